@@ -0,0 +1,395 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "bf.h"
+
+#define DEFAULT_REPEAT			3
+#define DEFAULT_THRESHOLD		10			// Percents an execution may slow down before it's a regression
+#define MAX_BENCHMARKS			128
+#define MAX_NAME				64
+
+typedef struct {
+	char *source;
+	size_t length;
+} Source;
+
+typedef struct {
+	const char *name;
+	const char *input;
+	void (*generate)(Source *source);	// NULL for the samples, which are read from the samples directory
+} Program;
+
+typedef struct {
+	char program[MAX_NAME];
+	char engine[MAX_NAME];
+	uint8_t optimizationLevel;
+
+	uint64_t parseNs, optimizeNs, executeNs;
+	uint64_t steps;
+	size_t sourceBytes, instructions;
+	size_t tapeUsed;					// Cells up to the last non-zero one when the program ends
+	size_t outputBytes;
+	uint8_t error;
+} Result;
+
+typedef struct {
+	const char *data;
+	size_t length, used;
+} Input;
+
+#pragma region Synthetic programs
+
+static void Append(Source *source, const char *text, size_t count) {
+	size_t length = strlen(text);
+	source->source = realloc(source->source, source->length + length * count + 1);
+
+	for(size_t i = 0; i < count; ++i, source->length += length) {
+		memcpy(source->source + source->length, text, length);
+	}
+	source->source[source->length] = 0;
+}
+
+// 7 levels of loops that run 10 times each, 10^7 iterations of the innermost body
+static void GenerateNestedLoops(Source *source) {
+	for(int level = 0; level < 7; ++level) Append(source, "++++++++++[>", 1);
+	Append(source, "+>+<", 1);
+	for(int level = 0; level < 7; ++level) Append(source, "<-]", 1);
+}
+
+// Scans back and forth over 20000 non-zero cells, 200 times
+static void GenerateLongScans(Source *source) {
+	Append(source, ">", 1);
+	Append(source, "+>", 20000);
+	Append(source, ">", 1);
+	Append(source, "+", 200);
+	Append(source, "[<<[<]>[>]>-]", 1);
+}
+
+// Prints 16^5 bytes
+static void GenerateHeavyOutput(Source *source) {
+	Append(source, "+++++++++++++++++++++++++++++++++", 1);
+	for(int level = 0; level < 5; ++level) Append(source, ">++++++++++++++++[", 1);
+	Append(source, "<<<<<.>>>>>-", 1);
+	for(int level = 0; level < 4; ++level) Append(source, "]<-", 1);
+	Append(source, "]", 1);
+}
+
+/*
+ * A few megabytes of straight line code and short loops that always end, mostly exercises the parser and optimizer.
+ * Every fragment returns to the cell it started on, so the program never leaves the memory.
+ */
+static void GenerateHugeSource(Source *source) {
+	static const char *fragments[] = {
+		"+++", "--", ">>+<<", ">-<", "[-]", "[->+<]", "[->>+<<]", ">[-<+>]<", ".", "+>+>+<<", "comment ",
+	};
+	const size_t count = sizeof fragments / sizeof fragments[0];
+
+	uint32_t seed = 12345;
+	for(size_t i = 0; i < 600000; ++i) {
+		seed = seed * 1103515245 + 12345;
+		Append(source, fragments[(seed >> 16) % count], 1);
+	}
+}
+
+#pragma endregion
+
+static const Program gPrograms[] = {
+	{ "hello", "" },
+	{ "simple", "" },
+	{ "test", "" },
+	{ "rot14", "Hello, World! The quick brown fox jumps over the lazy dog.\n" },
+	{ "conway", "bb\nbc\nbd\n\n\nq\n" },
+	// e.bf prints the digits of e forever, so it can't be timed to completion
+
+	{ "nested-loops", "", &GenerateNestedLoops },
+	{ "long-scans", "", &GenerateLongScans },
+	{ "heavy-output", "", &GenerateHeavyOutput },
+	{ "huge-source", "", &GenerateHugeSource },
+
+	{ NULL }
+};
+
+static const struct {
+	const char *name;
+	BF_Engine engine;
+} gEngines[] = {
+	{ "interpreter", BF_ENGINE_INTERPRETER },
+	{ "threaded", BF_ENGINE_THREADED },
+	{ "jit", BF_ENGINE_JIT },
+	{ "hot", BF_ENGINE_HOT },
+};
+
+static const uint8_t gOptimizationLevels[] = { BF_OPT_NONE, BF_OPT_MIN, BF_OPT_MAX };
+
+#define LENGTH(array)	(sizeof (array) / sizeof (array)[0])
+
+static uint64_t Now(void) {
+	struct timespec now;
+#if defined(_WIN32)
+	timespec_get(&now, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int64_t ReadInput(void *handle, char *data, size_t length) {
+	Input *input = handle;
+	if (length > input->length - input->used) length = input->length - input->used;
+
+	memcpy(data, input->data + input->used, length);
+	input->used += length;
+	return length;
+}
+
+static int64_t CountOutput(void *handle, char *data, size_t length) {
+	*(size_t *)handle += length;
+	return length;
+}
+
+static bool LoadSample(const char *directory, const char *name, Source *source) {
+	char path[512];
+	snprintf(path, sizeof path, "%s/%s.bf", directory, name);
+
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+
+	fseek(file, 0, SEEK_END);
+	source->length = ftell(file);
+	rewind(file);
+
+	source->source = malloc(source->length + 1);
+	source->length = fread(source->source, 1, source->length, file);
+	fclose(file);
+	return true;
+}
+
+static size_t TapeUsed(const BF_SimulationContext *sim) {
+	size_t used = sim->memory.length;
+	while(used > 0 && !sim->memory.buffer[used - 1]) --used;
+
+	return used;
+}
+
+// Parses and optimizes the source, keeping the fastest of every phase
+static BF_Context *Prepare(const Source *source, uint8_t optimizationLevel, int repeat, Result *result) {
+	BF_Context *ctx = NULL;
+	result->parseNs = result->optimizeNs = UINT64_MAX;
+
+	for(int i = 0; i < repeat; ++i) {
+		if (ctx) BF_FreeContext(ctx);
+
+		uint64_t start = Now();
+		ctx = BF_FromSource(source->source, source->length, NULL);
+		uint64_t parsed = Now();
+		if (!ctx) return NULL;
+
+		BF_Optimize(ctx, optimizationLevel);
+		uint64_t optimized = Now();
+
+		if (parsed - start < result->parseNs) result->parseNs = parsed - start;
+		if (optimized - parsed < result->optimizeNs) result->optimizeNs = optimized - parsed;
+	}
+
+	result->instructions = ctx->length;
+	return ctx;
+}
+
+static void Execute(BF_Context *ctx, const Program *program, BF_Engine engine, int repeat, Result *result) {
+	result->executeNs = UINT64_MAX;
+
+	for(int i = 0; i < repeat; ++i) {
+		Input input = { .data = program->input, .length = strlen(program->input) };
+		size_t output = 0;
+
+		BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+		BF_SetIO(sim, &ReadInput, &input, &CountOutput, &output, 0);
+
+		uint64_t start = Now();
+		uint64_t steps = BF_RunEngine(sim, engine);
+		BF_FlushOutput(sim);
+		uint64_t elapsed = Now() - start;
+
+		if (elapsed < result->executeNs) result->executeNs = elapsed;
+		result->steps = steps;
+		result->error = sim->error;
+		result->tapeUsed = TapeUsed(sim);
+		result->outputBytes = output;
+
+		BF_FreeSimulation(sim);
+	}
+}
+
+// Every result takes a single line, so a previous report can be read back by Compare
+static void WriteResult(FILE *file, const Result *result, bool last) {
+	fprintf(file,
+		"\t\t{ \"program\": \"%s\", \"engine\": \"%s\", \"opt\": %u, "
+		"\"parse_ns\": %llu, \"optimize_ns\": %llu, \"execute_ns\": %llu, "
+		"\"steps\": %llu, \"ns_per_step\": %.3f, \"source_bytes\": %zu, \"instructions\": %zu, "
+		"\"tape_used\": %zu, \"output_bytes\": %zu, \"error\": %u }%s\n",
+		result->program, result->engine, result->optimizationLevel,
+		(unsigned long long)result->parseNs, (unsigned long long)result->optimizeNs, (unsigned long long)result->executeNs,
+		(unsigned long long)result->steps, result->steps ? (double)result->executeNs / result->steps : 0.0,
+		result->sourceBytes, result->instructions, result->tapeUsed, result->outputBytes, result->error,
+		last ? "" : ",");
+}
+
+static bool WriteReport(const char *path, const Result *results, size_t count) {
+	FILE *file = fopen(path, "w");
+	if (!file) return false;
+
+	fprintf(file, "{\n\t\"results\": [\n");
+	for(size_t i = 0; i < count; ++i) WriteResult(file, &results[i], i + 1 == count);
+	fprintf(file, "\t]\n}\n");
+
+	fclose(file);
+	return true;
+}
+
+static const Result *FindResult(const Result *results, size_t count, const char *program, const char *engine, unsigned opt) {
+	for(size_t i = 0; i < count; ++i) {
+		if (strcmp(results[i].program, program) == 0 && strcmp(results[i].engine, engine) == 0 &&
+			results[i].optimizationLevel == opt)
+			return &results[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Flags every result that executes more than threshold percents slower than in the baseline report,
+ * or that ends with different steps or output. Returns the number of regressions.
+ */
+static size_t Compare(const char *path, const Result *results, size_t count, unsigned threshold) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		printf("Failed to open baseline %s\n", path);
+		return 1;
+	}
+
+	size_t regressions = 0;
+	char line[1024], program[MAX_NAME], engine[MAX_NAME];
+	unsigned opt;
+	unsigned long long executeNs, steps;
+	size_t outputBytes;
+
+	while(fgets(line, sizeof line, file)) {
+		const char *entry = strstr(line, "{ \"program\"");
+		if (!entry) continue;
+
+		if (sscanf(entry, "{ \"program\": \"%63[^\"]\", \"engine\": \"%63[^\"]\", \"opt\": %u, ", program, engine, &opt) != 3)
+			continue;
+
+		const char *field;
+		if (!(field = strstr(entry, "\"execute_ns\": ")) || sscanf(field, "\"execute_ns\": %llu", &executeNs) != 1) continue;
+		if (!(field = strstr(entry, "\"steps\": ")) || sscanf(field, "\"steps\": %llu", &steps) != 1) continue;
+		if (!(field = strstr(entry, "\"output_bytes\": ")) || sscanf(field, "\"output_bytes\": %zu", &outputBytes) != 1) continue;
+
+		const Result *result = FindResult(results, count, program, engine, opt);
+		if (!result) continue;
+
+		if (result->steps != steps || result->outputBytes != outputBytes) {
+			printf("CHANGED    %-14s %-12s opt %u: %llu -> %llu steps, %zu -> %zu output bytes\n", program, engine, opt,
+				steps, (unsigned long long)result->steps, outputBytes, result->outputBytes);
+			++regressions;
+		}
+
+		if (result->executeNs * 100 > executeNs * (100 + threshold)) {
+			printf("REGRESSION %-14s %-12s opt %u: %.3fms -> %.3fms (+%.1f%%)\n", program, engine, opt,
+				executeNs / 1e6, result->executeNs / 1e6, 100.0 * result->executeNs / executeNs - 100);
+			++regressions;
+		}
+	}
+
+	fclose(file);
+	return regressions;
+}
+
+static void Usage(void) {
+	printf("Usage: bf-bench [--out <report.json>] [--compare <baseline.json>] [--threshold <percents>]\n"
+		"                [--repeat <count>] [--samples <directory>] [--filter <program>]\n");
+}
+
+int main(int argc, char *argv[]) {
+	const char *out = "bench.json", *baseline = NULL, *samples = BF_SAMPLES_DIR, *filter = NULL;
+	unsigned threshold = DEFAULT_THRESHOLD;
+	int repeat = DEFAULT_REPEAT;
+
+	for(int i = 1; i < argc; ++i) {
+		bool hasValue = i + 1 < argc;
+
+		if (hasValue && strcmp(argv[i], "--out") == 0) out = argv[++i];
+		else if (hasValue && strcmp(argv[i], "--compare") == 0) baseline = argv[++i];
+		else if (hasValue && strcmp(argv[i], "--threshold") == 0) threshold = atoi(argv[++i]);
+		else if (hasValue && strcmp(argv[i], "--repeat") == 0) repeat = atoi(argv[++i]);
+		else if (hasValue && strcmp(argv[i], "--samples") == 0) samples = argv[++i];
+		else if (hasValue && strcmp(argv[i], "--filter") == 0) filter = argv[++i];
+		else return Usage(), 1;
+	}
+	if (repeat < 1) repeat = 1;
+
+	static Result results[MAX_BENCHMARKS];
+	size_t count = 0;
+
+	printf("%-14s %-12s %3s %10s %10s %12s %12s %9s %8s\n",
+		"program", "engine", "opt", "parse ms", "opt ms", "execute ms", "steps", "ns/step", "insts");
+
+	for(const Program *program = gPrograms; program->name; ++program) {
+		if (filter && strcmp(filter, program->name) != 0) continue;
+
+		Source source = { NULL, 0 };
+		if (program->generate) (*program->generate)(&source);
+		else if (!LoadSample(samples, program->name, &source)) {
+			printf("Failed to load sample %s from %s\n", program->name, samples);
+			continue;
+		}
+
+		for(size_t level = 0; level < LENGTH(gOptimizationLevels); ++level) {
+			Result prepared = { .optimizationLevel = gOptimizationLevels[level], .sourceBytes = source.length };
+			snprintf(prepared.program, MAX_NAME, "%s", program->name);
+
+			BF_Context *ctx = Prepare(&source, prepared.optimizationLevel, repeat, &prepared);
+			if (!ctx) {
+				printf("Failed to parse %s\n", program->name);
+				break;
+			}
+
+			for(size_t engine = 0; engine < LENGTH(gEngines) && count < MAX_BENCHMARKS; ++engine) {
+				Result *result = &results[count++];
+				*result = prepared;
+				snprintf(result->engine, MAX_NAME, "%s", gEngines[engine].name);
+
+				Execute(ctx, program, gEngines[engine].engine, repeat, result);
+
+				printf("%-14s %-12s %3u %10.3f %10.3f %12.3f %12llu %9.3f %8zu%s\n",
+					result->program, result->engine, result->optimizationLevel,
+					result->parseNs / 1e6, result->optimizeNs / 1e6, result->executeNs / 1e6,
+					(unsigned long long)result->steps, result->steps ? (double)result->executeNs / result->steps : 0.0,
+					result->instructions, result->error ? " (error)" : "");
+				fflush(stdout);
+			}
+
+			BF_FreeContext(ctx);
+		}
+
+		free(source.source);
+	}
+
+	if (!WriteReport(out, results, count)) {
+		printf("Failed to write %s\n", out);
+		return 1;
+	}
+	printf("Results written to %s\n", out);
+
+	if (!baseline) return 0;
+
+	size_t regressions = Compare(baseline, results, count, threshold);
+	printf("%zu regressions against %s\n", regressions, baseline);
+	return regressions ? 2 : 0;
+}
@@ -17,8 +17,8 @@ typedef enum {
 	BF_DEC,
 	__BF_AGGREGATABLE_END__,
 	
-	BF_PRT,
-	BF_INP,
+	BF_PRT,			// Print cell[dp + (int32_t)operand2]
+	BF_INP,			// Read into cell[dp + (int32_t)operand2]
 	BF_LBL,
 	BF_RPT,
 
@@ -33,20 +33,58 @@ typedef enum {
 
 	BF_WHILE,		// While loop
 	BF_WHILE_END,	// While loop end
+
+	BF_MUL,			// Multiply accumulate, cell[dp + (int32_t)operand2] += cell[dp] * operand1
+	BF_SCANL,		// Move left by operand1 until the current cell is 0
+	BF_SCANR,		// Move right by operand1 until the current cell is 0
+
+	BF_WRITE,		// Write data[operand1] to the output
+	BF_FILL,		// Copy data[operand1] into cell[dp], cell[dp + 1], ...
+	BF_COUNT,		// Replace cell[dp] with the times adding operand1 takes to bring it to 0, forever if it never gets there
+
+	__BF_OPERATION_COUNT__
 } BF_Operation;
 
+#define BF_CELL_MASK(size)	((uint32_t)(((uint64_t)1 << 8 * (size)) - 1))	// Of a cell of size bytes (1, 2 or 4)
+
 #define BF_OPT_NONE		0
 #define BF_OPT_MIN		1
-#define BF_OPT_MAX		3
+#define BF_OPT_MAX		2
 
 #define BF_FLAG_GENERATE_SUDO		BIT(1)
 #define BF_FLAG_DEBUG				BIT(2)	
+#define BF_FLAG_GENERATE_C			BIT(3)
+#define BF_FLAG_PROFILE				BIT(4)
+#define BF_FLAG_COMPILE				BIT(5)
+#define BF_FLAG_TIERED				BIT(6)
+
+typedef enum {
+	BF_ENGINE_INTERPRETER = 0,		// Switch based interpreter (BF_Run)
+	BF_ENGINE_THREADED,				// Pre-decoded direct threaded code (BF_RunThreaded)
+	BF_ENGINE_JIT,					// Native x86-64 code (BF_RunJit), falls back to BF_ENGINE_THREADED
+	BF_ENGINE_HOT,					// Interpreter that compiles its hot loops (BF_RunHot), falls back to BF_ENGINE_INTERPRETER
+} BF_Engine;
+
+#define BF_FIXED_TAPE_LENGTH	32768	// Cells of a fixed tape, whole pages (of 4 or 16 KiB) in any cell size, so guarding it keeps its length
+
+typedef enum {
+	BF_TAPE_FIXED = 0,				// BF_FIXED_TAPE_LENGTH cells from cell 0, guarded when possible
+	BF_TAPE_GROWABLE,				// Contiguous, grows in both directions as it's accessed
+	BF_TAPE_SPARSE,					// Pages allocated as they're accessed, in both directions
+} BF_Tape;
 
 typedef struct {
 	char *source;
 	char *output;
 	uint8_t optimizationLevel;
 	uint16_t flags;
+	BF_Engine engine;
+	uint8_t ioFlags;
+	char *batch;			// Directory or manifest of the inputs to run the program on
+	unsigned threads;		// Of the batch, 0 for one on every CPU
+	char *cache;			// Directory of the compiled sources, "off" for none, NULL for the default one
+	uint8_t cellSize;		// Bytes of every cell
+	BF_Tape tape;
 } BF_Argv;
 
 uint8_t IsAggregatableOpcode(char op);
@@ -58,27 +96,142 @@ typedef struct {
 	BF_Operation type;
 	uint32_t operand1;
 	uint32_t operand2;
+	uint32_t position;		// Byte offset in the source of the command it was built from (the ] for loop ends)
 } BF_Instruction;
 
+typedef struct {
+	char *bytes;
+	size_t length;
+} BF_Data;
+
 typedef struct {
 	BF_Instruction *instructions;
 	size_t length;
+
+	BF_Data *data;			// Constant bytes of the WRITE and FILL instructions (FILL holds whole cells)
+	size_t dataLength;
+	uint8_t cellSize;		// Bytes of every cell (1, 2 or 4), set before optimizing
+
+	char *image;			// Compiled file the instructions and data are mapped from, NULL when they are allocated
+	size_t imageLength;
 } BF_Context;
 
-BF_Context *BF_FromFile(void *handle);
-BF_Context *BF_Open(char *source);
+typedef enum {
+	BF_LOAD_OK = 0,
+	BF_LOAD_IO_ERROR,
+	BF_LOAD_OUT_OF_MEMORY,
+	BF_LOAD_UNMATCHED_OPEN,		// A [ that is never closed
+	BF_LOAD_UNMATCHED_CLOSE,	// A ] without a [
+} BF_LoadStatus;
+
+typedef struct {
+	BF_LoadStatus code;
+	size_t offset;				// Byte offset in the source of the bracket (or read) that failed
+} BF_LoadError;
+
+// All of them return NULL on failure, and describe the failure in error (which may be NULL)
+BF_Context *BF_FromSource(const char *source, size_t length, BF_LoadError *error);
+BF_Context *BF_FromFile(void *handle, BF_LoadError *error);
+BF_Context *BF_Open(const char *source, BF_LoadError *error);		// Maps the file when possible
+const char *BF_LoadErrorMessage(const BF_LoadError *error);
 
 char *BF_Export(BF_Context *context);
+char *BF_ExportC(BF_Context *context);		// NULL if the program can't be expressed as structured C
 
 void BF_FreeContext(BF_Context *context);
 
+/*
+ * Compiled contexts (.bfc files). The key ties a compiled file to the source, optimization level and optimizer
+ * it was made from, a file saved with BF_COMPILED_ANY_KEY (or loaded with it) is used whatever the source is.
+ */
+#define BF_COMPILED_VERSION		2
+#define BF_OPTIMIZER_VERSION	3		// Bump with every change to what the optimizer outputs
+#define BF_COMPILED_ANY_KEY		0
+
+uint64_t BF_SourceKey(const char *source, size_t length, uint8_t optimizationLevel, uint8_t cellSize);
+bool BF_SaveCompiled(const BF_Context *context, uint64_t key, const char *path);
+BF_Context *BF_LoadCompiled(const char *path, uint64_t key);	// NULL if it can't be read, is stale or damaged
+void BF_DetachCompiled(BF_Context *context);	// Copies a loaded context out of its file, so it can be changed
+void BF_ReleaseCompiled(BF_Context *context);	// Unmaps the file, leaving the context without instructions
+char *BF_DefaultCacheDirectory(void);			// Freed by the caller, NULL if there is no home directory
+
+// BF_Open and BF_Optimize, skipped when the directory (which may be NULL) has the source compiled already
+BF_Context *BF_OpenCached(const char *source, uint8_t optimizationLevel, uint8_t cellSize, const char *directory,
+	BF_LoadError *error);
+
+/*
+ * Compact execution format, every instruction is a 4 byte slot:
+ *	opcode		The BF_Operation, with BF_PACKED_WIDE when the operand doesn't fit in 16 bits and takes the next slot,
+ *				and BF_PACKED_LONG when the value doesn't fit in 8 bits and takes the slot after it (wide cells only)
+ *	value		Immediate (mod the cell), sign extended to the cell, decrements are stored as additions
+ *	operand		Signed move, cell offset or stride, the jump distance in slots, or the index of the data
+ */
+#define BF_PACKED_WIDE		0x80
+#define BF_PACKED_LONG		0x40
+
+typedef union {
+	struct {
+		uint8_t opcode;
+		int8_t value;
+		int16_t operand;
+	};
+	int32_t wide;			// Operand or value of a previous slot
+} BF_PackedOp;
+
+typedef struct {
+	BF_PackedOp *code;
+	size_t length;			// In slots
+	uint32_t *origin;		// Index of the instruction every slot was packed from
+	size_t instructions;	// Length of the context it was packed from
+	uint8_t cellSize;		// Of the context it was packed from
+} BF_PackedProgram;
+
+BF_PackedProgram *BF_Pack(const BF_Context *context);		// NULL if an operand doesn't fit in 32 bits
+BF_Context *BF_Unpack(const BF_PackedProgram *program);
+void BF_FreePacked(BF_PackedProgram *program);
+
 void BF_FlattenProgram(BF_Instruction *array, size_t *sl);
+void BF_CompactProgram(BF_Instruction *array, size_t *length, bool *marks);	// Flatten, and move the marks along
 void BF_PassiveErase(BF_Instruction *start, size_t len);
 
-#define CTX_MEMORY_SCALABLE		BIT(0)
+#define CTX_MEMORY_SCALABLE		BIT(0)	// Grows in both directions, moving the buffer
+#define CTX_MEMORY_GUARDED		BIT(1)	// Surrounded by PROT_NONE guards, accesses don't need bounds checks
+#define CTX_MEMORY_PAGED		BIT(2)	// The buffer is the page of the tape that was accessed last
 
 int32_t BF_SumMotion(BF_Instruction *array, size_t start, size_t len, bool *unpredictable);
-int32_t BF_CellDelta(BF_Instruction *origin, size_t cell, size_t start, size_t len, bool *unpredictable);
+int32_t BF_CellDelta(BF_Instruction *origin, int64_t cell, size_t start, size_t len, bool *unpredictable);
+uint32_t BF_InverseOf(uint32_t value);		// Multiplicative inverse of an odd value, mod 2^32
+bool BF_CountIterations(uint32_t cell, uint32_t step, uint8_t cellSize, uint32_t *iterations);	// False if it never ends
+
+#define BF_IO_LINE_BUFFERED		BIT(0)	// Flush the output on every new line
+#define BF_IO_INTERACTIVE		BIT(1)	// Flush the output on every byte
+#define BF_IO_PENDING			(-2)	// From an input handler that has nothing yet (and BF_ReadInput), the run waits for it
+
+typedef int64_t (*BF_IOHandler)(void *handle, char *data, size_t length);
+
+typedef struct {
+	BF_IOHandler handler;
+	void *handle;
+
+	char *buffer;
+	size_t used;		// Output: bytes waiting to be written, Input: bytes already consumed
+	size_t length;		// Input: bytes available in the buffer, Output: bytes written to the span
+	size_t capacity;
+
+	bool span;			// The buffer is memory of the caller, read or written in place
+	char *storage;		// Buffer of the stream itself
+	size_t storageCapacity;
+} BF_IOStream;
+
+#define BF_MESSAGE_LENGTH		128
+
+typedef struct BF_PageTable BF_PageTable;
+
+typedef enum {
+	BF_RUN_READY = 0,		// Didn't end yet, the next run goes on from ip
+	BF_RUN_WAITING,			// Stopped on an input that is pending, which is read again when the run goes on
+	BF_RUN_ENDED,			// Ran to the end of the program, or failed
+} BF_RunState;
 
 typedef struct {
 	BF_Context *context;
@@ -86,11 +239,21 @@ typedef struct {
 	size_t dp;
 	size_t ip;
 	uint8_t error;
+	char message[BF_MESSAGE_LENGTH];	// What the error was, simulations don't print anything themselves
+	uint32_t scratch;					// Target of the accesses that failed
+	BF_RunState state;
+	BF_PackedProgram *packed;			// Kept between the slices of BF_RunFor
+	BF_Context *tiered;					// Optimized by BF_RunTiered, the context once the run moved to it
 
 	struct {
 		char *buffer;
-		size_t length;
+		size_t length;		// In cells
+		size_t guard;		// Size of the guard on each side of the buffer
+		size_t reserved;	// Bytes reserved for the buffer to grow into
 		uint8_t flags;
+		uint8_t cellSize;	// Bytes of every cell, the buffer holds length * cellSize bytes
+		int64_t origin;		// Cell of the tape at the start of the buffer, moves as the buffer does
+		BF_PageTable *pages;	// Paged memories only
 	} memory;
 
 	struct {
@@ -98,11 +261,176 @@ typedef struct {
 		size_t used;
 		size_t allocated;
 	} stack;
+
+	struct {
+		BF_IOStream input, output;
+		uint8_t flags;
+	} io;
 } BF_SimulationContext;
 
+size_t BF_GuardSize(const BF_Context *ctx);
+bool BF_AllocateMemory(BF_SimulationContext *sim, size_t length, size_t guard);	// Guarded if possible when guard > 0
+bool BF_ReachMemory(BF_SimulationContext *sim, int32_t shift);	// Moves the buffer (and dp) to cover dp + shift
+void BF_ClearMemory(BF_SimulationContext *sim);					// Zeroes every cell and moves dp back to cell 0
+void BF_FreeMemory(BF_SimulationContext *sim);
+
+#define BF_TAPE_ALIGNMENT	(64 * 1024)		// Of the segments of an image, so they can be mapped with any page size
+
+typedef struct {
+	int64_t cell;			// First cell of the tape it holds
+	uint64_t length;		// In cells
+	uint64_t offset;		// Of its bytes in the cells of the image
+} BF_TapeSegment;
+
+/*
+ * The cells of a memory apart from its simulation, one segment for every page of a paged memory and a single
+ * one otherwise. They are in a file from base on (mapped copy on write by the memories restored from them),
+ * or in bytes where there is no file.
+ */
+typedef struct {
+	BF_TapeSegment *segments;
+	size_t length;
+	uint64_t size;			// Bytes of the cells
+	int descriptor;			// -1 for none
+	uint64_t base;
+	char *bytes;
+} BF_TapeImage;
+
+bool BF_CaptureTape(const BF_SimulationContext *sim, BF_TapeImage *image);
+bool BF_RestoreTape(BF_SimulationContext *sim, const BF_TapeImage *image, int64_t cell);	// dp goes to cell, the memory is cleared on failure
+bool BF_ReadTape(const BF_TapeImage *image, void *bytes, uint64_t length, uint64_t offset);
+void BF_FreeTape(BF_TapeImage *image);
+
+// Index of the first zero cell in steps of stride from dp, or the first index out of the memory (>= length)
+size_t BF_ScanLeft(const char *memory, size_t length, size_t dp, uint32_t stride);
+size_t BF_ScanRightWide(const char *memory, size_t length, size_t dp, uint32_t stride, uint8_t cellSize);
+size_t BF_ScanLeftWide(const char *memory, size_t length, size_t dp, uint32_t stride, uint8_t cellSize);
+size_t BF_ScanRight(const char *memory, size_t length, size_t dp, uint32_t stride);
+
+/*
+ * Called (from the signal handler) when a guarded memory is accessed out of range, on the thread that accessed it.
+ * Returns false if the fault can't be recovered from.
+ */
+typedef bool (*BF_FaultRecovery)(void *argument, void *ucontext);
+void BF_SetFaultRecovery(BF_FaultRecovery recovery, void *argument);
+
 BF_SimulationContext *BF_CreateSimulation(BF_Context *ctx);
+bool BF_UseTape(BF_SimulationContext *sim, BF_Tape tape);	// Replaces the memory of a simulation that didn't run yet
 void BF_FreeSimulation(BF_SimulationContext *ctx);
 
+int64_t BF_ReadDescriptor(void *handle, char *data, size_t length);
+int64_t BF_WriteDescriptor(void *handle, char *data, size_t length);
+
+// NULL handlers read EOF and drop the output
+void BF_SetIO(BF_SimulationContext *sim, BF_IOHandler read, void *input, BF_IOHandler write, void *output, uint8_t flags);
+void BF_SetIODescriptors(BF_SimulationContext *sim, int input, int output, uint8_t flags);
+
+/*
+ * Spans are memory of the caller that the runs read from or write to in place, they must outlive the runs.
+ * The input ends (EOF) after length bytes, and the output past capacity is dropped, io.output.length bytes
+ * of the span were written.
+ */
+void BF_SetInputSpan(BF_SimulationContext *sim, const char *input, size_t length);
+void BF_SetOutputSpan(BF_SimulationContext *sim, char *output, size_t capacity);
+void BF_FlushOutput(BF_SimulationContext *sim);
+void BF_WriteOutput(BF_SimulationContext *sim, const char *data, size_t length);
+int BF_ReadInput(BF_SimulationContext *sim);		// EOF when there is no more input
+void BF_FreeIO(BF_SimulationContext *sim);
+
+/*
+ * Every engine goes on from ip, where the last run of the simulation stopped, and sets its state. A run that
+ * waits for input is resumed by running it again, and one that ended doesn't run anything.
+ */
 uint64_t BF_Run(BF_SimulationContext *sim);
+uint64_t BF_RunPacked(BF_SimulationContext *sim, const BF_PackedProgram *program);
+uint64_t BF_RunThreaded(BF_SimulationContext *sim);
+uint64_t BF_RunEngine(BF_SimulationContext *sim, BF_Engine engine);
+uint64_t BF_RunFor(BF_SimulationContext *sim, uint64_t maxSteps);	// On the interpreter, ready to go on after maxSteps
+
+/*
+ * Runs the (unoptimized) context right away while a copy of it is optimized in the background, and moves to
+ * the copy at the next loop head it reaches once it's ready. The simulation owns the copy from then on.
+ */
+uint64_t BF_RunTiered(BF_SimulationContext *sim, uint8_t optimizationLevel);
+
+/*
+ * Round robin of many simulations over a few threads, slice steps at a time. The simulations stay the caller's,
+ * and must not be touched while they are scheduled. The ones that wait for input are parked until a wake.
+ */
+typedef struct BF_Scheduler BF_Scheduler;
+
+BF_Scheduler *BF_CreateScheduler(unsigned threads, uint64_t slice);		// 0 threads for one on every CPU
+void BF_Schedule(BF_Scheduler *scheduler, BF_SimulationContext *sim);	// Runs it until it ends or waits for input
+void BF_WakeScheduler(BF_Scheduler *scheduler);		// Input may have arrived, every waiting simulation tries again
+void BF_WaitScheduler(BF_Scheduler *scheduler);		// Until every simulation ended or waits for input
+void BF_FreeScheduler(BF_Scheduler *scheduler);		// Waits, then stops the threads
+
+/*
+ * The state of a simulation (memory, dp, ip and stack) at some point of its run, to start others of the same
+ * program from, such as after it built its tables and before it reads anything. The simulations started from
+ * it share its cells copy on write where the tape allows it. A saved snapshot is restored from the file.
+ */
+typedef struct BF_Snapshot BF_Snapshot;
+
+BF_Snapshot *BF_TakeSnapshot(const BF_SimulationContext *sim);		// NULL if the memory can't be copied
+BF_SimulationContext *BF_ForkSnapshot(const BF_Snapshot *snapshot, BF_Context *ctx);	// NULL if ctx isn't its program
+bool BF_RestoreSnapshot(BF_SimulationContext *sim, const BF_Snapshot *snapshot);		// False if it's of another program
+bool BF_SaveSnapshot(const BF_Snapshot *snapshot, const char *path);
+BF_Snapshot *BF_LoadSnapshot(const char *path);		// NULL if it can't be read or is damaged
+void BF_FreeSnapshot(BF_Snapshot *snapshot);
+
+typedef struct {
+	const char *input;		// Read by the program, which gets EOF after inputLength bytes
+	size_t inputLength;
+
+	char *output;			// Everything the program wrote, freed by the caller
+	size_t outputLength;
+	uint64_t steps;
+	uint8_t error;
+	char message[BF_MESSAGE_LENGTH];
+} BF_BatchJob;
+
+// Runs every job on its own simulation of the context, on up to threads threads (0 for one on every CPU)
+void BF_RunBatch(BF_Context *context, BF_BatchJob *jobs, size_t count, BF_Engine engine, BF_Tape tape, unsigned threads);
+
+typedef struct {
+	uint64_t entries;		// Times the loop was entered from outside
+	uint64_t iterations;	// Times its body ran
+} BF_LoopProfile;
+
+typedef struct {
+	size_t length;				// Of the profiled context
+	uint64_t *hits;				// Times every instruction ran
+	BF_LoopProfile *loops;		// At the index of every LBL / WHILE
+} BF_Profile;
+
+BF_Profile *BF_CreateProfile(const BF_Context *ctx);
+uint64_t BF_RunProfiled(BF_SimulationContext *sim, BF_Profile *profile);	// BF_Run, counting into the profile
+void BF_PrintProfile(const BF_Profile *profile, const BF_Context *ctx, void *handle, size_t top);	// Into a FILE *
+void BF_FreeProfile(BF_Profile *profile);
+
+char *BF_ReadMemory(BF_SimulationContext *sim, int32_t shift);
+
+typedef struct BF_JitProgram BF_JitProgram;
+
+BF_JitProgram *BF_JitCompile(const BF_Context *ctx, uint8_t memoryFlags);	// NULL if the program or the platform is not supported
+uint64_t BF_JitRun(BF_JitProgram *program, BF_SimulationContext *sim);
+
+/*
+ * A single loop, from its opener to its closer, for an interpreter to jump into once the loop got hot.
+ * It runs from the opener with the dp of the simulation, and leaves ip after the closer (or where it stopped),
+ * the output is left buffered for the interpreter.
+ */
+BF_JitProgram *BF_JitCompileLoop(const BF_Context *ctx, size_t opener, uint8_t memoryFlags);
+uint64_t BF_JitRunLoop(BF_JitProgram *program, BF_SimulationContext *sim);
+void BF_JitFree(BF_JitProgram *program);
+
+uint64_t BF_RunJit(BF_SimulationContext *sim);
+uint64_t BF_RunHot(BF_SimulationContext *sim);		// BF_Run, with the loops that got hot compiled
 
 void BF_OptimizeLevel1(BF_Context *context);
+void BF_OptimizeLevel2(BF_Context *context);
+void BF_Optimize(BF_Context *context, uint8_t level);
+
+bool BF_PropagateConstants(BF_Context *context);	// False if nothing changed
+bool BF_EvaluatePrefix(BF_Context *context, uint64_t budget);	// False if nothing changed
@@ -2,50 +2,279 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "bf.h"
 
+#define PROFILE_TOP_LOOPS		10
+#define BATCH_OUTPUT_EXTENSION	".out"
+#define COMPILED_EXTENSION		".bfc"
+
+static void WriteExport(BF_Argv *argv, const char *content, const char *extension) {
+	char outName[513];
+	strncpy(outName, argv->output ? argv->output : "", 512);
+
+	if (!argv->output) {
+		outName[0] = 0;
+		strncat(outName, argv->source, 512);
+		strncat(outName, extension, 512);
+	}
+	FILE *file = fopen(outName, "w+");
+	if(!file) printf("Failed to create file %s\n", outName), exit(1);
+
+	printf("Writing to file %s\n", outName);
+	fprintf(file, "%s", content);
+
+	fclose(file);
+}
+
+static char *ReadWholeFile(const char *path, size_t *length) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return NULL;
+
+	size_t allocated = 4096, used = 0, read;
+	char *content = malloc(allocated);
+	while ((read = fread(content + used, 1, allocated - used, file)) > 0) {
+		used += read;
+		if (used == allocated) content = realloc(content, allocated *= 2);
+	}
+
+	fclose(file);
+	*length = used;
+	return content;
+}
+
+static char *JoinPath(const char *directory, size_t length, const char *name) {
+	char *path = malloc(length + strlen(name) + 2);
+	sprintf(path, "%.*s/%s", (int)length, directory, name);
+	return path;
+}
+
+static bool EndsWith(const char *string, const char *suffix) {
+	size_t length = strlen(string), suffixLength = strlen(suffix);
+	return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
+
+static int ComparePaths(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * The inputs of a batch: every file in the directory (but hidden files and the outputs of a previous batch),
+ * or every line of the manifest, relative to the directory of the manifest.
+ */
+static char **ListInputs(const char *batch, size_t *count) {
+	struct stat info;
+	*count = 0;
+	if (stat(batch, &info)) return NULL;
+
+	size_t allocated = 64;
+	char **inputs;
+
+	if (S_ISDIR(info.st_mode)) {
+		DIR *directory = opendir(batch);
+		if (!directory) return NULL;
+
+		inputs = malloc(allocated * sizeof(char *));
+
+		for(struct dirent *entry; (entry = readdir(directory));) {
+			if (entry->d_name[0] == '.' || EndsWith(entry->d_name, BATCH_OUTPUT_EXTENSION)) continue;
+
+			char *path = JoinPath(batch, strlen(batch), entry->d_name);
+			if (stat(path, &info) || !S_ISREG(info.st_mode)) {
+				free(path);
+				continue;
+			}
+
+			if (*count == allocated) inputs = realloc(inputs, (allocated *= 2) * sizeof(char *));
+			inputs[(*count)++] = path;
+		}
+
+		closedir(directory);
+		qsort(inputs, *count, sizeof(char *), &ComparePaths);
+		return inputs;
+	}
+
+	size_t length;
+	char *manifest = ReadWholeFile(batch, &length);
+	if (!manifest) return NULL;
+
+	inputs = malloc(allocated * sizeof(char *));
+
+	const char *slash = strrchr(batch, '/');
+	size_t base = slash ? (size_t)(slash - batch) : 1;
+	const char *directory = slash ? batch : ".";
+
+	for(char *line = strtok(manifest, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+		if (*count == allocated) inputs = realloc(inputs, (allocated *= 2) * sizeof(char *));
+		inputs[(*count)++] = line[0] == '/' ? strdup(line) : JoinPath(directory, base, line);
+	}
+
+	free(manifest);
+	return inputs;
+}
+
+// Output of every input is written next to it, or in the --out directory
+static void WriteBatchOutput(BF_Argv *argv, const char *input, const BF_BatchJob *job) {
+	const char *name = strrchr(input, '/');
+	name = argv->output && name ? name + 1 : input;
+
+	char *path = argv->output ? JoinPath(argv->output, strlen(argv->output), name) : strdup(input);
+	path = realloc(path, strlen(path) + strlen(BATCH_OUTPUT_EXTENSION) + 1);
+	strcat(path, BATCH_OUTPUT_EXTENSION);
+
+	FILE *file = fopen(path, "wb");
+	if (!file) printf("Failed to create file %s\n", path);
+	else {
+		fwrite(job->output, 1, job->outputLength, file);
+		fclose(file);
+	}
+
+	free(path);
+}
+
+static void RunBatch(BF_Argv *argv, BF_Context *ctx) {
+	size_t count;
+	char **inputs = ListInputs(argv->batch, &count);
+	if (!inputs) printf("Failed to read the batch %s\n", argv->batch), exit(1);
+
+	BF_BatchJob *jobs = calloc(count + 1, sizeof(BF_BatchJob));
+	for(size_t i = 0; i < count; ++i) {
+		char *input = ReadWholeFile(inputs[i], &jobs[i].inputLength);
+		if (!input) printf("Failed to read %s\n", inputs[i]), exit(1);
+
+		jobs[i].input = input;
+	}
+
+	printf("Running program %s on %zu inputs\n", argv->source, count);
+	BF_RunBatch(ctx, jobs, count, argv->engine, argv->tape, argv->threads);
+
+	size_t failed = 0;
+	for(size_t i = 0; i < count; ++i) {
+		WriteBatchOutput(argv, inputs[i], &jobs[i]);
+
+		if (jobs[i].error) printf("%s: %s\n", inputs[i], jobs[i].message), ++failed;
+		else printf("%s: %llu steps\n", inputs[i], (unsigned long long)jobs[i].steps);
+
+		free((char *)jobs[i].input);
+		free(jobs[i].output);
+		free(inputs[i]);
+	}
+	printf("Batch finished (%zu of %zu runs got out with an error)\n", failed, count);
+
+	free(jobs);
+	free(inputs);
+}
+
+// Only a single run is tiered, what is written or batched is the optimized program
+static bool IsTiered(const BF_Argv *argv) {
+	return (argv->flags & BF_FLAG_TIERED) && !argv->batch &&
+		!(argv->flags & (BF_FLAG_COMPILE | BF_FLAG_GENERATE_C | BF_FLAG_GENERATE_SUDO));
+}
+
+// A compiled program as it is, a source from the cache (or loaded and optimized when it's not cached yet)
+static BF_Context *LoadContext(BF_Argv *argv) {
+	if (EndsWith(argv->source, COMPILED_EXTENSION)) {
+		BF_Context *ctx = BF_LoadCompiled(argv->source, BF_COMPILED_ANY_KEY);
+		if(!ctx) printf("%s: Not a program compiled by this version\n", argv->source), exit(1);
+
+		return ctx;
+	}
+
+	char *cache = NULL;
+	if (!argv->cache) cache = BF_DefaultCacheDirectory();
+	else if (strcmp(argv->cache, "off") != 0) cache = strdup(argv->cache);
+
+	// A tiered run optimizes the program while it runs
+	uint8_t level = IsTiered(argv) ? BF_OPT_NONE : argv->optimizationLevel;
+
+	BF_LoadError error;
+	BF_Context *ctx = BF_OpenCached(argv->source, level, argv->cellSize, cache, &error);
+	if(!ctx) printf("%s: %s at byte %zu\n", argv->source, BF_LoadErrorMessage(&error), error.offset), exit(1);
+
+	free(cache);
+	return ctx;
+}
+
+static void WriteCompiled(BF_Argv *argv, BF_Context *ctx) {
+	char *path = malloc(strlen(argv->output ? argv->output : argv->source) + sizeof(COMPILED_EXTENSION));
+	strcpy(path, argv->output ? argv->output : argv->source);
+	if (!argv->output) strcat(path, COMPILED_EXTENSION);
+
+	printf("Writing to file %s\n", path);
+	if(!BF_SaveCompiled(ctx, BF_COMPILED_ANY_KEY, path)) printf("Failed to create file %s\n", path), exit(1);
+
+	free(path);
+}
+
 int main(int argc, char *in_argv[]) {
 	BF_Argv argv;
 	BF_LoadArguments(argc, in_argv, &argv);
 
 	if(!argv.source) printf("No input file!\n"), exit(1);
 
-	BF_Context *ctx = BF_Open(argv.source);
-
-	if (argv.optimizationLevel >= 1)
-		BF_OptimizeLevel1(ctx);
+	BF_Context *ctx = LoadContext(&argv);
 
 	if(argv.flags & BF_FLAG_GENERATE_SUDO) {
 		char *sudo = BF_Export(ctx);
-		char outName[513];
-		strncpy(outName, argv.output ? argv.output : "", 512);
+		WriteExport(&argv, sudo, ".abf");
+		free(sudo);
+	}
 
-		if (!argv.output) {
-			outName[0] = 0;
-			strncat(outName, argv.source, 512);
-			strncat(outName, ".abf", 512);
-		}
-		FILE *file = fopen(outName, "w+");
-		if(!file) printf("Failed to create file %s\n", outName), exit(1);
+	if(argv.flags & BF_FLAG_GENERATE_C) {
+		char *code = BF_ExportC(ctx);
+		if(!code) exit(1);
 
-		printf("Writing to file %s\n", outName);
-		fprintf(file, "%s", sudo);
+		WriteExport(&argv, code, ".c");
+		free(code);
+	}
 
-		fclose(file);
-		free(sudo);
+	if(argv.flags & BF_FLAG_COMPILE) {
+		WriteCompiled(&argv, ctx);
+
+		BF_FreeContext(ctx);
+		BF_FreeArguments(&argv);
+		exit(0);
+	}
+
+	if(argv.batch) {
+		RunBatch(&argv, ctx);
+
+		BF_FreeContext(ctx);
+		BF_FreeArguments(&argv);
+		exit(0);
 	}
 
 	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	if(argv.tape != BF_TAPE_FIXED) BF_UseTape(sim, argv.tape);
+	BF_SetIODescriptors(sim, 0, 1, argv.ioFlags);
 	
 	printf("Running program %s\n", argv.source);
+	fflush(stdout);	// The program writes directly to the descriptor
+
+	BF_Profile *profile = NULL;
+	uint64_t steps;
+	if(argv.flags & BF_FLAG_PROFILE) {
+		profile = BF_CreateProfile(ctx);
+		steps = BF_RunProfiled(sim, profile);	// Always on the interpreter
+	} else if(IsTiered(&argv)) {
+		steps = BF_RunTiered(sim, argv.optimizationLevel);	// Always on the interpreter too
+	} else {
+		steps = BF_RunEngine(sim, argv.engine);
+	}
 
-	uint64_t steps = BF_Run(sim);
 	if(sim->error) {
+		printf("\n%s\n", sim->message);
 		printf("Got out with an error\n");
 	}
 
 	printf("Program finished (in %zu steps)\n", steps);
+	if(profile) {
+		fflush(stdout);
+		BF_PrintProfile(profile, ctx, stderr, PROFILE_TOP_LOOPS);
+		BF_FreeProfile(profile);
+	}
 	BF_FreeSimulation(sim);
 	BF_FreeContext(ctx);
 	BF_FreeArguments(&argv);
@@ -12,14 +12,27 @@ void HandleOutputArgument(BF_Argv *argv, char *arg) {
 	argv->output = strdup(arg);
 }
 
-void HandleGenerateArgument(BF_Argv *argv, char *_) {
-	argv->flags |= BF_FLAG_GENERATE_SUDO;
+void HandleGenerateArgument(BF_Argv *argv, char *arg) {
+	if (arg && strcmp(arg, "c") == 0) argv->flags |= BF_FLAG_GENERATE_C;
+	else argv->flags |= BF_FLAG_GENERATE_SUDO;
 }
 
 void HandleDebugArgument(BF_Argv *argv, char *_) {
 	argv->flags |= BF_FLAG_DEBUG;
 }
 
+void HandleProfileArgument(BF_Argv *argv, char *_) {
+	argv->flags |= BF_FLAG_PROFILE;
+}
+
+void HandleCompileArgument(BF_Argv *argv, char *_) {
+	argv->flags |= BF_FLAG_COMPILE;
+}
+
+void HandleTieredArgument(BF_Argv *argv, char *_) {
+	argv->flags |= BF_FLAG_TIERED;
+}
+
 void HandleOptimizationArgument(BF_Argv *argv, char *arg) {
 	if(!argv || !arg) return;
 
@@ -31,24 +44,100 @@ void HandleOptimizationArgument(BF_Argv *argv, char *arg) {
 	}
 };
 
+void HandleEngineArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	if (strcmp(arg, "interpreter") == 0) argv->engine = BF_ENGINE_INTERPRETER;
+	else if (strcmp(arg, "threaded") == 0) argv->engine = BF_ENGINE_THREADED;
+	else if (strcmp(arg, "jit") == 0) argv->engine = BF_ENGINE_JIT;
+	else if (strcmp(arg, "hot") == 0) argv->engine = BF_ENGINE_HOT;
+	else printf("Unknown engine %s, using interpreter\n", arg);
+}
+
+void HandleIOArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	if (strcmp(arg, "buffered") == 0) argv->ioFlags = 0;
+	else if (strcmp(arg, "line") == 0) argv->ioFlags = BF_IO_LINE_BUFFERED;
+	else if (strcmp(arg, "interactive") == 0) argv->ioFlags = BF_IO_INTERACTIVE;
+	else printf("Unknown io mode %s, using buffered\n", arg);
+}
+
+void HandleBatchArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	argv->batch = strdup(arg);
+}
+
+void HandleThreadsArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	argv->threads = strtoul(arg, NULL, 10);
+}
+
+void HandleCacheArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	argv->cache = strdup(arg);
+}
+
+void HandleCellBitsArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	if (strcmp(arg, "8") == 0) argv->cellSize = 1;
+	else if (strcmp(arg, "16") == 0) argv->cellSize = 2;
+	else if (strcmp(arg, "32") == 0) argv->cellSize = 4;
+	else printf("Unsupported cell width %s, using 8 bits\n", arg);
+}
+
+void HandleTapeArgument(BF_Argv *argv, char *arg) {
+	if(!argv || !arg) return;
+
+	if (strcmp(arg, "fixed") == 0) argv->tape = BF_TAPE_FIXED;
+	else if (strcmp(arg, "growable") == 0) argv->tape = BF_TAPE_GROWABLE;
+	else if (strcmp(arg, "sparse") == 0) argv->tape = BF_TAPE_SPARSE;
+	else printf("Unknown tape %s, using fixed\n", arg);
+}
+
+static const char *gGenerateTargets[] = { "abf", "c", NULL };
+
 static struct {
 	const char *prefix;
 	void (*handler)(BF_Argv *argv, char *arg); 
 	bool isFlags;
+	const char **values;	// Values a flag may optionally be followed by
 } gOptionals[] = {
 	{ "--out", &HandleOutputArgument, 			false },
 	{ "--opt", &HandleOptimizationArgument,		false },
+	{ "--engine", &HandleEngineArgument,		false },
+	{ "--io", &HandleIOArgument,				false },
+	{ "--batch", &HandleBatchArgument,			false },
+	{ "--threads", &HandleThreadsArgument,		false },
+	{ "--cache", &HandleCacheArgument,			false },
+	{ "--cell-bits", &HandleCellBitsArgument,	false },
+	{ "--tape", &HandleTapeArgument,			false },
 
-	{ "--generate", &HandleGenerateArgument,	true },
+	{ "--generate", &HandleGenerateArgument,	true, gGenerateTargets },
+	{ "--profile", &HandleProfileArgument,		true },
+	{ "--compile", &HandleCompileArgument,		true },
+	{ "--tiered", &HandleTieredArgument,		true },
 	
 	{ NULL, NULL, false }
 };
 
+static char *LoadFlagValue(int *j, char **args, const char **values) {
+	for(int i = 0; values && values[i] && args[*j + 1]; ++i) {
+		if (strcmp(values[i], args[*j + 1]) == 0) return args[++*j];
+	}
+
+	return NULL;
+}
+
 static bool LoadOptional(int *j, char **args, BF_Argv *argv) {
 	for(int i = 0; gOptionals[i].prefix; ++i) {
 		if (strcmp(gOptionals[i].prefix, args[*j]) == 0) {
 			if(gOptionals[i].isFlags) {
-				(*gOptionals[i].handler)(argv, NULL);
+				(*gOptionals[i].handler)(argv, LoadFlagValue(j, args, gOptionals[i].values));
 				return true;
 			}
 
@@ -64,6 +153,7 @@ static bool LoadOptional(int *j, char **args, BF_Argv *argv) {
 
 void BF_LoadArguments(int argc, char *argv[], BF_Argv *args) {
 	memset(args, 0, sizeof(BF_Argv));
+	args->cellSize = 1;
 
 	char *source = NULL;
 	for(int i = 1; i < argc; ++i) {
@@ -77,4 +167,6 @@ void BF_LoadArguments(int argc, char *argv[], BF_Argv *args) {
 void BF_FreeArguments(BF_Argv *argv) {
 	free(argv->output);
 	free(argv->source);
+	free(argv->batch);
+	free(argv->cache);
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_BATCH_THREADED	1
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MIN_OUTPUT_LENGTH		4096
+#define MAX_BATCH_THREADS		256
+
+/*
+ * Runs the same context against many inputs. The context is only read by the runs, so it's shared by all
+ * of them, and everything that was made once from it (the packed program or the native code) too.
+ *
+ * Every worker owns a queue, a range of the jobs it takes from the front. A worker that runs out of jobs
+ * steals the back half of the queue of another worker, so a few long runs don't leave the other workers
+ * idle while their own queues are still full.
+ */
+
+typedef struct {
+	BF_Context *ctx;
+	BF_BatchJob *jobs;
+	BF_Engine engine;
+	BF_Tape tape;
+
+	BF_PackedProgram *packed;
+	BF_JitProgram *jit;
+
+	struct Queue *queues;
+	unsigned workers;
+} Batch;
+
+typedef struct {
+	BF_BatchJob *job;
+	size_t allocated;
+} JobOutput;
+
+static int64_t WriteJobOutput(void *handle, char *data, size_t length) {
+	JobOutput *output = handle;
+	BF_BatchJob *job = output->job;
+
+	if (job->outputLength + length > output->allocated) {
+		size_t allocated = output->allocated ? output->allocated : MIN_OUTPUT_LENGTH;
+		while (job->outputLength + length > allocated) allocated *= 2;
+
+		char *buffer = realloc(job->output, allocated);
+		if (!buffer) return -1;
+
+		job->output = buffer;
+		output->allocated = allocated;
+	}
+
+	memcpy(job->output + job->outputLength, data, length);
+	job->outputLength += length;
+	return length;
+}
+
+static uint64_t RunEngine(const Batch *batch, BF_SimulationContext *sim) {
+	switch(batch->engine) {
+	case BF_ENGINE_JIT: return batch->jit ? BF_JitRun(batch->jit, sim) : BF_RunThreaded(sim);
+	case BF_ENGINE_THREADED: return BF_RunThreaded(sim);
+	case BF_ENGINE_HOT: return BF_RunHot(sim);
+	case BF_ENGINE_INTERPRETER: default: return batch->packed ? BF_RunPacked(sim, batch->packed) : BF_Run(sim);
+	}
+}
+
+// Runs a job on the simulation of the worker, which is left as it was created for the next job
+static void RunJob(const Batch *batch, BF_SimulationContext *sim, BF_BatchJob *job) {
+	JobOutput output = { .job = job };
+
+	job->output = NULL;
+	job->outputLength = 0;
+
+	// The input is read in place, only the output is copied out, into a buffer that grows with it
+	BF_SetIO(sim, NULL, NULL, &WriteJobOutput, &output, 0);
+	BF_SetInputSpan(sim, job->input, job->inputLength);
+	job->steps = RunEngine(batch, sim);
+	BF_FlushOutput(sim);
+
+	job->error = sim->error;
+	memcpy(job->message, sim->message, sizeof job->message);
+
+	BF_ClearMemory(sim);
+	sim->ip = 0;
+	sim->state = BF_RUN_READY;
+	sim->error = 0;
+	sim->message[0] = 0;
+}
+
+#if BF_BATCH_THREADED
+
+typedef struct Queue {
+	pthread_mutex_t lock;
+	size_t begin, end;		// Jobs left in the queue
+} Queue;
+
+typedef struct {
+	Batch *batch;
+	unsigned index;
+} Worker;
+
+static bool TakeJob(Queue *queue, size_t *job) {
+	pthread_mutex_lock(&queue->lock);
+	bool taken = queue->begin < queue->end;
+	if (taken) *job = queue->begin++;
+	pthread_mutex_unlock(&queue->lock);
+
+	return taken;
+}
+
+// Moves the back half of the first queue that has jobs into the queue of the thief, false if all of them are empty
+static bool StealJobs(Batch *batch, unsigned thief) {
+	for(unsigned i = 1; i < batch->workers; ++i) {
+		Queue *victim = &batch->queues[(thief + i) % batch->workers];
+
+		pthread_mutex_lock(&victim->lock);
+		size_t end = victim->end, begin = end - (end - victim->begin + 1) / 2;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (begin == end) continue;
+
+		// Only the owner takes from its empty queue, so the jobs can't be missed in between
+		Queue *queue = &batch->queues[thief];
+		pthread_mutex_lock(&queue->lock);
+		queue->begin = begin;
+		queue->end = end;
+		pthread_mutex_unlock(&queue->lock);
+		return true;
+	}
+
+	return false;
+}
+
+static BF_SimulationContext *CreateSimulation(const Batch *batch) {
+	BF_SimulationContext *sim = BF_CreateSimulation(batch->ctx);
+	if (batch->tape != BF_TAPE_FIXED) BF_UseTape(sim, batch->tape);
+
+	return sim;
+}
+
+static void *WorkerMain(void *argument) {
+	Worker *worker = argument;
+	Batch *batch = worker->batch;
+	BF_SimulationContext *sim = CreateSimulation(batch);
+
+	for(;;) {
+		size_t job;
+		if (!TakeJob(&batch->queues[worker->index], &job)) {
+			if (!StealJobs(batch, worker->index)) break;
+			continue;
+		}
+
+		RunJob(batch, sim, &batch->jobs[job]);
+	}
+
+	BF_FreeSimulation(sim);
+	return NULL;
+}
+
+static unsigned CountProcessors(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+}
+
+static void RunWorkers(Batch *batch, size_t count, unsigned threads) {
+	if (!threads) threads = CountProcessors();
+	if (threads > MAX_BATCH_THREADS) threads = MAX_BATCH_THREADS;
+	if (threads > count) threads = count;
+
+	Queue queues[threads];
+	Worker workers[threads];
+	pthread_t handles[threads];
+
+	batch->queues = queues;
+	batch->workers = threads;
+
+	// Every worker starts with an even share
+	for(unsigned i = 0; i < threads; ++i) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].begin = count * i / threads;
+		queues[i].end = count * (i + 1) / threads;
+		workers[i] = (Worker){ .batch = batch, .index = i };
+	}
+
+	// The calling thread is the first worker
+	unsigned started = 1;
+	for(; started < threads; ++started) {
+		if (pthread_create(&handles[started], NULL, &WorkerMain, &workers[started])) break;
+	}
+	WorkerMain(&workers[0]);		// Steals the queues of the workers that failed to start too
+
+	for(unsigned i = 1; i < started; ++i) pthread_join(handles[i], NULL);
+	for(unsigned i = 0; i < threads; ++i) pthread_mutex_destroy(&queues[i].lock);
+}
+
+#else
+
+static void RunWorkers(Batch *batch, size_t count, unsigned threads) {
+	BF_SimulationContext *sim = CreateSimulation(batch);
+	for(size_t i = 0; i < count; ++i) RunJob(batch, sim, &batch->jobs[i]);
+
+	BF_FreeSimulation(sim);
+}
+
+#endif
+
+void BF_RunBatch(BF_Context *ctx, BF_BatchJob *jobs, size_t count, BF_Engine engine, BF_Tape tape, unsigned threads) {
+	if (!count) return;
+
+	Batch batch = { .ctx = ctx, .jobs = jobs, .engine = engine, .tape = tape };
+
+	if (engine == BF_ENGINE_INTERPRETER) batch.packed = BF_Pack(ctx);
+	if (engine == BF_ENGINE_JIT && tape == BF_TAPE_FIXED) {
+		// Compiled for the memory every simulation gets
+		BF_SimulationContext *probe = CreateSimulation(&batch);
+		batch.jit = BF_JitCompile(ctx, probe->memory.flags);
+		BF_FreeSimulation(probe);
+	}
+
+	RunWorkers(&batch, count, threads);
+
+	if (batch.packed) BF_FreePacked(batch.packed);
+	BF_JitFree(batch.jit);
+}
@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_COMPILED_MAPPED	1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define COMPILED_MAGIC			"BFC\x1a"
+#define COMPILED_BYTE_ORDER		0x01020304
+#define COMPILED_EXTENSION		".bfc"
+
+/*
+ * A compiled file holds an optimized context as it is in memory, so it's used without being parsed:
+ *	[header][instructions][length of every data block (uint64_t)][bytes of every data block]
+ * Files of another version, byte order or instruction layout are rejected, the same as a stale key.
+ */
+
+typedef struct {
+	char magic[4];
+	uint32_t version;			// BF_COMPILED_VERSION
+	uint16_t instructionSize;	// sizeof(BF_Instruction)
+	uint16_t cellSize;			// Of the context, the optimized instructions depend on it
+	uint32_t byteOrder;			// COMPILED_BYTE_ORDER as written by the machine that compiled it
+	uint64_t key;				// BF_SourceKey of what it was compiled from
+	uint64_t length;			// Instructions
+	uint64_t dataLength;		// Data blocks
+} Header;
+
+static uint64_t Mix(uint64_t hash, uint64_t word) {
+	hash ^= word * 0x9E3779B97F4A7C15ull;
+	hash = (hash << 31 | hash >> 33) * 0xBF58476D1CE4E5B9ull;
+	return hash ^ hash >> 29;
+}
+
+uint64_t BF_SourceKey(const char *source, size_t length, uint8_t optimizationLevel, uint8_t cellSize) {
+	uint64_t hash = Mix(Mix(BF_OPTIMIZER_VERSION, optimizationLevel), cellSize), word;
+
+	// A word at a time, hashing is far cheaper than the lexer it replaces
+	size_t i = 0;
+	for(; i + sizeof(word) <= length; i += sizeof(word)) {
+		memcpy(&word, source + i, sizeof(word));
+		hash = Mix(hash, word);
+	}
+
+	word = 0;
+	memcpy(&word, source + i, length - i);
+	hash = Mix(Mix(hash, word), length);
+	return hash != BF_COMPILED_ANY_KEY ? hash : 1;
+}
+
+static bool WriteAll(FILE *file, const void *data, size_t length) {
+	return !length || fwrite(data, length, 1, file) == 1;
+}
+
+bool BF_SaveCompiled(const BF_Context *ctx, uint64_t key, const char *path) {
+	// Written aside and renamed, so a run that loads it at the same time never sees half of it
+	char *temporary = malloc(strlen(path) + 32);
+#if BF_COMPILED_MAPPED
+	sprintf(temporary, "%s.%ld.tmp", path, (long)getpid());
+#else
+	sprintf(temporary, "%s.tmp", path);
+#endif
+
+	FILE *file = fopen(temporary, "wb");
+	if (!file) {
+		free(temporary);
+		return false;
+	}
+
+	Header header = {
+		.magic = COMPILED_MAGIC, .version = BF_COMPILED_VERSION, .instructionSize = sizeof(BF_Instruction),
+		.cellSize = ctx->cellSize, .byteOrder = COMPILED_BYTE_ORDER, .key = key, .length = ctx->length, .dataLength = ctx->dataLength
+	};
+
+	bool written = WriteAll(file, &header, sizeof(header)) &&
+		WriteAll(file, ctx->instructions, ctx->length * sizeof(BF_Instruction));
+
+	for(size_t i = 0; written && i < ctx->dataLength; ++i) {
+		uint64_t length = ctx->data[i].length;
+		written = WriteAll(file, &length, sizeof(length));
+	}
+	for(size_t i = 0; written && i < ctx->dataLength; ++i) {
+		written = WriteAll(file, ctx->data[i].bytes, ctx->data[i].length);
+	}
+
+	written = !fclose(file) && written && !rename(temporary, path);
+	if (!written) remove(temporary);
+
+	free(temporary);
+	return written;
+}
+
+// The whole file, mapped copy on write when possible, NULL if it can't be read
+static char *MapFile(const char *path, size_t *length) {
+#if BF_COMPILED_MAPPED
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0) return NULL;
+
+	struct stat info;
+	if (fstat(descriptor, &info) || !S_ISREG(info.st_mode) || info.st_size == 0) {
+		close(descriptor);
+		return NULL;
+	}
+
+	*length = info.st_size;
+	char *content = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	return content != MAP_FAILED ? content : NULL;
+#else
+	FILE *file = fopen(path, "rb");
+	if (!file) return NULL;
+
+	size_t allocated = 4096, read;
+	char *content = malloc(allocated);
+	for(*length = 0; (read = fread(content + *length, 1, allocated - *length, file)) > 0;) {
+		*length += read;
+		if (*length == allocated) content = realloc(content, allocated *= 2);
+	}
+
+	fclose(file);
+	return content;
+#endif
+}
+
+static void UnmapFile(char *content, size_t length) {
+#if BF_COMPILED_MAPPED
+	munmap(content, length);
+#else
+	free(content);
+#endif
+}
+
+// Every jump and data index is in range, so a damaged file can't send the engines out of the program
+static bool IsValid(const BF_Context *ctx) {
+	for(size_t i = 0; i < ctx->length; ++i) {
+		const BF_Instruction *instruction = &ctx->instructions[i];
+
+		switch(instruction->type) {
+		case BF_LBL: case BF_RPT: case BF_WHILE: case BF_WHILE_END:
+			if (instruction->operand1 >= ctx->length) return false;
+			break;
+		case BF_WRITE: case BF_FILL:
+			if (instruction->operand1 >= ctx->dataLength) return false;
+			break;
+		default:
+			if (instruction->type >= __BF_OPERATION_COUNT__) return false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static BF_Context *FromImage(char *image, size_t length, uint64_t key) {
+	const Header *header = (const Header *)image;
+	if (length < sizeof(Header) || memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) ||
+		header->version != BF_COMPILED_VERSION || header->instructionSize != sizeof(BF_Instruction) ||
+		header->byteOrder != COMPILED_BYTE_ORDER || (header->cellSize != 1 && header->cellSize != 2 && header->cellSize != 4))
+		return NULL;
+
+	if (key != BF_COMPILED_ANY_KEY && header->key != key) return NULL;
+
+	// The sizes are checked one at a time, none of them can overflow the ones after it
+	size_t left = length - sizeof(Header);
+	if (header->length > left / sizeof(BF_Instruction)) return NULL;
+	left -= header->length * sizeof(BF_Instruction);
+	if (header->dataLength > left / sizeof(uint64_t)) return NULL;
+	left -= header->dataLength * sizeof(uint64_t);
+
+	BF_Context *ctx = malloc(sizeof(BF_Context));
+	ctx->instructions = (BF_Instruction *)(image + sizeof(Header));
+	ctx->length = header->length;
+	ctx->data = malloc((header->dataLength + 1) * sizeof(BF_Data));
+	ctx->dataLength = header->dataLength;
+	ctx->cellSize = header->cellSize;
+	ctx->image = image;
+	ctx->imageLength = length;
+
+	const char *lengths = (const char *)(ctx->instructions + ctx->length);
+	char *bytes = (char *)lengths + ctx->dataLength * sizeof(uint64_t);
+
+	bool valid = true;
+	for(size_t i = 0; i < ctx->dataLength; ++i) {
+		uint64_t blockLength;
+		memcpy(&blockLength, lengths + i * sizeof(uint64_t), sizeof(blockLength));
+
+		valid = valid && blockLength <= left;
+		if (valid) left -= blockLength;
+
+		ctx->data[i] = (BF_Data){ .bytes = valid ? bytes : NULL, .length = valid ? blockLength : 0 };
+		if (valid) bytes += blockLength;
+	}
+
+	if (!valid || left || !IsValid(ctx)) {
+		// The image belongs to the caller until the context is returned
+		ctx->image = NULL;
+		ctx->instructions = NULL;
+		for(size_t i = 0; i < ctx->dataLength; ++i) ctx->data[i].bytes = NULL;
+
+		BF_FreeContext(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+BF_Context *BF_LoadCompiled(const char *path, uint64_t key) {
+	size_t length;
+	char *image = MapFile(path, &length);
+	if (!image) return NULL;
+
+	BF_Context *ctx = FromImage(image, length, key);
+	if (!ctx) UnmapFile(image, length);
+
+	return ctx;
+}
+
+void BF_DetachCompiled(BF_Context *ctx) {
+	if (!ctx->image) return;
+
+	BF_Instruction *instructions = malloc((ctx->length + 1) * sizeof(BF_Instruction));
+	memcpy(instructions, ctx->instructions, ctx->length * sizeof(BF_Instruction));
+	ctx->instructions = instructions;
+
+	for(size_t i = 0; i < ctx->dataLength; ++i) {
+		char *bytes = malloc(ctx->data[i].length + 1);
+		memcpy(bytes, ctx->data[i].bytes, ctx->data[i].length);
+		ctx->data[i].bytes = bytes;
+	}
+
+	UnmapFile(ctx->image, ctx->imageLength);
+	ctx->image = NULL;
+	ctx->imageLength = 0;
+}
+
+void BF_ReleaseCompiled(BF_Context *ctx) {
+	if (!ctx->image) return;
+
+	UnmapFile(ctx->image, ctx->imageLength);
+	ctx->instructions = NULL;
+	for(size_t i = 0; i < ctx->dataLength; ++i) ctx->data[i].bytes = NULL;
+
+	ctx->image = NULL;
+	ctx->imageLength = 0;
+}
+
+// Creates the directory and its parents, fails only if it still doesn't exist
+static bool MakeDirectory(const char *directory) {
+#if BF_COMPILED_MAPPED
+	char *path = strdup(directory);
+	for(char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		mkdir(path, 0755);
+		*slash = '/';
+	}
+	mkdir(path, 0755);
+
+	struct stat info;
+	bool exists = !stat(path, &info) && S_ISDIR(info.st_mode);
+	free(path);
+	return exists;
+#else
+	return true;
+#endif
+}
+
+char *BF_DefaultCacheDirectory(void) {
+	const char *directory = getenv("BF_CACHE_DIR");
+	if (directory && *directory) return strdup(directory);
+
+	const char *base = getenv("XDG_CACHE_HOME"), *suffix = "/bf";
+	if (!base || !*base) base = getenv("HOME"), suffix = "/.cache/bf";
+	if (!base || !*base) return NULL;
+
+	char *path = malloc(strlen(base) + strlen(suffix) + 1);
+	strcpy(path, base);
+	strcat(path, suffix);
+	return path;
+}
+
+BF_Context *BF_OpenCached(const char *source, uint8_t optimizationLevel, uint8_t cellSize, const char *directory,
+	BF_LoadError *error) {
+	if (error) *error = (BF_LoadError){ .code = BF_LOAD_OK };
+
+	size_t length;
+	char *content = MapFile(source, &length);
+	if (!content) {
+		// Empty files and pipes are left to the loader
+		BF_Context *ctx = BF_Open(source, error);
+		if (ctx) {
+			ctx->cellSize = cellSize;
+			BF_Optimize(ctx, optimizationLevel);
+		}
+		return ctx;
+	}
+
+	char *path = NULL;
+	BF_Context *ctx = NULL;
+	uint64_t key = BF_SourceKey(content, length, optimizationLevel, cellSize);
+
+	if (directory) {
+		path = malloc(strlen(directory) + 32);
+		sprintf(path, "%s/%016llx" COMPILED_EXTENSION, directory, (unsigned long long)key);
+		ctx = BF_LoadCompiled(path, key);
+	}
+
+	if (!ctx) {
+		ctx = BF_FromSource(content, length, error);
+		if (ctx) {
+			ctx->cellSize = cellSize;
+			BF_Optimize(ctx, optimizationLevel);
+		}
+
+		// A cache that can't be written only costs the next run the time of this one
+		if (ctx && path && MakeDirectory(directory)) BF_SaveCompiled(ctx, key, path);
+	}
+
+	UnmapFile(content, length);
+	free(path);
+	return ctx;
+}
@@ -0,0 +1,549 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bf.h"
+
+#define KNOWN_MEMORY_LENGTH		BF_FIXED_TAPE_LENGTH	// Cells past the default memory may be out of range, so their accesses stay
+#define MAX_TRACKED_CELLS		(1 << 20)
+#define MAX_UNROLL_ITERATIONS	1024
+#define MAX_UNROLL_GROWTH		1024		// Instructions a single unrolled loop may add to the program
+#define UNROLL_BUDGET			(1 << 20)	// Instructions (and scanned cells) simulated while unrolling, over the whole program
+
+/*
+ * Constant propagation over the tape.
+ *
+ * The program is walked in order with an abstract tape: every cell is either known (with the value the
+ * program gave it) or unknown, and the pointer is known relative to an anchor. The anchor starts as cell 0
+ * of a fresh memory, where every cell is a known 0, and moves to the current cell whenever the pointer
+ * can't be followed (after a scan or a loop that moves).
+ *
+ * Writes to known cells are not emitted, their values are kept on the abstract tape (dirty) and written
+ * with a single SET right before something needs the memory: a print, an input, a loop that runs or the
+ * end of the program. A loop is handled by what is known about its cell when it's reached:
+ *	known 0			The loop never runs and is removed
+ *	known			Its trip count is known too, so it's unrolled into the abstract tape (if everything in it
+ *					can be followed, unrolling around a loop that is kept only makes the program longer)
+ *	unknown			It's kept, every cell it writes becomes unknown, and its cell is known to be 0 after it
+ */
+
+typedef struct {
+	uint32_t value;			// Within the mask of the cell size
+	bool known;
+	bool dirty;				// The value isn't in the memory yet
+} AbstractCell;
+
+typedef struct {
+	int64_t offset;
+	AbstractCell cell;
+} JournalEntry;
+
+typedef struct {
+	AbstractCell *cells;	// Cells [base, base + length) relative to the anchor
+	int64_t base;
+	size_t length;
+
+	int64_t dp;				// Relative to the anchor
+	bool absolute;			// The anchor is cell 0 of a fresh memory, untracked cells in range are known zeros
+
+	int64_t *dirty;			// Cells that may be dirty, in the order they became dirty
+	size_t dirtyUsed, dirtyAllocated;
+
+	JournalEntry *journal;	// Previous states of the cells changed while unrolling, to undo a failed unroll
+	size_t journalUsed, journalAllocated;
+} AbstractTape;
+
+typedef struct {
+	int64_t *offsets;		// A stack of the cells written by the loops being processed
+	size_t used, allocated;
+} Clobbers;
+
+typedef struct {
+	const BF_Context *ctx;
+	AbstractTape tape;
+	Clobbers clobbers;
+
+	BF_Instruction *out;
+	size_t length, allocated;
+
+	uint32_t position;		// Of the instruction being processed
+	size_t budget;
+	int unrolling;			// Depth of the loops being unrolled
+	bool changed;
+} Propagation;
+
+static void *Grow(void *buffer, size_t *allocated, size_t used, size_t size) {
+	if (used < *allocated) return buffer;
+
+	*allocated = *allocated ? 2 * *allocated : 64;
+	return realloc(buffer, *allocated * size);
+}
+
+#pragma region Abstract tape
+
+static bool IsTrackable(const AbstractTape *tape, int64_t offset) {
+	return !tape->absolute || (offset >= 0 && offset < KNOWN_MEMORY_LENGTH);
+}
+
+// The cell at offset from the anchor, NULL if it can't be tracked
+static AbstractCell *Lookup(AbstractTape *tape, int64_t offset) {
+	if (!IsTrackable(tape, offset)) return NULL;
+	if (tape->length && offset >= tape->base && offset < tape->base + (int64_t)tape->length)
+		return &tape->cells[offset - tape->base];
+
+	// Grow the window towards the cell, at least to twice its size
+	int64_t low = offset, high = offset + 1;
+	if (tape->length) {
+		if (tape->base < low) low = tape->base;
+		if (tape->base + (int64_t)tape->length > high) high = tape->base + tape->length;
+	}
+
+	size_t length = high - low;
+	if (length > MAX_TRACKED_CELLS) return NULL;
+	if (length < 2 * tape->length) length = 2 * tape->length < MAX_TRACKED_CELLS ? 2 * tape->length : MAX_TRACKED_CELLS;
+	if (offset == low) low = high - length;
+	else high = low + length;
+
+	AbstractCell *cells = malloc(length * sizeof(AbstractCell));
+	const AbstractCell fresh = { .value = 0, .known = tape->absolute };
+	for(size_t i = 0; i < length; ++i) cells[i] = fresh;
+
+	if (tape->length) memcpy(cells + (tape->base - low), tape->cells, tape->length * sizeof(AbstractCell));
+	free(tape->cells);
+
+	tape->cells = cells;
+	tape->base = low;
+	tape->length = length;
+	return &tape->cells[offset - low];
+}
+
+static void SetCell(Propagation *p, int64_t offset, AbstractCell state) {
+	AbstractTape *tape = &p->tape;
+	AbstractCell *cell = Lookup(tape, offset);
+
+	if (p->unrolling) {
+		tape->journal = Grow(tape->journal, &tape->journalAllocated, tape->journalUsed, sizeof(JournalEntry));
+		tape->journal[tape->journalUsed++] = (JournalEntry){ offset, *cell };
+	}
+
+	if (state.dirty && !cell->dirty) {
+		tape->dirty = Grow(tape->dirty, &tape->dirtyAllocated, tape->dirtyUsed, sizeof(int64_t));
+		tape->dirty[tape->dirtyUsed++] = offset;
+	}
+
+	*cell = state;
+}
+
+static void Emit(Propagation *p, BF_Instruction instruction) {
+	p->out = Grow(p->out, &p->allocated, p->length, sizeof(BF_Instruction));
+	p->out[p->length++] = instruction;
+}
+
+// An instruction that applies to the cell at offset from the current one
+static BF_Instruction Relative(BF_Operation here, BF_Operation left, BF_Operation right, int64_t offset, uint32_t value) {
+	return (BF_Instruction){
+		.type = offset == 0 ? here : offset < 0 ? left : right,
+		.operand1 = value,
+		.operand2 = offset < 0 ? -offset : offset,
+	};
+}
+
+// Writes the value of a dirty cell to the memory
+static void Materialize(Propagation *p, int64_t offset) {
+	AbstractCell *cell = Lookup(&p->tape, offset);
+	if (!cell || !cell->dirty) return;
+
+	BF_Instruction set = Relative(BF_SET, BF_STL, BF_STR, offset - p->tape.dp, cell->value);
+	set.position = p->position;
+	Emit(p, set);
+
+	SetCell(p, offset, (AbstractCell){ .value = cell->value, .known = true });
+}
+
+static void Flush(Propagation *p) {
+	AbstractTape *tape = &p->tape;
+	for(size_t i = 0; i < tape->dirtyUsed; ++i) Materialize(p, tape->dirty[i]);
+
+	// While unrolling the list must survive, an unroll that fails makes these cells dirty again
+	if (!p->unrolling) tape->dirtyUsed = 0;
+}
+
+static void Forget(Propagation *p, int64_t offset) {
+	if (Lookup(&p->tape, offset)) SetCell(p, offset, (AbstractCell){ .known = false });
+}
+
+static void Learn(Propagation *p, int64_t offset, uint32_t value, bool dirty) {
+	value &= BF_CELL_MASK(p->ctx->cellSize);		// Wraps around like the cells do
+	if (Lookup(&p->tape, offset)) SetCell(p, offset, (AbstractCell){ .value = value, .known = true, .dirty = dirty });
+}
+
+// Moves the anchor to the current cell and forgets everything (the memory must be flushed)
+static void Reanchor(Propagation *p) {
+	AbstractTape *tape = &p->tape;
+	free(tape->cells);
+
+	tape->cells = NULL;
+	tape->base = tape->length = 0;
+	tape->dp = 0;
+	tape->absolute = false;
+	tape->dirtyUsed = 0;
+}
+
+#pragma endregion
+
+#pragma region Loops
+
+static bool IsOpener(BF_Operation type) {
+	return type == BF_LBL || type == BF_WHILE;
+}
+
+static bool IsCloser(BF_Operation type) {
+	return type == BF_RPT || type == BF_WHILE_END;
+}
+
+// Offset from the current cell of the cell an instruction accesses
+static int64_t AccessOffset(const BF_Instruction *instruction) {
+	switch(instruction->type) {
+	case BF_ICL: case BF_DCL: case BF_STL: return -(int64_t)instruction->operand2;
+	case BF_ICR: case BF_DCR: case BF_STR: return instruction->operand2;
+	case BF_PRT: case BF_INP: case BF_MUL: return (int32_t)instruction->operand2;
+	default: return 0;
+	}
+}
+
+static int64_t ArithmeticDelta(const BF_Instruction *instruction) {
+	switch(instruction->type) {
+	case BF_DEC: case BF_DCL: case BF_DCR: return -(int64_t)instruction->operand1;
+	default: return instruction->operand1;
+	}
+}
+
+/*
+ * Pushes the offsets (from the cell the loop starts at) of every cell the loop writes.
+ * Returns false if the loop doesn't end on the cell it started at, then the pointer is unknown after it.
+ */
+static bool LoopClobbers(Propagation *p, size_t begin, size_t end) {
+	const BF_Instruction *inst = p->ctx->instructions;
+	Clobbers *clobbers = &p->clobbers;
+
+	int64_t dp = 0;
+	int64_t *openers = malloc((end - begin + 1) * sizeof(int64_t));
+	size_t depth = 0;
+
+	for(size_t i = begin; i <= end; ++i) {
+		bool writes = true;
+		switch(inst[i].type) {
+		case BF_MVL: dp -= inst[i].operand1; writes = false; break;
+		case BF_MVR: dp += inst[i].operand1; writes = false; break;
+		case BF_PRT: case BF_NOP: writes = false; break;
+		case BF_SCANL: case BF_SCANR: free(openers); return false;
+
+		case BF_LBL: openers[depth++] = dp; writes = false; break;
+		case BF_WHILE: openers[depth++] = dp; break;
+		case BF_RPT: case BF_WHILE_END:
+			if (openers[--depth] != dp) {
+				free(openers);
+				return false;
+			}
+			writes = false;
+			break;
+
+		default: break;
+		}
+
+		if (!writes) continue;
+
+		clobbers->offsets = Grow(clobbers->offsets, &clobbers->allocated, clobbers->used, sizeof(int64_t));
+		clobbers->offsets[clobbers->used++] = dp + AccessOffset(&inst[i]);
+	}
+
+	free(openers);
+	return true;
+}
+
+static bool PropagateRange(Propagation *p, size_t begin, size_t end);
+
+// Runs a loop with a known cell on the abstract tape, false (with everything undone) if it can't be unrolled
+static bool Unroll(Propagation *p, size_t begin, size_t end) {
+	AbstractTape *tape = &p->tape;
+	const BF_Instruction *opener = &p->ctx->instructions[begin];
+
+	const size_t length = p->length, journal = tape->journalUsed, dirty = tape->dirtyUsed;
+	const int64_t dp = tape->dp;
+	bool unrolled = false;
+
+	++p->unrolling;
+	for(size_t iteration = 0; p->budget && iteration <= MAX_UNROLL_ITERATIONS; ++iteration) {
+		AbstractCell *cell = Lookup(tape, tape->dp);
+		if (!cell || !cell->known) break;
+		if (!cell->value) {
+			unrolled = true;
+			break;
+		}
+
+		if (opener->type == BF_WHILE) Learn(p, tape->dp, cell->value - 1, true);
+		if (!PropagateRange(p, begin + 1, end) || p->length - length > MAX_UNROLL_GROWTH) break;
+	}
+	--p->unrolling;
+
+	if (unrolled) {
+		if (!p->unrolling) tape->journalUsed = 0;
+		return true;
+	}
+
+	// Undo every change to the tape, newest first
+	while(tape->journalUsed > journal) {
+		const JournalEntry *entry = &tape->journal[--tape->journalUsed];
+		*Lookup(tape, entry->offset) = entry->cell;
+	}
+
+	tape->dirtyUsed = dirty;
+	tape->dp = dp;
+	p->length = length;
+	return false;
+}
+
+// Keeps a loop whose cell is unknown
+static void KeepLoop(Propagation *p, size_t begin, size_t end) {
+	const BF_Instruction *inst = p->ctx->instructions;
+	AbstractTape *tape = &p->tape;
+
+	const size_t mark = p->clobbers.used;
+	bool balanced = LoopClobbers(p, begin, end);
+
+	// The loop sees the memory as the program wrote it, and on every iteration only the cells it doesn't write are known
+	Flush(p);
+	if (balanced) {
+		for(size_t k = mark; k < p->clobbers.used; ++k) Forget(p, tape->dp + p->clobbers.offsets[k]);
+	} else {
+		Reanchor(p);
+	}
+
+	size_t opener = p->length;
+	Emit(p, inst[begin]);
+
+	PropagateRange(p, begin + 1, end);
+	p->position = inst[end].position;
+	Flush(p);
+
+	BF_Instruction closer = inst[end];
+	closer.operand1 = opener;
+	p->out[opener].operand1 = p->length;
+	Emit(p, closer);
+
+	// The loop may have ended after any iteration, what the body learnt about the cells it writes isn't known
+	if (balanced) {
+		for(size_t k = mark; k < p->clobbers.used; ++k) Forget(p, tape->dp + p->clobbers.offsets[k]);
+	} else {
+		Reanchor(p);
+	}
+
+	Learn(p, tape->dp, 0, false);
+	p->clobbers.used = mark;
+}
+
+#pragma endregion
+
+// Scans through known cells to the first known zero, false if a cell on the way is unknown
+static bool ResolveScan(Propagation *p, int64_t stride) {
+	AbstractTape *tape = &p->tape;
+	int64_t dp = tape->dp;
+
+	for(size_t cells = 0; cells < MAX_TRACKED_CELLS; ++cells, dp += stride) {
+		if (p->unrolling) {
+			if (!p->budget) return false;
+			--p->budget;
+		}
+
+		AbstractCell *cell = Lookup(tape, dp);
+		if (!cell || !cell->known) return false;
+		if (cell->value) continue;
+
+		if (dp != tape->dp) {
+			BF_Instruction move = { .type = dp > tape->dp ? BF_MVR : BF_MVL, .position = p->position };
+			move.operand1 = dp > tape->dp ? dp - tape->dp : tape->dp - dp;
+			Emit(p, move);
+		}
+
+		tape->dp = dp;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Processes the instructions in [begin, end) into the output.
+ * Returns false if an unrolled loop must be given up, because something in it can't be followed.
+ */
+static bool PropagateRange(Propagation *p, size_t begin, size_t end) {
+	const BF_Instruction *inst = p->ctx->instructions;
+	AbstractTape *tape = &p->tape;
+
+	for(size_t i = begin; i < end; ++i) {
+		if (p->unrolling) {
+			if (!p->budget) return false;
+			--p->budget;
+		}
+
+		const BF_Instruction *instruction = &inst[i];
+		const int64_t target = tape->dp + AccessOffset(instruction);
+		AbstractCell *cell = Lookup(tape, target);
+		p->position = instruction->position;
+
+		switch(instruction->type) {
+		case BF_NOP: break;
+
+		case BF_MVL: tape->dp -= instruction->operand1; Emit(p, *instruction); break;
+		case BF_MVR: tape->dp += instruction->operand1; Emit(p, *instruction); break;
+
+		case BF_INC: case BF_DEC: case BF_ICL: case BF_DCL: case BF_ICR: case BF_DCR:
+			if (!cell || !cell->known) {
+				Emit(p, *instruction);
+				break;
+			}
+
+			Learn(p, target, cell->value + ArithmeticDelta(instruction), true);
+			p->changed = true;
+			break;
+
+		case BF_SET: case BF_STL: case BF_STR:
+			if (!cell) {
+				Emit(p, *instruction);
+				break;
+			}
+
+			Learn(p, target, instruction->operand1, true);
+			p->changed = true;
+			break;
+
+		case BF_PRT:
+			Materialize(p, target);
+			Emit(p, *instruction);
+			break;
+
+		case BF_INP:	// The cell is left as it is on EOF
+			Materialize(p, target);
+			Emit(p, *instruction);
+			Forget(p, target);
+			break;
+
+		case BF_MUL: {
+			AbstractCell *source = Lookup(tape, tape->dp);
+			if (!source || !source->known) {
+				Materialize(p, target);
+				Emit(p, *instruction);
+				Forget(p, target);
+				break;
+			}
+
+			// A MUL of 0 only touches the target of a count, which a loop that runs does too (when its cell isn't 0)
+			if (!instruction->operand1 && source->value) {
+				Materialize(p, tape->dp);
+				Emit(p, *instruction);
+				break;
+			}
+
+			p->changed = true;
+			uint32_t delta = (source->value * instruction->operand1) & BF_CELL_MASK(p->ctx->cellSize);
+			if (!delta) break;
+
+			// Looked up again, the source lookup may have moved the cells
+			cell = Lookup(tape, target);
+			if (cell && cell->known) {
+				Learn(p, target, cell->value + delta, true);
+			} else {
+				BF_Instruction add = Relative(BF_INC, BF_ICL, BF_ICR, target - tape->dp, delta);
+				add.position = instruction->position;
+				Emit(p, add);
+			}
+			break;
+		}
+
+		case BF_COUNT: {
+			uint32_t iterations;
+			if (!cell || !cell->known || !BF_CountIterations(cell->value, instruction->operand1, p->ctx->cellSize, &iterations)) {
+				Materialize(p, target);
+				Emit(p, *instruction);
+				Forget(p, target);
+				break;
+			}
+
+			Learn(p, target, iterations, true);
+			p->changed = true;
+			break;
+		}
+
+		case BF_SCANL: case BF_SCANR:
+			if (ResolveScan(p, instruction->type == BF_SCANL ? -(int64_t)instruction->operand1 : instruction->operand1)) {
+				p->changed = true;
+				break;
+			}
+			if (p->unrolling) return false;
+
+			// The scan ends on a zero cell, wherever it is
+			Flush(p);
+			Emit(p, *instruction);
+			Reanchor(p);
+			Learn(p, 0, 0, false);
+			break;
+
+		case BF_LBL: case BF_WHILE: {
+			size_t close = instruction->operand1;
+
+			if (cell && cell->known && !cell->value) {
+				p->changed = true;	// Never runs
+			} else if (cell && cell->known && p->budget && Unroll(p, i, close)) {
+				p->changed = true;
+			} else if (p->unrolling) {
+				return false;
+			} else {
+				KeepLoop(p, i, close);
+			}
+
+			i = close;
+			break;
+		}
+
+		default:	// Anything else is kept, and nothing is known after it
+			if (p->unrolling) return false;
+
+			Flush(p);
+			Emit(p, *instruction);
+			Reanchor(p);
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool BF_PropagateConstants(BF_Context *ctx) {
+	// Loops that are cut short by the optimizer can't be followed
+	for(size_t i = 0; i < ctx->length; ++i) {
+		if (IsOpener(ctx->instructions[i].type) && ctx->instructions[i].operand1 >= ctx->length) return false;
+		if (IsCloser(ctx->instructions[i].type) && ctx->instructions[i].operand1 >= ctx->length) return false;
+	}
+
+	Propagation p = { .ctx = ctx, .budget = UNROLL_BUDGET };
+	p.tape.absolute = true;
+
+	PropagateRange(&p, 0, ctx->length);
+	p.position = ctx->length ? ctx->instructions[ctx->length - 1].position : 0;
+	Flush(&p);	// The memory ends the same
+
+	free(p.tape.cells);
+	free(p.tape.dirty);
+	free(p.tape.journal);
+	free(p.clobbers.offsets);
+
+	if (!p.changed) {
+		free(p.out);
+		return false;
+	}
+
+	BF_DetachCompiled(ctx);
+	free(ctx->instructions);
+	ctx->instructions = p.out;
+	ctx->length = p.length;
+	return true;
+}
@@ -1,5 +1,6 @@
 
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,14 +9,15 @@
 
 static struct {
 	const char *name;
+	const char *shifted;	// Name of the instruction when it has a signed offset in operand2
 } gOpcodes[] = {
 	[BF_NOP] = { "NOP" },
 	[BF_MVL] = { "MOVE %u LEFT" },
 	[BF_MVR] = { "MOVE %u RIGHT" },
 	[BF_INC] = { "ADD %u" },
 	[BF_DEC] = { "SUB %u" },
-	[BF_PRT] = { "PRINT" },
-	[BF_INP] = { "INPUT" },
+	[BF_PRT] = { "PRINT", "PRINT %d" },
+	[BF_INP] = { "INPUT", "INPUT %d" },
 	[BF_LBL] = { "JZ %u" },
 	[BF_RPT] = { "JNZ %u" },
 	[BF_SET] = { "SET %u" },
@@ -29,7 +31,15 @@ static struct {
 	[BF_STR] = { "SET %u TO %u RIGHT"},
 
 	[BF_WHILE] = { "WHILE %u" },
-	[BF_WHILE_END] = { "END %u" }
+	[BF_WHILE_END] = { "END %u" },
+
+	[BF_MUL] = { "ADD CURRENT * %u TO %d" },
+	[BF_SCANL] = { "SCAN %u LEFT" },
+	[BF_SCANR] = { "SCAN %u RIGHT" },
+
+	[BF_WRITE] = { "WRITE DATA %u" },
+	[BF_FILL] = { "FILL DATA %u" },
+	[BF_COUNT] = { "COUNT STEPS OF %u" },
 };
 
 char *BF_Export(BF_Context *context) {
@@ -42,7 +52,10 @@ char *BF_Export(BF_Context *context) {
 		const BF_Instruction *instruction = &context->instructions[i];
 
 		int length = 0;
-		length = snprintf(buffer, 512, gOpcodes[instruction->type].name, instruction->operand1, instruction->operand2);
+		if (instruction->operand2 && gOpcodes[instruction->type].shifted)
+			length = snprintf(buffer, 512, gOpcodes[instruction->type].shifted, (int32_t)instruction->operand2);
+		else
+			length = snprintf(buffer, 512, gOpcodes[instruction->type].name, instruction->operand1, instruction->operand2);
 
 		strcat(buffer, "\n");
 		if (used + ++length >= bytes) {
@@ -54,4 +67,143 @@ char *BF_Export(BF_Context *context) {
 	}
 
 	return string;
-}
\ No newline at end of file
+}
+
+typedef struct {
+	char *string;
+	size_t used, allocated;
+} StringBuilder;
+
+static void Append(StringBuilder *builder, int indent, const char *format, ...) {
+	char buffer[513];
+
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(buffer, 512, format, args);
+	va_end(args);
+
+	if (builder->used + indent + length + 1 >= builder->allocated) {
+		while (builder->used + indent + length + 1 >= builder->allocated) builder->allocated += 4096;
+		builder->string = realloc(builder->string, builder->allocated);
+	}
+
+	memset(builder->string + builder->used, '\t', indent);
+	memcpy(builder->string + builder->used + indent, buffer, length + 1);
+	builder->used += indent + length;
+}
+
+#define DATA_LITERAL_LENGTH		64		// Bytes in every string literal of the data, 4 characters each
+
+// Emits `prefix"<bytes>", <length>suffix` for every chunk of the data, with the chunk offset as the argument of prefix
+static void AppendData(StringBuilder *b, int indent, const char *prefix, const char *suffix, const BF_Data *data) {
+	for(size_t offset = 0; offset < data->length; offset += DATA_LITERAL_LENGTH) {
+		size_t length = data->length - offset < DATA_LITERAL_LENGTH ? data->length - offset : DATA_LITERAL_LENGTH;
+
+		char literal[4 * DATA_LITERAL_LENGTH + 1], *cursor = literal;
+		for(size_t i = 0; i < length; ++i) cursor += sprintf(cursor, "\\%03o", (uint8_t)data->bytes[offset + i]);
+
+		Append(b, indent, prefix, offset);
+		Append(b, 0, "\"%s\", %zu%s", literal, length, suffix);
+	}
+}
+
+// Loops can only become structured code if every jump points to its matching bracket
+static bool IsStructured(BF_Context *context) {
+	size_t *stack = malloc((context->length + 1) * sizeof(size_t)), depth = 0;
+	bool structured = true;
+
+	for(size_t i = 0; structured && i < context->length; ++i) {
+		const BF_Instruction *instruction = &context->instructions[i];
+		switch(instruction->type) {
+		case BF_LBL: case BF_WHILE:
+			stack[depth++] = i;
+			break;
+		case BF_RPT: case BF_WHILE_END: {
+			BF_Operation opener = instruction->type == BF_RPT ? BF_LBL : BF_WHILE;
+			structured = depth > 0 && instruction->operand1 == stack[depth - 1] &&
+				context->instructions[stack[depth - 1]].type == opener &&
+				context->instructions[stack[depth - 1]].operand1 == i;
+			--depth;
+			break;
+		}
+		default: break;
+		}
+	}
+
+	free(stack);
+	return structured && depth == 0;
+}
+
+char *BF_ExportC(BF_Context *context) {
+	if (!IsStructured(context)) {
+		printf("Can't export program with unstructured jumps to C\n");
+		return NULL;
+	}
+
+	static const char *const cellTypes[] = { [1] = "unsigned char", [2] = "unsigned short", [4] = "unsigned int" };
+	uint32_t mask = BF_CELL_MASK(context->cellSize);
+
+	StringBuilder builder = { 0 }, *b = &builder;
+	Append(b, 0, "/* Generated by bf, build with: cc -O3 <file> */\n");
+	Append(b, 0, "#include <stdio.h>\n");
+	Append(b, 0, "#include <string.h>\n\n");
+	Append(b, 0, "#ifndef BF_TAPE_LENGTH\n#define BF_TAPE_LENGTH %d\n#endif\n\n", BF_FIXED_TAPE_LENGTH);
+	Append(b, 0, "typedef %s cell_t;\n\n", cellTypes[context->cellSize]);
+	Append(b, 0, "static cell_t tape[BF_TAPE_LENGTH];\n\n");
+	Append(b, 0, "static void input(cell_t *cell) {\n");
+	Append(b, 1, "fflush(stdout);\n");
+	Append(b, 1, "int chr = getchar();\n");
+	Append(b, 1, "if (chr != EOF) *cell = chr;\n");
+	Append(b, 0, "}\n\n");
+	Append(b, 0, "int main(void) {\n");
+	Append(b, 1, "cell_t *p = tape;\n\n");
+
+	int depth = 1;
+	for(size_t i = 0; i < context->length; ++i) {
+		const BF_Instruction *instruction = &context->instructions[i];
+		uint32_t value = instruction->operand1 & mask;
+
+		switch(instruction->type) {
+		case BF_MVL: Append(b, depth, "p -= %u;\n", instruction->operand1); break;
+		case BF_MVR: Append(b, depth, "p += %u;\n", instruction->operand1); break;
+		case BF_INC: Append(b, depth, "p[0] += %u;\n", value); break;
+		case BF_DEC: Append(b, depth, "p[0] -= %u;\n", value); break;
+		case BF_SET: Append(b, depth, "p[0] = %u;\n", value); break;
+		case BF_ICL: Append(b, depth, "p[-%u] += %u;\n", instruction->operand2, value); break;
+		case BF_ICR: Append(b, depth, "p[%u] += %u;\n", instruction->operand2, value); break;
+		case BF_DCL: Append(b, depth, "p[-%u] -= %u;\n", instruction->operand2, value); break;
+		case BF_DCR: Append(b, depth, "p[%u] -= %u;\n", instruction->operand2, value); break;
+		case BF_STL: Append(b, depth, "p[-%u] = %u;\n", instruction->operand2, value); break;
+		case BF_STR: Append(b, depth, "p[%u] = %u;\n", instruction->operand2, value); break;
+		case BF_PRT: Append(b, depth, "putchar(p[%d]);\n", (int32_t)instruction->operand2); break;
+		case BF_INP: Append(b, depth, "input(p + %d);\n", (int32_t)instruction->operand2); break;
+		case BF_SCANL: Append(b, depth, "while (p[0]) p -= %u;\n", instruction->operand1); break;
+		case BF_SCANR: Append(b, depth, "while (p[0]) p += %u;\n", instruction->operand1); break;
+		case BF_MUL: Append(b, depth, "p[%d] += p[0] * %uu;\n", (int32_t)instruction->operand2, value); break;
+		case BF_WRITE: AppendData(b, depth, "fwrite(", ", 1, stdout);\n", &context->data[instruction->operand1]); break;
+		case BF_FILL: AppendData(b, depth, "memcpy((char *)p + %zu, ", ");\n", &context->data[instruction->operand1]); break;
+		case BF_COUNT:
+			Append(b, depth, "for (cell_t n = 0;; ++n) {\n");
+			Append(b, depth + 1, "if (!p[0]) { p[0] = n; break; }\n");
+			Append(b, depth + 1, "p[0] += %uu;\n", value);
+			Append(b, depth, "}\n");
+			break;
+
+		case BF_LBL: Append(b, depth++, "while (p[0]) {\n"); break;
+		case BF_WHILE:
+			Append(b, depth++, "while (p[0]) {\n");
+			Append(b, depth, "p[0] -= 1;\n");
+			break;
+		case BF_RPT:
+		case BF_WHILE_END: Append(b, --depth, "}\n"); break;
+
+		case BF_NOP: default: break;
+		}
+	}
+
+	Append(b, 0, "\n");
+	Append(b, 1, "fflush(stdout);\n");
+	Append(b, 1, "return 0;\n");
+	Append(b, 0, "}\n");
+	return builder.string;
+}
@@ -0,0 +1,147 @@
+/*
+ * Body of the packed interpreter, included by runner.c once for every variant:
+ *	INTERPRETER_NAME		Name of the generated function
+ *	INTERPRETER_PROFILED	Counts every instruction and loop into profile, which is NULL otherwise
+ *	INTERPRETER_HOT			Counts the iterations of every loop into hot, and runs the ones that got hot natively
+ *	CELL_TYPE				Unsigned type of a cell
+ * It starts at the slot pc, and stops after limit steps with the simulation ready to go on from where it stopped.
+ */
+#if INTERPRETER_HOT
+static uint64_t INTERPRETER_NAME(BF_SimulationContext *sim, const BF_PackedProgram *program, HotLoops *hot,
+	size_t pc, uint64_t limit) {
+#else
+static uint64_t INTERPRETER_NAME(BF_SimulationContext *sim, const BF_PackedProgram *program, BF_Profile *profile,
+	size_t pc, uint64_t limit) {
+#endif
+	const BF_PackedOp *code = program->code;
+	uint64_t steps = 0;
+	CELL_TYPE value, *cell;
+
+#define AT(shift)	((CELL_TYPE *)PackedCell(sim, program, pc, (shift), sizeof(CELL_TYPE)))
+
+#if INTERPRETER_PROFILED || INTERPRETER_HOT
+	const BF_Instruction *instructions = sim->context->instructions;
+#endif
+
+#if INTERPRETER_HOT
+	// The steps of a compiled loop include the one that went into it, and its opener once more after a RPT
+#define HOT_ENTER(loop, replaced) do { \
+		steps += RunHotLoop(sim, program, hot->compiled[(loop)], &next) - (replaced); \
+		if (sim->error) pc = next; \
+		else if (sim->state == BF_RUN_WAITING) { pc = next; ++steps; goto L_WAIT; } \
+	} while(0)
+#endif
+
+	for(sim->error = 0; !sim->error && pc < program->length && steps < limit; ++steps) {
+		const BF_PackedOp *op = &code[pc];
+		uint8_t opcode = op->opcode;
+		int32_t operand = op->operand;
+		CELL_TYPE immediate = op->value;
+		size_t next = pc + 1;
+
+		if (opcode & (BF_PACKED_WIDE | BF_PACKED_LONG)) {
+			if (opcode & BF_PACKED_WIDE) operand = code[next++].wide;
+			if (opcode & BF_PACKED_LONG) immediate = code[next++].wide;
+			opcode &= ~(BF_PACKED_WIDE | BF_PACKED_LONG);
+		}
+
+#if INTERPRETER_PROFILED
+		const size_t index = program->origin[pc];
+		++profile->hits[index];
+#endif
+
+		switch(opcode) {
+		case BF_MVL: case BF_MVR: sim->dp += operand; break;
+
+		case BF_INC: case BF_DEC: case BF_ICL: case BF_DCL: case BF_ICR: case BF_DCR:
+			*AT(operand) += immediate;
+			break;
+		case BF_SET: case BF_STL: case BF_STR: *AT(operand) = immediate; break;
+
+		case BF_PRT:
+			value = *AT(operand);
+			if (!sim->error) IOWrite(sim, value);
+			break;
+		case BF_INP: cell = AT(operand); IORead(sim, cell, goto L_WAIT); break;
+
+		case BF_LBL: case BF_WHILE:
+#if INTERPRETER_HOT
+			if (hot->compiled[program->origin[pc]]) {
+				HOT_ENTER(program->origin[pc], 1);
+				break;
+			}
+#endif
+			cell = AT(0);
+			if (!*cell) next = pc + operand;
+			else {
+#if INTERPRETER_PROFILED
+				++profile->loops[index].entries;
+				++profile->loops[index].iterations;
+#endif
+				if (opcode == BF_WHILE) --*cell;
+			}
+			break;
+		case BF_RPT: case BF_WHILE_END:
+			if (*AT(0)) {
+				next = pc + operand;
+#if INTERPRETER_PROFILED
+				// A WHILE_END jumps back to the WHILE, which counts the iteration again as an entry
+				if (opcode == BF_WHILE_END) --profile->loops[instructions[index].operand1].entries;
+				else ++profile->loops[instructions[index].operand1].iterations;
+#endif
+#if INTERPRETER_HOT
+				size_t loop = instructions[program->origin[pc]].operand1;
+				if (++hot->iterations[loop] == HOT_LOOP_THRESHOLD) hot->compiled[loop] = CompileHotLoop(sim, loop);
+				if (hot->compiled[loop]) HOT_ENTER(loop, opcode == BF_RPT ? 1 : 0);
+#endif
+			}
+			break;
+
+		case BF_MUL:	// The target isn't touched by a loop that isn't entered
+			value = *AT(0);
+			if (!sim->error && value) *AT(operand) += (uint32_t)value * immediate;
+			break;
+
+		case BF_COUNT: {
+			uint32_t iterations;
+			cell = AT(0);
+			if (BF_CountIterations(*cell, immediate, sizeof(CELL_TYPE), &iterations)) *cell = iterations;
+			else next = pc;		// Never gets to 0, it runs forever like the loop did
+			break;
+		}
+
+		case BF_SCANL: case BF_SCANR:
+			sim->ip = program->origin[pc];
+			MemScan(sim, operand, sizeof(CELL_TYPE));
+			break;
+
+		case BF_WRITE: BF_WriteOutput(sim, sim->context->data[operand].bytes, sim->context->data[operand].length); break;
+		case BF_FILL: PackedFill(sim, program, pc, &sim->context->data[operand], sizeof(CELL_TYPE)); break;
+
+		case BF_NOP: default: break; // Not a instruction
+		}
+
+		if (!sim->error) pc = next;
+	}
+
+	sim->state = !sim->error && pc < program->length ? BF_RUN_READY : BF_RUN_ENDED;
+	goto L_STOP;
+
+	// The input isn't counted, it's read again when the run goes on
+L_WAIT:
+#if INTERPRETER_PROFILED
+	--profile->hits[program->origin[pc]];
+#endif
+	sim->state = BF_RUN_WAITING;
+
+L_STOP:
+	// The faulting instruction counts as executed, just like in the other engines
+	if (pc < program->length) sim->ip = program->origin[pc] + (sim->error ? 1 : 0);
+	else sim->ip = program->instructions;
+
+	BF_FlushOutput(sim);
+	return steps;
+
+#undef AT
+#undef HOT_ENTER
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#define read	_read
+#define write	_write
+#else
+#include <unistd.h>
+#endif
+
+#include "bf.h"
+
+#define DEFAULT_IO_BUFFER_SIZE		(64 * 1024)
+
+// A non blocking descriptor that has nothing to read yet makes the run wait for it
+int64_t BF_ReadDescriptor(void *handle, char *data, size_t length) {
+	int64_t result = read((int)(intptr_t)handle, data, length);
+	return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? BF_IO_PENDING : result;
+}
+
+int64_t BF_WriteDescriptor(void *handle, char *data, size_t length) {
+	return write((int)(intptr_t)handle, data, length);
+}
+
+static int64_t NoInput(void *handle, char *data, size_t length) {
+	return 0;
+}
+
+static int64_t NoOutput(void *handle, char *data, size_t length) {
+	return length;
+}
+
+static void StreamInit(BF_IOStream *stream, BF_IOHandler handler, void *handle) {
+	stream->handler = handler;
+	stream->handle = handle;
+	stream->used = stream->length = 0;
+
+	if (!stream->storage) {
+		stream->storageCapacity = DEFAULT_IO_BUFFER_SIZE;
+		stream->storage = malloc(stream->storageCapacity);
+	}
+
+	stream->span = false;
+	stream->buffer = stream->storage;
+	stream->capacity = stream->storageCapacity;
+}
+
+void BF_SetIO(BF_SimulationContext *sim, BF_IOHandler read, void *input, BF_IOHandler write, void *output, uint8_t flags) {
+	BF_FlushOutput(sim);
+
+	StreamInit(&sim->io.input, read ? read : &NoInput, input);
+	StreamInit(&sim->io.output, write ? write : &NoOutput, output);
+	sim->io.flags = flags;
+}
+
+// The whole span is in the buffer as if it was read at once, the handler is only asked for more (EOF) after it
+void BF_SetInputSpan(BF_SimulationContext *sim, const char *input, size_t length) {
+	BF_IOStream *stream = &sim->io.input;
+	StreamInit(stream, &NoInput, NULL);
+
+	stream->span = true;
+	stream->buffer = (char *)input;		// NoInput never writes to it
+	stream->length = stream->capacity = length;
+}
+
+void BF_SetOutputSpan(BF_SimulationContext *sim, char *output, size_t capacity) {
+	BF_FlushOutput(sim);
+
+	BF_IOStream *stream = &sim->io.output;
+	StreamInit(stream, &NoOutput, NULL);
+
+	// An empty span drops everything from the start
+	stream->span = true;
+	if (capacity) {
+		stream->buffer = output;
+		stream->capacity = capacity;
+	}
+}
+
+void BF_SetIODescriptors(BF_SimulationContext *sim, int input, int output, uint8_t flags) {
+	BF_SetIO(sim, &BF_ReadDescriptor, (void *)(intptr_t)input, &BF_WriteDescriptor, (void *)(intptr_t)output, flags);
+}
+
+void BF_FlushOutput(BF_SimulationContext *sim) {
+	BF_IOStream *output = &sim->io.output;
+
+	if (output->span) {
+		// Already where the caller wants it, the span only moves to the storage once it's full
+		if (output->buffer != output->storage) {
+			output->length = output->used;
+			if (output->used < output->capacity) return;
+
+			output->buffer = output->storage;
+			output->capacity = output->storageCapacity;
+		}
+
+		output->used = 0;	// Past the span, dropped
+		return;
+	}
+
+	size_t written = 0;
+	while(written < output->used) {
+		int64_t result = (*output->handler)(output->handle, output->buffer + written, output->used - written);
+		if (result <= 0) break;	// Nothing else we can do with the output
+
+		written += result;
+	}
+
+	output->used = 0;
+}
+
+// Writes a whole block at once, flushed by the same rules as the bytes printed one by one
+void BF_WriteOutput(BF_SimulationContext *sim, const char *data, size_t length) {
+	BF_IOStream *output = &sim->io.output;
+	bool newline = (sim->io.flags & BF_IO_LINE_BUFFERED) && memchr(data, '\n', length);
+
+	while (length > 0) {
+		size_t chunk = output->capacity - output->used;
+		if (chunk > length) chunk = length;
+
+		memcpy(output->buffer + output->used, data, chunk);
+		output->used += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (output->used >= output->capacity) BF_FlushOutput(sim);
+	}
+
+	if ((sim->io.flags & BF_IO_INTERACTIVE) || newline) BF_FlushOutput(sim);
+}
+
+int BF_ReadInput(BF_SimulationContext *sim) {
+	BF_IOStream *input = &sim->io.input;
+
+	// Whatever was printed so far is probably a prompt for this input
+	BF_FlushOutput(sim);
+
+	if (input->used >= input->length) {
+		int64_t result = (*input->handler)(input->handle, input->buffer, input->capacity);
+
+		input->used = 0;
+		input->length = result > 0 ? result : 0;
+		if (result == BF_IO_PENDING) return BF_IO_PENDING;
+		if (result <= 0) return EOF;
+	}
+
+	return (unsigned char)input->buffer[input->used++];
+}
+
+void BF_FreeIO(BF_SimulationContext *sim) {
+	BF_FlushOutput(sim);
+
+	free(sim->io.input.storage);
+	free(sim->io.output.storage);
+}
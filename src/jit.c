@@ -0,0 +1,673 @@
+#if defined(__linux__)
+#define _GNU_SOURCE		// REG_RIP
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define BF_JIT_SUPPORTED	1
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+/*
+ * State shared between the generated code and the C side.
+ * The generated code reads and writes the fields by their offsets, so the layout must not change
+ * without updating the emitter.
+ */
+typedef struct {
+	char *memory;
+	size_t length;
+	size_t dp;
+	uint64_t steps;
+	uint32_t ip;		// Instruction that faulted, or the input that is pending
+	int32_t shift;		// Shift of the faulted access
+	BF_SimulationContext *sim;
+} JitState;
+
+#define JIT_EXIT_DONE		0
+#define JIT_EXIT_FAULT		1
+#define JIT_EXIT_WAIT		2
+
+typedef struct {
+	uint32_t at;		// Offset of an instruction that accesses a cell
+	uint32_t stub;		// Offset of the stub that reports its fault
+} JitSite;
+
+struct BF_JitProgram {
+	int (*entry)(JitState *state);
+	void *code;
+	size_t size;
+	uint32_t begin, end;	// Instructions it was compiled from, it starts at begin and leaves at end
+
+	// Guarded programs don't check their accesses, faults are redirected to the stubs by the signal handler
+	bool guarded;
+	JitSite *sites;
+	size_t sitesLength;
+};
+
+#if BF_JIT_SUPPORTED
+
+// Cells are written as their low byte, which is the first on x86-64
+static void JitPrint(char *cell, BF_SimulationContext *sim) {
+	BF_WriteOutput(sim, cell, 1);
+}
+
+// Whether the input is pending, the generated code leaves then
+static int JitInput(char *cell, BF_SimulationContext *sim) {
+	int chr = BF_ReadInput(sim);
+	if (chr >= 0) *cell = chr;
+	return chr == BF_IO_PENDING;
+}
+
+static void JitWrite(const BF_Data *data, BF_SimulationContext *sim) {
+	BF_WriteOutput(sim, data->bytes, data->length);
+}
+
+static void JitFill(char *cell, const BF_Data *data) {
+	memcpy(cell, data->bytes, data->length);
+}
+
+static size_t JitScan(BF_SimulationContext *sim, size_t dp, int32_t stride) {
+	if (stride > 0) return BF_ScanRight(sim->memory.buffer, sim->memory.length, dp, stride);
+	return BF_ScanLeft(sim->memory.buffer, sim->memory.length, dp, -stride);
+}
+
+// Register numbers, as encoded in ModRM/SIB fields
+#define RAX		0
+#define RCX		1
+#define RBX		3
+
+typedef struct {
+	uint32_t at;		// Offset of the rel32 to patch
+	uint32_t target;	// Instruction index to jump to
+} Fixup;
+
+typedef struct {
+	uint32_t at;		// Offset of the jae (or jnz) rel32 to patch, or of the access itself on guarded memory
+	uint32_t ip;
+	int32_t shift;
+	uint32_t steps;		// Steps executed in the block up to and including the faulting instruction
+	int exit;			// JIT_EXIT_FAULT, or JIT_EXIT_WAIT after an input that is pending
+} FaultStub;
+
+typedef struct {
+	uint8_t *buffer;
+	size_t used, allocated;
+
+	Fixup *fixups;
+	size_t fixupsUsed, fixupsAllocated;
+
+	FaultStub *faults;
+	size_t faultsUsed, faultsAllocated;
+
+	uint32_t pending;	// Steps not yet added to r13
+	bool checked;		// rbx was verified to be in range since the last move or label
+	bool guarded;		// The memory has guard pages, accesses are not checked
+} Emitter;
+
+static void Emit(Emitter *e, const uint8_t *bytes, size_t length) {
+	if (e->used + length > e->allocated) {
+		while(e->used + length > e->allocated) e->allocated = e->allocated ? e->allocated * 2 : 4096;
+		e->buffer = realloc(e->buffer, e->allocated);
+	}
+
+	memcpy(e->buffer + e->used, bytes, length);
+	e->used += length;
+}
+
+#define EMIT(...)	do { const uint8_t __bytes[] = { __VA_ARGS__ }; Emit(e, __bytes, sizeof __bytes); } while(0)
+#define IMM32(v)	(uint8_t)(v), (uint8_t)((uint32_t)(v) >> 8), (uint8_t)((uint32_t)(v) >> 16), (uint8_t)((uint32_t)(v) >> 24)
+#define SIB(index)	(uint8_t)(((index) << 3) | 4)	// [r12 + index]
+
+static void EmitJump(Emitter *e, const uint8_t *opcode, size_t length, uint32_t target) {
+	Emit(e, opcode, length);
+
+	if (e->fixupsUsed >= e->fixupsAllocated) {
+		e->fixupsAllocated = e->fixupsAllocated ? e->fixupsAllocated * 2 : 64;
+		e->fixups = realloc(e->fixups, e->fixupsAllocated * sizeof(Fixup));
+	}
+	e->fixups[e->fixupsUsed++] = (Fixup){ .at = e->used, .target = target };
+
+	EMIT(IMM32(0));
+}
+
+// add r13, pending
+static void EmitFlushSteps(Emitter *e) {
+	if (!e->pending) return;
+
+	EMIT(0x49, 0x81, 0xC5, IMM32(e->pending));
+	e->pending = 0;
+}
+
+static void AddStub(Emitter *e, FaultStub stub) {
+	if (e->faultsUsed >= e->faultsAllocated) {
+		e->faultsAllocated = e->faultsAllocated ? e->faultsAllocated * 2 : 64;
+		e->faults = realloc(e->faults, e->faultsAllocated * sizeof(FaultStub));
+	}
+	e->faults[e->faultsUsed++] = stub;
+}
+
+static void AddFault(Emitter *e, uint32_t ip, int32_t shift) {
+	AddStub(e, (FaultStub){ .at = e->used, .ip = ip, .shift = shift, .steps = e->pending, .exit = JIT_EXIT_FAULT });
+}
+
+/*
+ * Verifies that dp + shift is inside the memory, and returns the register that holds the index of the
+ * cell (rbx for the current cell, rax for shifted cells).
+ * The check is elided for the current cell if it was already checked in this block, and on guarded
+ * memory altogether (the access itself is the check).
+ */
+static uint8_t EmitCellIndex(Emitter *e, uint32_t ip, int32_t shift) {
+	uint8_t index = RBX;
+	if (e->guarded) {
+		return RBX;
+	} else if (shift) {
+		EMIT(0x48, 0x8D, 0x83, IMM32(shift));	// lea rax, [rbx + shift]
+		EMIT(0x4C, 0x39, 0xF0);					// cmp rax, r14
+		index = RAX;
+	} else if (e->checked) {
+		return RBX;
+	} else {
+		EMIT(0x4C, 0x39, 0xF3);					// cmp rbx, r14
+		e->checked = true;
+	}
+
+	EMIT(0x0F, 0x83);							// jae fault
+	AddFault(e, ip, shift);
+	EMIT(IMM32(0));
+
+	return index;
+}
+
+/*
+ * Emits `opcode byte [cell], immediate` (or `opcode reg, byte [cell]`), where the cell is [r12 + index] after
+ * EmitCellIndex, or [r12 + rbx + shift] on guarded memory.
+ */
+static void EmitCellAccess(Emitter *e, uint32_t ip, int32_t shift, uint8_t index, uint8_t opcode, uint8_t reg, int immediate) {
+	if (e->guarded) {
+		AddFault(e, ip, shift);
+		EMIT(0x41, opcode, (uint8_t)(0x84 | (reg << 3)), 0x1C, IMM32(shift));
+	} else {
+		EMIT(0x41, opcode, (uint8_t)(0x04 | (reg << 3)), SIB(index));
+	}
+
+	if (immediate >= 0) EMIT((uint8_t)immediate);
+}
+
+// call function (The arguments are already in place)
+static void EmitCallAddress(Emitter *e, uint64_t address) {
+	EMIT(0x48, 0xB8,						// mov rax, function
+		(uint8_t)address, (uint8_t)(address >> 8), (uint8_t)(address >> 16), (uint8_t)(address >> 24),
+		(uint8_t)(address >> 32), (uint8_t)(address >> 40), (uint8_t)(address >> 48), (uint8_t)(address >> 56));
+	EMIT(0xFF, 0xD0);						// call rax
+}
+
+// call function(cell, sim)
+static void EmitCall(Emitter *e, uint64_t function, uint32_t ip, int32_t shift, uint8_t index) {
+	if (e->guarded) {
+		EmitCellAccess(e, ip, shift, index, 0x8A, RAX, -1);	// mov al, [cell] (Fault here and not in the call)
+		EMIT(0x49, 0x8D, 0xBC, 0x1C, IMM32(shift));			// lea rdi, [r12 + rbx + shift]
+	} else {
+		EMIT(0x49, 0x8D, 0x3C, SIB(index));				// lea rdi, [r12 + index]
+	}
+
+	EMIT(0x49, 0x8B, 0x77, offsetof(JitState, sim));	// mov rsi, [r15 + sim]
+	EmitCallAddress(e, function);
+}
+
+// mov reg, address (rdi = 7, rsi = 6)
+static void EmitLoadAddress(Emitter *e, uint8_t reg, const void *pointer) {
+	uint64_t address = (uint64_t)(uintptr_t)pointer;
+	EMIT(0x48, (uint8_t)(0xB8 | reg),
+		(uint8_t)address, (uint8_t)(address >> 8), (uint8_t)(address >> 16), (uint8_t)(address >> 24),
+		(uint8_t)(address >> 32), (uint8_t)(address >> 40), (uint8_t)(address >> 48), (uint8_t)(address >> 56));
+}
+
+// Jump target of a control instruction, with the same semantics as BF_Run
+static uint32_t JumpTarget(const BF_Context *ctx, const BF_Instruction *instruction) {
+	size_t target = instruction->operand1;
+	if (instruction->type != BF_WHILE_END) ++target;
+
+	return target < ctx->length ? target : ctx->length;
+}
+
+static bool FitsInt32(int64_t value) {
+	return INT32_MIN <= value && value <= INT32_MAX;
+}
+
+static bool EmitInstruction(Emitter *e, const BF_Context *ctx, uint32_t ip) {
+	static const uint8_t JZ[] = { 0x0F, 0x84 }, JNZ[] = { 0x0F, 0x85 };
+
+	const BF_Instruction *instruction = &ctx->instructions[ip];
+	int32_t shift = 0;
+	uint8_t value = instruction->operand1, index;
+
+	++e->pending;
+	switch(instruction->type) {
+	case BF_NOP: break;
+
+	case BF_MVL:
+	case BF_MVR: {
+		int64_t motion = instruction->type == BF_MVL ? -(int64_t)instruction->operand1 : instruction->operand1;
+		if (!FitsInt32(motion)) return false;
+
+		EMIT(0x48, 0x81, 0xC3, IMM32(motion));	// add rbx, motion
+		e->checked = false;
+		break;
+	}
+
+	case BF_DEC: value = -instruction->operand1;
+		/* fallthrough */
+	case BF_INC:
+		index = EmitCellIndex(e, ip, 0);
+		EmitCellAccess(e, ip, 0, index, 0x80, 0, value);		// add byte [cell], value
+		break;
+
+	case BF_DCL: value = -instruction->operand1;
+		/* fallthrough */
+	case BF_ICL: shift = -instruction->operand2; goto Add;
+	case BF_DCR: value = -instruction->operand1;
+		/* fallthrough */
+	case BF_ICR: shift = instruction->operand2;
+	Add:
+		index = EmitCellIndex(e, ip, shift);
+		EmitCellAccess(e, ip, shift, index, 0x80, 0, value);	// add byte [cell], value
+		break;
+
+	case BF_STL: shift = -instruction->operand2; goto Set;
+	case BF_STR: shift = instruction->operand2; goto Set;
+	case BF_SET:
+	Set:
+		index = EmitCellIndex(e, ip, shift);
+		EmitCellAccess(e, ip, shift, index, 0xC6, 0, value);	// mov byte [cell], value
+		break;
+
+	case BF_MUL: {
+		shift = instruction->operand2;
+		index = EmitCellIndex(e, ip, 0);
+		EmitCellAccess(e, ip, 0, index, 0x8A, RCX, -1);			// mov cl, byte [cell]
+
+		// The target isn't touched (nor checked) by a loop that isn't entered
+		EMIT(0x84, 0xC9);										// test cl, cl
+		EMIT(0x0F, 0x84, IMM32(0));								// jz skip
+		uint32_t skip = e->used;
+		if (value != 1) EMIT(0x69, 0xC9, IMM32(value));		// imul ecx, ecx, value
+
+		index = EmitCellIndex(e, ip, shift);
+		EmitCellAccess(e, ip, shift, index, 0x00, RCX, -1);		// add byte [cell + shift], cl
+
+		uint32_t distance = e->used - skip;
+		memcpy(e->buffer + skip - 4, &distance, 4);
+		break;
+	}
+
+	case BF_COUNT: {
+		// The division by the step is made at compile time, only the check of the cell and the scaling are left
+		uint8_t step = value, shift = 0, mask = 0xFF;
+		for(; step && !(step & 1); step >>= 1, ++shift, mask >>= 1);
+
+		index = EmitCellIndex(e, ip, 0);
+		uint32_t again = e->used;
+		if (!step) EmitCellAccess(e, ip, 0, index, 0x80, 7, 0x00);			// cmp byte [cell], 0
+		else if (shift) EmitCellAccess(e, ip, 0, index, 0xF6, 0, (1 << shift) - 1);	// test byte [cell], low bits
+		if (!step || shift) EMIT(0x0F, 0x85, IMM32(again - (e->used + 6)));	// jnz again (Never gets to 0)
+		if (!step) break;
+
+		EmitCellAccess(e, ip, 0, index, 0x8A, RCX, -1);			// mov cl, byte [cell]
+		EMIT(0xF6, 0xD9);										// neg cl
+		EMIT(0x0F, 0xB6, 0xC9);									// movzx ecx, cl
+		if (shift) EMIT(0xC1, 0xE9, shift);						// shr ecx, shift
+		EMIT(0x69, 0xC9, IMM32(BF_InverseOf(step)));			// imul ecx, ecx, 1 / step
+		EMIT(0x81, 0xE1, IMM32(mask));							// and ecx, mask
+		EmitCellAccess(e, ip, 0, index, 0x88, RCX, -1);			// mov byte [cell], cl
+		break;
+	}
+
+	case BF_SCANL:
+	case BF_SCANR: {
+		int64_t stride = instruction->type == BF_SCANL ? -(int64_t)instruction->operand1 : instruction->operand1;
+		if (!FitsInt32(stride)) return false;
+
+		EMIT(0x49, 0x8B, 0x7F, offsetof(JitState, sim));	// mov rdi, [r15 + sim]
+		EMIT(0x48, 0x89, 0xDE);								// mov rsi, rbx
+		EMIT(0xBA, IMM32(stride));							// mov edx, stride
+		EmitCallAddress(e, (uint64_t)(uintptr_t)&JitScan);
+		EMIT(0x48, 0x89, 0xC3);								// mov rbx, rax
+
+		// The scan stops on the first cell out of the memory, touching it raises the error (or grows the memory)
+		e->checked = false;
+		index = EmitCellIndex(e, ip, 0);
+		if (e->guarded) EmitCellAccess(e, ip, 0, index, 0x80, 7, 0x00);	// cmp byte [cell], 0
+		break;
+	}
+
+	case BF_PRT:
+		shift = instruction->operand2;
+		index = EmitCellIndex(e, ip, shift);
+		EmitCall(e, (uint64_t)(uintptr_t)&JitPrint, ip, shift, index);
+		break;
+
+	case BF_INP:
+		shift = instruction->operand2;
+		index = EmitCellIndex(e, ip, shift);
+		EmitCall(e, (uint64_t)(uintptr_t)&JitInput, ip, shift, index);
+
+		// A pending input leaves with ip on it, the input itself isn't counted
+		EMIT(0x85, 0xC0);						// test eax, eax
+		EMIT(0x0F, 0x85);						// jnz wait
+		AddStub(e, (FaultStub){ .at = e->used, .ip = ip, .steps = e->pending - 1, .exit = JIT_EXIT_WAIT });
+		EMIT(IMM32(0));
+		break;
+
+	case BF_WRITE:
+		EmitLoadAddress(e, 7, &ctx->data[instruction->operand1]);	// mov rdi, data
+		EMIT(0x49, 0x8B, 0x77, offsetof(JitState, sim));			// mov rsi, [r15 + sim]
+		EmitCallAddress(e, (uint64_t)(uintptr_t)&JitWrite);
+		break;
+
+	case BF_FILL: {
+		// Both ends of the cells are checked (or touched on guarded memory) before the copy, the copy can't fault
+		int64_t last = ctx->data[instruction->operand1].length - 1;
+		if (!FitsInt32(last)) return false;
+
+		index = EmitCellIndex(e, ip, 0);
+		if (e->guarded) EmitCellAccess(e, ip, 0, index, 0x80, 7, 0x00);		// cmp byte [cell], 0
+		index = EmitCellIndex(e, ip, last);
+		if (e->guarded) EmitCellAccess(e, ip, last, index, 0x80, 7, 0x00);	// cmp byte [cell + last], 0
+
+		EMIT(0x49, 0x8D, 0x3C, SIB(RBX));								// lea rdi, [r12 + rbx]
+		EmitLoadAddress(e, 6, &ctx->data[instruction->operand1]);		// mov rsi, data
+		EmitCallAddress(e, (uint64_t)(uintptr_t)&JitFill);
+		break;
+	}
+
+	case BF_LBL:
+	case BF_WHILE:
+	case BF_RPT:
+	case BF_WHILE_END:
+		index = EmitCellIndex(e, ip, 0);
+		EmitFlushSteps(e);
+		EmitCellAccess(e, ip, 0, index, 0x80, 7, 0x00);		// cmp byte [cell], 0
+
+		if (instruction->type == BF_LBL || instruction->type == BF_WHILE)
+			EmitJump(e, JZ, sizeof JZ, JumpTarget(ctx, instruction));
+		else
+			EmitJump(e, JNZ, sizeof JNZ, JumpTarget(ctx, instruction));
+
+		if (instruction->type == BF_WHILE)
+			EmitCellAccess(e, ip, 0, index, 0x80, 0, 0xFF);	// add byte [cell], -1
+		break;
+
+	default: return false;	// Unknown instruction
+	}
+
+	return true;
+}
+
+static void EmitterFree(Emitter *e) {
+	free(e->buffer);
+	free(e->fixups);
+	free(e->faults);
+}
+
+/*
+ * Compiles the instructions from begin up to end, which is where the code returns from. The labels are
+ * indexed from begin, and a jump out of the range fails the compilation.
+ */
+static BF_JitProgram *Compile(const BF_Context *ctx, uint32_t begin, uint32_t end, uint8_t memoryFlags) {
+	// The code is emitted for byte cells, wider ones are left to the threaded engine
+	if (ctx->length >= UINT32_MAX || ctx->cellSize != 1) return NULL;
+
+	Emitter emitter = { .guarded = memoryFlags & CTX_MEMORY_GUARDED }, *e = &emitter;
+	uint32_t *labels = malloc((end - begin + 1) * sizeof(uint32_t));
+	bool *targets = calloc(end - begin + 1, sizeof(bool));
+
+	bool compiled = true;
+	for(size_t i = begin; i < end; ++i) {
+		switch(ctx->instructions[i].type) {
+		case BF_LBL: case BF_RPT: case BF_WHILE: case BF_WHILE_END: {
+			uint32_t target = JumpTarget(ctx, &ctx->instructions[i]);
+			if (target < begin || target > end) compiled = false;
+			else targets[target - begin] = true;
+			break;
+		}
+		default: break;
+		}
+	}
+
+	EMIT(0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);	// push rbp, rbx, r12, r13, r14, r15
+	EMIT(0x48, 0x83, 0xEC, 0x08);										// sub rsp, 8 (Align the stack for calls)
+	EMIT(0x49, 0x89, 0xFF);												// mov r15, rdi
+	EMIT(0x4D, 0x8B, 0x67, offsetof(JitState, memory));				// mov r12, [r15 + memory]
+	EMIT(0x4D, 0x8B, 0x77, offsetof(JitState, length));				// mov r14, [r15 + length]
+	EMIT(0x49, 0x8B, 0x5F, offsetof(JitState, dp));					// mov rbx, [r15 + dp]
+	EMIT(0x4D, 0x8B, 0x6F, offsetof(JitState, steps));				// mov r13, [r15 + steps]
+
+	for(uint32_t i = begin; compiled && i <= end; ++i) {
+		if (targets[i - begin]) {
+			EmitFlushSteps(e);
+			e->checked = false;
+		}
+		labels[i - begin] = e->used;
+
+		if (i < end) compiled = EmitInstruction(e, ctx, i);
+	}
+
+	// Normal exit
+	EmitFlushSteps(e);
+	EMIT(0x31, 0xC0);													// xor eax, eax
+	uint32_t epilogue = e->used;
+	EMIT(0x49, 0x89, 0x5F, offsetof(JitState, dp));					// mov [r15 + dp], rbx
+	EMIT(0x4D, 0x89, 0x6F, offsetof(JitState, steps));				// mov [r15 + steps], r13
+	EMIT(0x48, 0x83, 0xC4, 0x08);										// add rsp, 8
+	EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D);	// pop r15, r14, r13, r12, rbx, rbp
+	EMIT(0xC3);															// ret
+
+	// Out of range accesses and pending inputs, report the instruction back to the C side
+	JitSite *sites = e->guarded ? malloc((e->faultsUsed + 1) * sizeof(JitSite)) : NULL;
+	size_t sitesLength = 0;
+	for(size_t i = 0; compiled && i < e->faultsUsed; ++i) {
+		const FaultStub *fault = &e->faults[i];
+		if (e->guarded && fault->exit == JIT_EXIT_FAULT) {
+			sites[sitesLength++] = (JitSite){ .at = fault->at, .stub = e->used };
+		} else {
+			int32_t rel = e->used - (fault->at + 4);
+			memcpy(e->buffer + fault->at, &rel, sizeof rel);
+		}
+
+		if (fault->steps) EMIT(0x49, 0x81, 0xC5, IMM32(fault->steps));	// add r13, steps
+		EMIT(0x41, 0xC7, 0x47, offsetof(JitState, ip), IMM32(fault->ip));		// mov dword [r15 + ip], ip
+		EMIT(0x41, 0xC7, 0x47, offsetof(JitState, shift), IMM32(fault->shift));	// mov dword [r15 + shift], shift
+		EMIT(0xB8, IMM32(fault->exit));									// mov eax, exit
+		EMIT(0xE9, IMM32(epilogue - (e->used + 5)));					// jmp epilogue
+	}
+
+	for(size_t i = 0; compiled && i < e->fixupsUsed; ++i) {
+		int32_t rel = labels[e->fixups[i].target - begin] - (e->fixups[i].at + 4);
+		memcpy(e->buffer + e->fixups[i].at, &rel, sizeof rel);
+	}
+
+	free(labels);
+	free(targets);
+
+	if (!compiled) {
+		free(sites);
+		EmitterFree(e);
+		return NULL;
+	}
+
+	void *code = mmap(NULL, e->used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(sites);
+		EmitterFree(e);
+		return NULL;
+	}
+
+	memcpy(code, e->buffer, e->used);
+	if (mprotect(code, e->used, PROT_READ | PROT_EXEC)) {
+		munmap(code, e->used);
+		free(sites);
+		EmitterFree(e);
+		return NULL;
+	}
+
+	BF_JitProgram *program = malloc(sizeof(BF_JitProgram));
+	program->code = code;
+	program->size = e->used;
+	program->begin = begin;
+	program->end = end;
+	program->entry = (int (*)(JitState *))code;
+	program->guarded = e->guarded;
+	program->sites = sites;
+	program->sitesLength = sitesLength;
+
+	EmitterFree(e);
+	return program;
+}
+
+BF_JitProgram *BF_JitCompile(const BF_Context *ctx, uint8_t memoryFlags) {
+	return ctx->length < UINT32_MAX ? Compile(ctx, 0, ctx->length, memoryFlags) : NULL;
+}
+
+BF_JitProgram *BF_JitCompileLoop(const BF_Context *ctx, size_t opener, uint8_t memoryFlags) {
+	if (ctx->length >= UINT32_MAX || opener >= ctx->length) return NULL;
+
+	BF_Operation type = ctx->instructions[opener].type;
+	size_t closer = ctx->instructions[opener].operand1;
+	if ((type != BF_LBL && type != BF_WHILE) || closer <= opener || closer >= ctx->length) return NULL;
+
+	return Compile(ctx, opener, closer + 1, memoryFlags);
+}
+
+void BF_JitFree(BF_JitProgram *program) {
+	if (!program) return;
+
+	munmap(program->code, program->size);
+	free(program->sites);
+	free(program);
+}
+
+static uintptr_t *InstructionPointer(void *ucontext) {
+#if defined(__linux__)
+	return (uintptr_t *)&((ucontext_t *)ucontext)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__APPLE__)
+	return (uintptr_t *)&((ucontext_t *)ucontext)->uc_mcontext->__ss.__rip;
+#else
+	return (uintptr_t *)&((ucontext_t *)ucontext)->uc_mcontext.mc_rip;
+#endif
+}
+
+// Resumes a faulting access at its stub, which exits the generated code with JIT_EXIT_FAULT
+static bool JitRecover(void *argument, void *ucontext) {
+	const BF_JitProgram *program = argument;
+	uintptr_t *rip = InstructionPointer(ucontext), code = (uintptr_t)program->code;
+	if (*rip < code || *rip >= code + program->size) return false;
+
+	uint32_t at = *rip - code;
+	size_t low = 0, high = program->sitesLength;
+	while(low < high) {
+		size_t middle = (low + high) / 2;
+		if (program->sites[middle].at < at) low = middle + 1;
+		else high = middle;
+	}
+
+	if (low >= program->sitesLength || program->sites[low].at != at) return false;
+
+	*rip = code + program->sites[low].stub;
+	return true;
+}
+
+#undef SIB
+#undef IMM32
+#undef EMIT
+
+#else
+
+BF_JitProgram *BF_JitCompile(const BF_Context *ctx, uint8_t memoryFlags) {
+	return NULL;	// No native backend for this platform
+}
+
+BF_JitProgram *BF_JitCompileLoop(const BF_Context *ctx, size_t opener, uint8_t memoryFlags) {
+	return NULL;
+}
+
+void BF_JitFree(BF_JitProgram *program) {}
+
+static bool JitRecover(void *argument, void *ucontext) {
+	return false;
+}
+
+#endif
+
+// Runs the code from dp, and leaves ip where the program goes on from (or past the instruction that faulted)
+static uint64_t JitEnter(BF_JitProgram *program, BF_SimulationContext *sim) {
+	JitState state = {
+		.memory = sim->memory.buffer,
+		.length = sim->memory.length,
+		.dp = sim->dp,
+		.steps = 0,
+		.sim = sim
+	};
+
+	sim->error = 0;
+	if (program->guarded) BF_SetFaultRecovery(&JitRecover, program);
+	int exit = (*program->entry)(&state);
+	if (program->guarded) BF_SetFaultRecovery(NULL, NULL);
+	sim->dp = state.dp;
+	sim->ip = program->end;
+	sim->state = program->end < sim->context->length ? BF_RUN_READY : BF_RUN_ENDED;
+
+	if (exit == JIT_EXIT_WAIT) {
+		sim->ip = state.ip;
+		sim->state = BF_RUN_WAITING;
+	} else if (exit == JIT_EXIT_FAULT) {
+		// Let the common path report the error, the same way the interpreter does
+		sim->ip = state.ip;
+		BF_ReadMemory(sim, state.shift);
+		sim->error = 1;
+		sim->state = BF_RUN_ENDED;
+		++sim->ip;
+	}
+
+	return state.steps;
+}
+
+uint64_t BF_JitRun(BF_JitProgram *program, BF_SimulationContext *sim) {
+	if (sim->state == BF_RUN_ENDED) return 0;
+
+	// The generated code only starts from the beginning, a run that stopped in the middle goes on threaded
+	if (sim->ip) return BF_RunThreaded(sim);
+
+	// Code compiled for guarded memory doesn't check its accesses
+	if (program->guarded && !(sim->memory.flags & CTX_MEMORY_GUARDED)) return BF_RunThreaded(sim);
+
+	// Growing or paging the memory would move it under the generated code
+	if (sim->memory.flags & (CTX_MEMORY_SCALABLE | CTX_MEMORY_PAGED)) return BF_RunThreaded(sim);
+
+	uint64_t steps = JitEnter(program, sim);
+	BF_FlushOutput(sim);
+
+	return steps;
+}
+
+uint64_t BF_JitRunLoop(BF_JitProgram *program, BF_SimulationContext *sim) {
+	return JitEnter(program, sim);
+}
+
+uint64_t BF_RunJit(BF_SimulationContext *sim) {
+	if (sim->memory.flags & (CTX_MEMORY_SCALABLE | CTX_MEMORY_PAGED) || sim->ip) return BF_RunThreaded(sim);
+
+	BF_JitProgram *program = BF_JitCompile(sim->context, sim->memory.flags);
+	if (!program) return BF_RunThreaded(sim);
+
+	uint64_t steps = BF_JitRun(program, sim);
+	BF_JitFree(program);
+	return steps;
+}
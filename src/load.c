@@ -1,104 +1,312 @@
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "bf.h"
 
-#define INSERT(op)	InstructionSetInsert(ctx, &alloc, (op), &s)
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_LOAD_MAPPED		1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__)
+#define BF_LOAD_VECTORIZED	1
+#include <emmintrin.h>
+#endif
+
+#define READ_BLOCK_SIZE			(1024 * 1024)
+#define MIN_INSTRUCTIONS		64
+#define MIN_STACK				64
+
+typedef struct {
+	size_t instruction;		// Index of the [
+	size_t offset;			// Byte offset of the [ in the source
+} Bracket;
 
 typedef struct {
-	uint32_t *buffer;
+	Bracket *buffer;
 	size_t used, allocated;
 } Stack;
 
-static void StackPush(Stack *s, uint32_t addr) {
-	if(s->used >= s->allocated) s->buffer = realloc(s->buffer, (s->allocated += 64) * sizeof(uint32_t));
-	s->buffer[s->used++] = addr;
-}
+typedef struct {
+	BF_Context *ctx;
+	size_t allocated;
+	Stack stack;
+	size_t offset;			// Bytes of the source lexed before the current block
+	BF_LoadError *error;
+} Lexer;
 
-static uint32_t StackPop(Stack *s) {
-	return s->buffer[--s->used];
-}
+// The operation of every command byte, BF_NOP for comments
+static const uint8_t gCommands[256] = {
+	['<'] = BF_MVL, ['>'] = BF_MVR, ['+'] = BF_INC, ['-'] = BF_DEC,
+	['.'] = BF_PRT, [','] = BF_INP, ['['] = BF_LBL, [']'] = BF_RPT,
+};
 
 uint8_t IsAggregatableOpcode(char op) {
 	return __BF_AGGREGATABLE_START__ <= op && op < __BF_AGGREGATABLE_END__;
 }
 
-void InstructionSetInsert(BF_Context *ctx, size_t *alloc, char operation, Stack *stack) {
-	// Can we aggregate?
-	if(ctx->length > 0 && IsAggregatableOpcode(operation) && operation == ctx->instructions[ctx->length - 1].type) {
-		ctx->instructions[ctx->length - 1].operand1++;
-		return;
-	} 
+static bool Fail(Lexer *lexer, uint8_t code, size_t offset) {
+	if (lexer->error) *lexer->error = (BF_LoadError){ .code = code, .offset = offset };
+	return false;
+}
+
+static bool StackPush(Stack *s, Bracket bracket) {
+	if(s->used >= s->allocated) {
+		size_t allocated = s->allocated ? 2 * s->allocated : MIN_STACK;
+		Bracket *buffer = realloc(s->buffer, allocated * sizeof(Bracket));
+		if (!buffer) return false;
 
-	if (ctx->length >= *alloc) {
-		ctx->instructions = realloc(ctx->instructions, (*alloc += 50) * sizeof(BF_Instruction));
+		s->buffer = buffer;
+		s->allocated = allocated;
 	}
 
-	if (IsAggregatableOpcode(operation) || operation == BF_INP || operation == BF_PRT) {
-		ctx->instructions[ctx->length++] = (BF_Instruction){ .type = operation, .operand1 = 1 };
-		return;
+	s->buffer[s->used++] = bracket;
+	return true;
+}
+
+static BF_Instruction *Append(Lexer *lexer) {
+	BF_Context *ctx = lexer->ctx;
+
+	if (ctx->length >= lexer->allocated) {
+		size_t allocated = lexer->allocated ? 2 * lexer->allocated : MIN_INSTRUCTIONS;
+		BF_Instruction *instructions = realloc(ctx->instructions, allocated * sizeof(BF_Instruction));
+		if (!instructions) return NULL;
+
+		ctx->instructions = instructions;
+		lexer->allocated = allocated;
 	}
 
-	if(operation == BF_LBL) {
-		ctx->instructions[ctx->length++] = (BF_Instruction){
-			.type = BF_LBL,
-			.operand1 = -1
-		};
-		StackPush(stack, ctx->length - 1);
-		return;
+	return &ctx->instructions[ctx->length++];
+}
+
+#if BF_LOAD_VECTORIZED
+
+// Lanes of the 16 bytes at p that hold a command
+static uint32_t CommandMask(const char *p) {
+	const __m128i cells = _mm_loadu_si128((const __m128i *)p);
+
+	// + , - . are consecutive, the rest are compared one by one
+	const __m128i punctuation = _mm_sub_epi8(cells, _mm_set1_epi8('+'));
+	__m128i found = _mm_cmpeq_epi8(_mm_min_epu8(punctuation, _mm_set1_epi8(3)), punctuation);
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(cells, _mm_set1_epi8('<')));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(cells, _mm_set1_epi8('>')));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(cells, _mm_set1_epi8('[')));
+	found = _mm_or_si128(found, _mm_cmpeq_epi8(cells, _mm_set1_epi8(']')));
+
+	return (uint32_t)_mm_movemask_epi8(found);
+}
+
+// Lanes of the 16 bytes at p that are not c
+static uint32_t MismatchMask(const char *p, char c) {
+	const __m128i cells = _mm_loadu_si128((const __m128i *)p);
+	return ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cells, _mm_set1_epi8(c))) & 0xFFFF;
+}
+
+#endif
+
+// First command at or after p, or end
+static const char *SkipComments(const char *p, const char *end) {
+#if BF_LOAD_VECTORIZED
+	for(; end - p >= 16; p += 16) {
+		uint32_t found = CommandMask(p);
+		if (found) return p + __builtin_ctz(found);
+	}
+#endif
+
+	for(; p < end && !gCommands[(uint8_t)*p]; ++p);
+	return p;
+}
+
+// End of the run of c that starts at p
+static const char *SkipRun(const char *p, const char *end, char c) {
+#if BF_LOAD_VECTORIZED
+	for(; end - p >= 16; p += 16) {
+		uint32_t found = MismatchMask(p, c);
+		if (found) return p + __builtin_ctz(found);
 	}
-	
-	// operation == BF_RPT
-	if(stack->used <= 0) {
-		printf("Unmached ] at byte %zu\n", ctx->length);
-		return;
+#endif
+
+	for(; p < end && *p == c; ++p);
+	return p;
+}
+
+/*
+ * Lexes one block of the source. Runs of moves and arithmetics are aggregated with the previous
+ * instruction (even across comments and blocks), so the blocks can be split anywhere.
+ */
+static bool LexBlock(Lexer *lexer, const char *source, size_t length) {
+	BF_Context *ctx = lexer->ctx;
+	const char *end = source + length;
+
+	for(const char *p = SkipComments(source, end); p < end; p = SkipComments(p, end)) {
+		BF_Operation operation = gCommands[(uint8_t)*p];
+		size_t offset = lexer->offset + (p - source);
+
+		if (IsAggregatableOpcode(operation)) {
+			const char *run = SkipRun(p + 1, end, *p);
+			uint32_t count = run - p;
+			p = run;
+
+			if (ctx->length > 0 && ctx->instructions[ctx->length - 1].type == operation) {
+				ctx->instructions[ctx->length - 1].operand1 += count;
+				continue;
+			}
+
+			BF_Instruction *instruction = Append(lexer);
+			if (!instruction) return Fail(lexer, BF_LOAD_OUT_OF_MEMORY, offset);
+
+			*instruction = (BF_Instruction){ .type = operation, .operand1 = count, .position = offset };
+			continue;
+		}
+
+		++p;
+		BF_Instruction *instruction = Append(lexer);
+		if (!instruction) return Fail(lexer, BF_LOAD_OUT_OF_MEMORY, offset);
+
+		switch(operation) {
+		case BF_PRT: case BF_INP:
+			*instruction = (BF_Instruction){ .type = operation, .operand1 = 1, .position = offset };
+			break;
+
+		case BF_LBL:
+			*instruction = (BF_Instruction){ .type = BF_LBL, .position = offset };
+			if (!StackPush(&lexer->stack, (Bracket){ ctx->length - 1, offset }))
+				return Fail(lexer, BF_LOAD_OUT_OF_MEMORY, offset);
+			break;
+
+		default: {	// BF_RPT
+			if (lexer->stack.used == 0) return Fail(lexer, BF_LOAD_UNMATCHED_CLOSE, offset);
+
+			size_t addr = lexer->stack.buffer[--lexer->stack.used].instruction;
+			ctx->instructions[addr].operand1 = ctx->length - 1;
+			*instruction = (BF_Instruction){ .type = BF_RPT, .operand1 = addr, .position = offset };
+			break;
+		}
+		}
 	}
 
-	uint32_t addr = StackPop(stack);
-	ctx->instructions[addr].operand1 = ctx->length;
-	ctx->instructions[ctx->length++] = (BF_Instruction){
-		.type = BF_RPT,
-		.operand1 = addr
-	};
+	lexer->offset += length;
+	return true;
 }
 
-BF_Context *BF_FromFile(FILE *handle) {
+static void BeginLexing(Lexer *lexer, BF_LoadError *error) {
 	BF_Context *ctx = malloc(sizeof(BF_Context));
 	ctx->instructions = NULL;
 	ctx->length = 0;
-	
-	Stack s = { .allocated = 0, .used = 0, .buffer = NULL };
-
-	size_t alloc = 0;
-	for(int c;(c = fgetc(handle)) > 0;) {
-		switch(c) {
-		case '<': INSERT(BF_MVL); break;
-		case '>': INSERT(BF_MVR); break;
-		case '+': INSERT(BF_INC); break;
-		case '-': INSERT(BF_DEC); break;
-		case '.': INSERT(BF_PRT); break;
-		case ',': INSERT(BF_INP); break;
-		case '[': INSERT(BF_LBL); break;
-		case ']': INSERT(BF_RPT); break;
-		default: continue;	// Invalid operation
-		}
+	ctx->data = NULL;
+	ctx->dataLength = 0;
+	ctx->image = NULL;
+	ctx->cellSize = 1;
+	ctx->imageLength = 0;
+
+	*lexer = (Lexer){ .ctx = ctx, .error = error };
+	if (error) *error = (BF_LoadError){ .code = BF_LOAD_OK };
+}
+
+// The lexed context, or NULL if lexing failed or a [ was never closed
+static BF_Context *EndLexing(Lexer *lexer, bool lexed) {
+	if (lexed && lexer->stack.used > 0)
+		lexed = Fail(lexer, BF_LOAD_UNMATCHED_OPEN, lexer->stack.buffer[lexer->stack.used - 1].offset);
+
+	free(lexer->stack.buffer);
+	if (lexed) return lexer->ctx;
+
+	BF_FreeContext(lexer->ctx);
+	return NULL;
+}
+
+BF_Context *BF_FromSource(const char *source, size_t length, BF_LoadError *error) {
+	Lexer lexer;
+	BeginLexing(&lexer, error);
+
+	return EndLexing(&lexer, LexBlock(&lexer, source, length));
+}
+
+BF_Context *BF_FromFile(void *handle, BF_LoadError *error) {
+	Lexer lexer;
+	BeginLexing(&lexer, error);
+
+	char *block = malloc(READ_BLOCK_SIZE);
+	bool lexed = block != NULL || Fail(&lexer, BF_LOAD_OUT_OF_MEMORY, 0);
+
+	for(size_t read; lexed && (read = fread(block, 1, READ_BLOCK_SIZE, handle)) > 0;) {
+		lexed = LexBlock(&lexer, block, read);
+	}
+
+	if (lexed && ferror(handle)) lexed = Fail(&lexer, BF_LOAD_IO_ERROR, lexer.offset);
+
+	free(block);
+	return EndLexing(&lexer, lexed);
+}
+
+#if BF_LOAD_MAPPED
+
+// Lexes the file straight from the page cache, NULL with *mapped = false if it can't be mapped
+static BF_Context *FromMapping(const char *source, BF_LoadError *error, bool *mapped) {
+	*mapped = false;
+
+	int descriptor = open(source, O_RDONLY);
+	if (descriptor < 0) return NULL;
+
+	struct stat info;
+	if (fstat(descriptor, &info) || !S_ISREG(info.st_mode) || info.st_size == 0) {
+		close(descriptor);
+		return NULL;
 	}
 
+	size_t length = info.st_size;
+	char *content = mmap(NULL, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (content == MAP_FAILED) return NULL;
+
+	madvise(content, length, MADV_SEQUENTIAL);
+	*mapped = true;
+
+	BF_Context *ctx = BF_FromSource(content, length, error);
+	munmap(content, length);
 	return ctx;
 }
 
-BF_Context *BF_Open(char *source) {
+#endif
+
+BF_Context *BF_Open(const char *source, BF_LoadError *error) {
+#if BF_LOAD_MAPPED
+	bool mapped;
+	BF_Context *ctx = FromMapping(source, error, &mapped);
+	if (mapped) return ctx;
+#endif
+
 	FILE *handle = fopen(source, "r");
 	if (!handle) {
+		if (error) *error = (BF_LoadError){ .code = BF_LOAD_IO_ERROR, .offset = 0 };
 		return NULL;
 	}
 
-	return BF_FromFile(handle);
+	BF_Context *loaded = BF_FromFile(handle, error);
+	fclose(handle);
+	return loaded;
+}
+
+const char *BF_LoadErrorMessage(const BF_LoadError *error) {
+	switch(error->code) {
+	case BF_LOAD_OK: return "No error";
+	case BF_LOAD_IO_ERROR: return "Failed to read the source";
+	case BF_LOAD_OUT_OF_MEMORY: return "Out of memory";
+	case BF_LOAD_UNMATCHED_OPEN: return "Unmatched [";
+	case BF_LOAD_UNMATCHED_CLOSE: return "Unmatched ]";
+	default: return "Unknown error";
+	}
 }
 
 void BF_FreeContext(BF_Context *ctx) {
+	BF_ReleaseCompiled(ctx);
+	for(size_t i = 0; i < ctx->dataLength; ++i) free(ctx->data[i].bytes);
+
+	free(ctx->data);
 	free(ctx->instructions);
 	free(ctx);
 }
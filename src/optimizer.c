@@ -1,4 +1,6 @@
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 
 #include "bf.h"
@@ -6,6 +8,15 @@
 #define OPTIMIZE_SET		"[-]+*"
 #define OPTIMIZE_LEFT_INC	"<*+*>*"
 
+#define MAX_MULTIPLY_TARGETS	32
+
+#define PATTERN_WINDOW			3			// How far past its first instruction a pattern reads, outside of loops
+#define PREFIX_STEP_BUDGET		(1 << 22)	// Steps run at compile time to evaluate the start of the program
+#define NO_PARENT				SIZE_MAX
+
+#define MARK_VISIT				BIT(0)
+#define MARK_LOOPS				BIT(1)		// The loops around the instruction are marked too
+
 static struct { BF_Operation a, b; } gInversePairs[] = {
 	{ BF_INC, BF_DEC },
 	{ BF_MVL, BF_MVR },
@@ -35,7 +46,7 @@ static BF_Operation GetInverseOf(BF_Operation o) {
 static bool SetPatternOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
 	size_t current = begin;
 	
-	uint8_t setValue = 0;
+	uint32_t setValue = 0;
 	// Must start with [-]
 	if (current >= ctx->length || inst[current].type != BF_LBL) return false;
 	++current;
@@ -45,16 +56,17 @@ static bool SetPatternOptimizer(BF_Instruction *inst, size_t begin, BF_Context *
 	++current;
 	
 	// If the next operation is INC or DEC, we can compress it into the set
-	if (inst[current].type == BF_INC || inst[current].type == BF_DEC) {
+	bool folded = current < ctx->length && (inst[current].type == BF_INC || inst[current].type == BF_DEC);
+	if (folded) {
 		setValue = inst[current].operand1;
 		if (inst[current].type == BF_DEC) {
-			setValue = 0xFF - inst[current].operand1;
+			setValue = -inst[current].operand1;
 		}
 	}
 
 	inst[begin].type = BF_SET;
-	inst[begin].operand1 = setValue;
-	BF_PassiveErase(inst + begin + 1, 2 + (setValue ? 1 : 0));
+	inst[begin].operand1 = setValue & BF_CELL_MASK(ctx->cellSize);
+	BF_PassiveErase(inst + begin + 1, 2 + (folded ? 1 : 0));
 	return true;
 }
 
@@ -71,7 +83,7 @@ static bool ShiftSetPatternOptimizer(BF_Instruction *inst, size_t begin, BF_Cont
 
 	++current;
 	if (current >= ctx->length || inst[current].type != GetInverseOf(shift)) return false;
-	
+	if (inst[current].operand1 != inst[begin].operand1) return false;
 	
 	inst[begin].type = shift == BF_MVL ? BF_STL : BF_STR;
 	inst[begin].operand2 = inst[begin].operand1;
@@ -83,29 +95,17 @@ static bool ShiftSetPatternOptimizer(BF_Instruction *inst, size_t begin, BF_Cont
 static bool UnusedJumpsOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
 	size_t current = begin;
 
-	size_t set = 0;
-	if(inst[current].type != BF_SET) return false;
-	set = inst[current].operand1;
+	if(inst[current].type != BF_SET || inst[current].operand1) return false;
 	++current;
 
-	if (current >= ctx->length || (inst[current].type != BF_RPT && inst[current].type != BF_LBL)) return false;
-	BF_Operation op = inst[current].type;
+	// [-][...] The loop is never entered
+	if (current >= ctx->length || (inst[current].type != BF_LBL && inst[current].type != BF_WHILE)) return false;
 
-	// [-][ OR [-]+*]
-	bool willAlwaysSkip = (op == BF_LBL && set) || (op == BF_RPT && !set);
-	if (willAlwaysSkip) {
-		BF_PassiveErase(inst + begin + 1, 1);
-		return true;
-	}
-
-	// [-]++[
-	bool willAlwaysJump = op == BF_LBL && !set;
-	if(willAlwaysJump) {
-		BF_PassiveErase(inst + begin + 1, inst[current].operand1 - inst[inst[current].operand1].operand1);
-		return true;
-	}
+	uint32_t end = inst[current].operand1;
+	if (end >= ctx->length || inst[end].operand1 != current) return false;
 
-	return false;
+	BF_PassiveErase(inst + current, end - current + 1);
+	return true;
 }
 
 static bool ShiftIncrementPatternOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
@@ -171,7 +171,7 @@ static bool ArithmaticsFoldingOptimizer(BF_Instruction *inst, size_t begin, BF_C
 		if(current >= ctx->length || ADDERS[i] != inst[current].type || shift != inst[current].operand2) break;
 
 		inst[begin].operand1 += inst[current].operand1;
-		BF_PassiveErase(inst + begin, 1);
+		BF_PassiveErase(inst + current, 1);
 		return true;
 	}
 
@@ -211,42 +211,144 @@ static bool InverseOperationOptimizer(BF_Instruction *inst, size_t begin, BF_Con
 	return false;
 } 
 
-static bool WhileLoopOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
+static bool IsUnitDecrement(const BF_Instruction *instruction) {
+	return instruction->type == BF_DEC && instruction->operand1 == 1;
+}
+
+static bool IsLoopOf(BF_Instruction *inst, size_t begin, BF_Operation opener, BF_Context *ctx) {
+	if (inst[begin].type != opener) return false;
+
+	uint32_t end = inst[begin].operand1;
+	return end < ctx->length && end > begin && inst[end].operand1 == begin;	// Optimizied away otherwise
+}
+
+static bool ScanLoopOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
+	// [>*] OR [<*]
+	if (!IsLoopOf(inst, begin, BF_LBL, ctx) || inst[begin].operand1 != begin + 2) return false;
+
+	const BF_Instruction *move = &inst[begin + 1];
+	if ((move->type != BF_MVL && move->type != BF_MVR) || !move->operand1) return false;
+
+	inst[begin].type = move->type == BF_MVL ? BF_SCANL : BF_SCANR;
+	inst[begin].operand1 = move->operand1;
+	BF_PassiveErase(inst + begin + 1, 2);
+	return true;
+}
+
+static bool MultiplyLoopOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
+	// [->+>++<<] OR [--->+<] Every iteration adds a constant to some neighbours and steps the loop cell by another
+	if (!IsLoopOf(inst, begin, BF_LBL, ctx) && !IsLoopOf(inst, begin, BF_WHILE, ctx)) return false;
+	uint32_t end = inst[begin].operand1;
+
+	int32_t offsets[MAX_MULTIPLY_TARGETS], deltas[MAX_MULTIPLY_TARGETS];
+	size_t count = 0;
+
+	int32_t dp = 0, step = inst[begin].type == BF_WHILE ? -1 : 0;
+	for(size_t i = begin + 1; i < end; ++i) {
+		int32_t offset = dp, delta = 0;
+		switch(inst[i].type) {
+		case BF_NOP: continue;
+		case BF_MVL: dp -= inst[i].operand1; continue;
+		case BF_MVR: dp += inst[i].operand1; continue;
+
+		case BF_INC: delta = inst[i].operand1; break;
+		case BF_DEC: delta = -inst[i].operand1; break;
+		case BF_ICL: offset -= inst[i].operand2; delta = inst[i].operand1; break;
+		case BF_ICR: offset += inst[i].operand2; delta = inst[i].operand1; break;
+		case BF_DCL: offset -= inst[i].operand2; delta = -inst[i].operand1; break;
+		case BF_DCR: offset += inst[i].operand2; delta = -inst[i].operand1; break;
+
+		default: return false;	// Anything else depends on the iteration
+		}
+
+		if (offset == 0) {
+			step += delta;
+			continue;
+		}
+
+		size_t k = 0;
+		for(; k < count && offsets[k] != offset; ++k);
+		if (k == count) {
+			if (count >= MAX_MULTIPLY_TARGETS) return false;
+			offsets[count] = offset;
+			deltas[count++] = 0;
+		}
+		deltas[k] += delta;
+	}
+
+	if (dp != 0) return false;
+
+	/*
+	 * An odd step reaches 0 from every cell, after -cell / step iterations (mod the cell size), so the division
+	 * is folded into the factors. An even step may never get there, the count replaces the cell with the
+	 * iterations (or runs forever like the loop) and the factors are the deltas.
+	 * A loop that runs forever touches its targets first, so a count is preceded by MULs of 0 that touch them
+	 * too, and fail the same way when they're out of the memory. It's left a loop when they don't fit in it.
+	 */
+	uint32_t mask = BF_CELL_MASK(ctx->cellSize), unit = step & mask;
+	bool odd = unit & 1;
+
+	size_t needed = 1;	// SET
+	for(size_t k = 0; k < count; ++k) needed += ((odd ? -deltas[k] * BF_InverseOf(unit) : deltas[k]) & mask) != 0;
+	if (!odd) needed += count + 1;
+	if (needed > end - begin + 1) return false;
+
 	size_t current = begin;
+	uint32_t position = inst[begin].position;
+	if (!odd) {
+		for(size_t k = 0; k < count; ++k)
+			inst[current++] = (BF_Instruction){ .type = BF_MUL, .operand1 = 0, .operand2 = (uint32_t)offsets[k], .position = position };
+		inst[current++] = (BF_Instruction){ .type = BF_COUNT, .operand1 = unit, .position = position };
+	}
 
+	for(size_t k = 0; k < count; ++k) {
+		uint32_t factor = (odd ? -deltas[k] * BF_InverseOf(unit) : deltas[k]) & mask;
+		if (!factor) continue;
+
+		inst[current++] = (BF_Instruction){ .type = BF_MUL, .operand1 = factor, .operand2 = (uint32_t)offsets[k], .position = position };
+	}
+
+	inst[current++] = (BF_Instruction){ .type = BF_SET, .operand1 = 0, .position = position };
+	BF_PassiveErase(inst + current, end - current + 1);
+	return true;
+}
+
+static bool WhileLoopOptimizer(BF_Instruction *inst, size_t begin, BF_Context *ctx) {
 	// [->*<] OR [>*<-] OR [-<*>]
-	if (inst[current].type != BF_LBL) return false;
+	if (!IsLoopOf(inst, begin, BF_LBL, ctx)) return false;
 	uint32_t end = inst[begin].operand1;
-	
-	if (end >= ctx->length || inst[end].type != BF_RPT) return false;	// Optimizied away
 	bool unpredictable = false;
 
-	++current;
-	bool frontDecrementor = current < ctx->length && inst[current].type == BF_DEC;
-	bool backDecrementor = end - 1 >= current && inst[end - 1].type == BF_DEC;
-	if(frontDecrementor || backDecrementor) {
-		int32_t motion = BF_SumMotion(inst, current + 1, end - current + 2, &unpredictable);
+	// Moving the decrement to the front is only safe when nothing else in the loop looks at the loop cell
+	bool frontDecrementor = IsUnitDecrement(&inst[begin + 1]);
+	bool backDecrementor = !frontDecrementor && end - 1 > begin + 1 && IsUnitDecrement(&inst[end - 1]);
+	if (!frontDecrementor && !backDecrementor) return false;
 
-		if (unpredictable || motion != 0) return false;
+	size_t bodyStart = frontDecrementor ? begin + 2 : begin + 1;
+	size_t bodyEnd = frontDecrementor ? end : end - 1;
+	for(size_t i = bodyStart; backDecrementor && i < bodyEnd; ++i) {
+		if (!IsAggregatableOpcode(inst[i].type) && inst[i].type != BF_NOP &&
+			(inst[i].type < BF_ICL || inst[i].type > BF_DCR)) return false;
+	}
 
-		int32_t delta = BF_CellDelta(inst, 0, current + 1, end - current + 1, &unpredictable);
-		if (unpredictable || delta != 0) return false;
+	int32_t motion = BF_SumMotion(inst, bodyStart, bodyEnd, &unpredictable);
+	if (unpredictable || motion != 0) return false;
 
-		if (frontDecrementor)
-			BF_PassiveErase(inst + begin, 2);
-		else
-			BF_PassiveErase(inst + end - 1, 2);
+	int32_t delta = BF_CellDelta(inst, 0, bodyStart, bodyEnd, &unpredictable);
+	if (unpredictable || delta != 0) return false;
 
-		inst[end].type = BF_WHILE_END;
-		inst[end].operand1 = begin;
+	if (frontDecrementor)
+		BF_PassiveErase(inst + begin, 2);
+	else
+		BF_PassiveErase(inst + end - 1, 2);
 
-		inst[begin].type = BF_WHILE;
-		inst[begin].operand1 = end;
+	inst[end].type = BF_WHILE_END;
+	inst[end].operand1 = begin;
 
-		return true;  
-	}
+	inst[begin].type = BF_WHILE;
+	inst[begin].operand1 = end;
 
-	return false;
+	return true;
 }
 
 static bool Optimize(BF_Instruction *inst, size_t j, BF_Context *ctx) {
@@ -258,6 +360,8 @@ static bool Optimize(BF_Instruction *inst, size_t j, BF_Context *ctx) {
 		&MergeConstantSetsOptimizer,
 		&UnusedJumpsOptimizer,
 		&ArithmaticsFoldingOptimizer,
+		&ScanLoopOptimizer,
+		&MultiplyLoopOptimizer,
 		&WhileLoopOptimizer,
 		NULL
 	};
@@ -269,15 +373,226 @@ static bool Optimize(BF_Instruction *inst, size_t j, BF_Context *ctx) {
 	return false;
 }
 
-void BF_OptimizeLevel1(BF_Context *ctx) {
-	// Perform stateless optimizations
+/*
+ * The forms of every instruction that can be moved by a deferred offset. PRT and INP carry their
+ * offset in operand2, the others become their left or right variant.
+ */
+static struct { BF_Operation here, left, right; } gShiftedForms[] = {
+	{ BF_INC, BF_ICL, BF_ICR },
+	{ BF_DEC, BF_DCL, BF_DCR },
+	{ BF_SET, BF_STL, BF_STR },
+	{ BF_PRT, BF_PRT, BF_PRT },
+	{ BF_INP, BF_INP, BF_INP },
+};
+static int gShiftedFormsLength = sizeof(gShiftedForms) / sizeof(gShiftedForms[0]);
+
+// Offset of the accessed cell from dp, and the family the instruction belongs to
+static bool ShiftOf(const BF_Instruction *instruction, int64_t *shift, int *form) {
+	BF_Operation type = instruction->type;
+
+	for(int i = 0; i < gShiftedFormsLength; ++i) {
+		if (type == gShiftedForms[i].here) *shift = type == BF_PRT || type == BF_INP ? (int32_t)instruction->operand2 : 0;
+		else if (type == gShiftedForms[i].left) *shift = -(int64_t)instruction->operand2;
+		else if (type == gShiftedForms[i].right) *shift = instruction->operand2;
+		else continue;
+
+		*form = i;
+		return true;
+	}
+
+	return false;
+}
+
+static BF_Instruction Shifted(const BF_Instruction *instruction, int form, int64_t shift) {
+	BF_Operation here = gShiftedForms[form].here;
+	BF_Instruction shifted = { .operand1 = instruction->operand1, .position = instruction->position };
+
+	if (here == BF_PRT || here == BF_INP) {
+		shifted.type = here;
+		shifted.operand2 = (uint32_t)(int32_t)shift;
+	} else {
+		shifted.type = shift == 0 ? here : shift < 0 ? gShiftedForms[form].left : gShiftedForms[form].right;
+		shifted.operand2 = shift < 0 ? -shift : shift;
+	}
+
+	return shifted;
+}
+
+/*
+ * Rewrites a basic block so its accesses are made relative to the dp it starts with, and the moves in
+ * between are replaced with a single move at the end:
+ *	>>+<.>>-	=>	ICR 1 2, PRINT 1, DCR 1 3, MVR 3
+ * The block is rewritten in place, since it holds at least one instruction for every access and one move
+ * if the net motion isn't 0.
+ */
+static bool DeferBlockMotion(BF_Instruction *inst, size_t begin, size_t end) {
+	int64_t offset = 0, shift;
+	int form;
+	size_t moves = 0;
+
+	// Offsets are signed 32 bit values
+	for(size_t i = begin; i < end; ++i) {
+		shift = 0;
+		if (inst[i].type == BF_MVL) offset -= inst[i].operand1, ++moves;
+		else if (inst[i].type == BF_MVR) offset += inst[i].operand1, ++moves;
+		else if (!ShiftOf(&inst[i], &shift, &form)) continue;
+
+		if (offset + shift < INT32_MIN || offset + shift > INT32_MAX || offset < INT32_MIN || offset > INT32_MAX) return false;
+	}
+
+	// Already a single move at the end
+	if (!moves || (moves == 1 && (inst[end - 1].type == BF_MVL || inst[end - 1].type == BF_MVR))) return false;
+
+	size_t current = begin;
+	uint32_t position = inst[end - 1].position;
+	offset = 0;
+	for(size_t i = begin; i < end; ++i) {
+		if (inst[i].type == BF_MVL) offset -= inst[i].operand1;
+		else if (inst[i].type == BF_MVR) offset += inst[i].operand1;
+		else if (ShiftOf(&inst[i], &shift, &form)) inst[current++] = Shifted(&inst[i], form, shift + offset);
+	}
+
+	if (offset) {
+		inst[current++] = (BF_Instruction){
+			.type = offset < 0 ? BF_MVL : BF_MVR, .operand1 = offset < 0 ? -offset : offset, .position = position
+		};
+	}
+	BF_PassiveErase(inst + current, end - current);
+	return true;
+}
+
+static bool IsDeferrable(const BF_Instruction *instruction) {
+	int64_t shift;
+	int form;
+	return instruction->type == BF_NOP || instruction->type == BF_MVL || instruction->type == BF_MVR ||
+		ShiftOf(instruction, &shift, &form);
+}
+
+static bool DeferMotion(BF_Context *ctx) {
+	bool deferred = false;
+
+	for(size_t begin = 0; begin < ctx->length;) {
+		size_t end = begin;
+		for(; end < ctx->length && IsDeferrable(&ctx->instructions[end]); ++end);
+
+		if (end > begin) deferred |= DeferBlockMotion(ctx->instructions, begin, end);
+		begin = end + 1;
+	}
+
+	return deferred;
+}
+
+static bool IsOpener(const BF_Instruction *instruction) {
+	return instruction->type == BF_LBL || instruction->type == BF_WHILE;
+}
+
+static bool IsCloser(const BF_Instruction *instruction) {
+	return instruction->type == BF_RPT || instruction->type == BF_WHILE_END;
+}
+
+// Innermost loop around every instruction (NO_PARENT at the top level)
+static void FindParents(const BF_Instruction *inst, size_t length, size_t *parents) {
+	size_t current = NO_PARENT;
+
+	for(size_t i = 0; i < length; ++i) {
+		parents[i] = current;
+
+		if (IsOpener(&inst[i])) current = i;
+		else if (IsCloser(&inst[i]) && current != NO_PARENT) current = parents[current];
+	}
+}
+
+/*
+ * A pattern starting at i reads at most PATTERN_WINDOW instructions ahead, or the whole loop it starts.
+ * So after a change at i, the patterns that could match now start in the window before it or at one of
+ * the loops around it.
+ */
+static void MarkAround(uint8_t *marks, const size_t *parents, size_t i) {
+	for(size_t j = i >= PATTERN_WINDOW ? i - PATTERN_WINDOW : 0; j <= i; ++j) marks[j] |= MARK_VISIT;
+
+	// Once a loop was climbed through, all of the loops around it are already marked
+	for(size_t parent = parents[i]; parent != NO_PARENT && !(marks[parent] & MARK_LOOPS); parent = parents[parent])
+		marks[parent] |= MARK_VISIT | MARK_LOOPS;
+}
+
+// Last instruction an optimization at i can modify
+static size_t Extent(const BF_Instruction *inst, size_t i, size_t length) {
+	size_t extent = i;
+
+	for(size_t j = i; j < length && j <= i + PATTERN_WINDOW; ++j) {
+		if (j > extent) extent = j;
+		if (IsOpener(&inst[j]) && inst[j].operand1 < length && inst[j].operand1 > extent) extent = inst[j].operand1;
+	}
+
+	return extent;
+}
+
+/*
+ * Runs the patterns over the program until none of them matches. The first sweep tries every instruction,
+ * and the following ones only the neighbourhoods of what the previous sweep changed, since a pattern that
+ * didn't match can only match once something it reads has changed. Instructions are visited from the end
+ * to the start like a full sweep would, so the result is the same.
+ */
+static void OptimizePatterns(BF_Context *ctx) {
+	BF_Instruction *inst = ctx->instructions;
+
+	bool *changed = malloc((ctx->length + 1) * sizeof(bool));
+	uint8_t *visit = malloc((ctx->length + 1) * sizeof(uint8_t));
+	size_t *parents = malloc((ctx->length + 1) * sizeof(size_t));
+	memset(changed, true, ctx->length * sizeof(bool));
+
 	size_t optimizations = 0;
 	do {
 		optimizations = 0;
+
+		FindParents(inst, ctx->length, parents);
+		memset(visit, 0, ctx->length * sizeof(uint8_t));
+		for(size_t i = 0; i < ctx->length; ++i) {
+			if (changed[i]) MarkAround(visit, parents, i);
+		}
+		memset(changed, false, ctx->length * sizeof(bool));
+
 		for(int64_t i = ctx->length - 1; i >= 0; --i) {
-			optimizations += Optimize(ctx->instructions, i, ctx);
+			if (!visit[i]) continue;
+
+			size_t extent = Extent(inst, i, ctx->length);
+			if (!Optimize(inst, i, ctx)) continue;
+
+			++optimizations;
+			memset(changed + i, true, (extent - i + 1) * sizeof(bool));
+			MarkAround(visit, parents, i);		// The instructions before it are still to come in this sweep
 		}
 
-		BF_FlattenProgram(ctx->instructions, &ctx->length);
+		BF_CompactProgram(inst, &ctx->length, changed);
 	} while(optimizations);		// Keep optimizing until there is nothing left to optimize
-}
\ No newline at end of file
+
+	free(changed);
+	free(visit);
+	free(parents);
+}
+
+void BF_OptimizeLevel1(BF_Context *ctx) {
+	// Perform stateless optimizations
+	OptimizePatterns(ctx);
+
+	// Then fold the moves that are left in every basic block into offsets
+	if (DeferMotion(ctx)) {
+		BF_CompactProgram(ctx->instructions, &ctx->length, NULL);
+		OptimizePatterns(ctx);
+	}
+}
+
+void BF_OptimizeLevel2(BF_Context *ctx) {
+	BF_OptimizeLevel1(ctx);
+
+	// Known cells turn arithmetics and whole loops into a few sets, which the patterns can fold again
+	if (BF_PropagateConstants(ctx)) BF_OptimizeLevel1(ctx);
+
+	// Then run what comes before the first input
+	BF_EvaluatePrefix(ctx, PREFIX_STEP_BUDGET);
+}
+
+void BF_Optimize(BF_Context *ctx, uint8_t level) {
+	if (level >= BF_OPT_MAX) BF_OptimizeLevel2(ctx);
+	else if (level >= BF_OPT_MIN) BF_OptimizeLevel1(ctx);
+}
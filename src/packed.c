@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+// Index of the instruction a control instruction jumps to, with the same semantics as BF_Run
+static size_t PackedTarget(const BF_Context *ctx, const BF_Instruction *instruction) {
+	size_t target = instruction->operand1;
+	if (instruction->type != BF_WHILE_END) ++target;
+
+	return target < ctx->length ? target : ctx->length;
+}
+
+static bool IsJump(BF_Operation type) {
+	return type == BF_LBL || type == BF_RPT || type == BF_WHILE || type == BF_WHILE_END;
+}
+
+/*
+ * The operands in the form the runner consumes them: moves, offsets and strides are signed, the decrements
+ * are folded into the value, and jumps are relative to the slot of the jump.
+ */
+static int64_t PackedOperand(const BF_Context *ctx, size_t i, const uint32_t *slots) {
+	const BF_Instruction *instruction = &ctx->instructions[i];
+
+	switch(instruction->type) {
+	case BF_MVL: case BF_SCANL: return -(int64_t)instruction->operand1;
+	case BF_MVR: case BF_SCANR: return instruction->operand1;
+
+	case BF_ICL: case BF_DCL: case BF_STL: return -(int64_t)instruction->operand2;
+	case BF_ICR: case BF_DCR: case BF_STR: return instruction->operand2;
+	case BF_MUL: case BF_PRT: case BF_INP: return (int32_t)instruction->operand2;
+	case BF_WRITE: case BF_FILL: return instruction->operand1;
+
+	case BF_LBL: case BF_RPT: case BF_WHILE: case BF_WHILE_END:
+		return (int64_t)slots[PackedTarget(ctx, instruction)] - slots[i];
+
+	default: return 0;
+	}
+}
+
+static uint32_t PackedValue(const BF_Instruction *instruction, uint32_t mask) {
+	switch(instruction->type) {
+	case BF_DEC: case BF_DCL: case BF_DCR: return -instruction->operand1 & mask;
+	default: return instruction->operand1 & mask;
+	}
+}
+
+// A value the runners read that doesn't fit in the slot (only with wide cells, 8 bit values always fit)
+static bool IsLongValue(const BF_Instruction *instruction, uint32_t mask) {
+	switch(instruction->type) {
+	case BF_INC: case BF_DEC: case BF_ICL: case BF_DCL: case BF_ICR: case BF_DCR:
+	case BF_SET: case BF_STL: case BF_STR: case BF_MUL: case BF_COUNT: {
+		uint32_t value = PackedValue(instruction, mask);
+		return ((uint32_t)(int8_t)value & mask) != value;
+	}
+	default: return false;
+	}
+}
+
+static bool FitsInt16(int64_t value) {
+	return INT16_MIN <= value && value <= INT16_MAX;
+}
+
+static bool FitsInt32(int64_t value) {
+	return INT32_MIN <= value && value <= INT32_MAX;
+}
+
+/*
+ * Lays out the slots of every instruction. Jumps start narrow and are widened when their distance doesn't
+ * fit, which can push other jumps out of range, so this repeats until nothing changes.
+ */
+static size_t LayoutSlots(const BF_Context *ctx, uint32_t *slots, bool *wide, const bool *longs) {
+	bool changed = true;
+
+	while (changed) {
+		changed = false;
+
+		size_t length = 0;
+		for(size_t i = 0; i < ctx->length; ++i) {
+			slots[i] = length;
+			length += 1 + wide[i] + longs[i];
+		}
+		slots[ctx->length] = length;
+
+		for(size_t i = 0; i < ctx->length; ++i) {
+			if (wide[i] || !IsJump(ctx->instructions[i].type)) continue;
+
+			if (!FitsInt16(PackedOperand(ctx, i, slots))) wide[i] = changed = true;
+		}
+	}
+
+	return slots[ctx->length];
+}
+
+BF_PackedProgram *BF_Pack(const BF_Context *ctx) {
+	if (ctx->length >= UINT32_MAX) return NULL;
+
+	const uint32_t mask = BF_CELL_MASK(ctx->cellSize);
+	uint32_t *slots = malloc((ctx->length + 1) * sizeof(uint32_t));
+	bool *wide = calloc(ctx->length + 1, sizeof(bool));
+	bool *longs = calloc(ctx->length + 1, sizeof(bool));
+
+	// Jump distances are bounded by the program length, the other operands don't depend on the layout
+	for(size_t i = 0; i < ctx->length; ++i) {
+		longs[i] = IsLongValue(&ctx->instructions[i], mask);
+		if (IsJump(ctx->instructions[i].type)) continue;
+
+		int64_t operand = PackedOperand(ctx, i, NULL);
+		if (!FitsInt32(operand)) {
+			free(slots);
+			free(wide);
+			free(longs);
+			return NULL;
+		}
+
+		wide[i] = !FitsInt16(operand);
+	}
+
+	size_t length = LayoutSlots(ctx, slots, wide, longs);
+
+	BF_PackedProgram *program = malloc(sizeof(BF_PackedProgram));
+	program->code = malloc((length + 1) * sizeof(BF_PackedOp));
+	program->origin = malloc((length + 1) * sizeof(uint32_t));
+	program->length = length;
+	program->instructions = ctx->length;
+	program->cellSize = ctx->cellSize;
+
+	for(size_t i = 0; i < ctx->length; ++i) {
+		BF_PackedOp *op = &program->code[slots[i]];
+		int64_t operand = PackedOperand(ctx, i, slots);
+		uint32_t value = PackedValue(&ctx->instructions[i], mask);
+
+		op->opcode = ctx->instructions[i].type;
+		op->value = value;
+		op->operand = 0;
+		program->origin[slots[i]] = i;
+
+		if (wide[i]) {
+			op->opcode |= BF_PACKED_WIDE;
+			op[1].wide = operand;
+			program->origin[slots[i] + 1] = i;
+		} else {
+			op->operand = operand;
+		}
+
+		if (longs[i]) {
+			op->opcode |= BF_PACKED_LONG;
+			op[1 + wide[i]].wide = value;
+			program->origin[slots[i] + 1 + wide[i]] = i;
+		}
+	}
+
+	free(slots);
+	free(wide);
+	free(longs);
+	return program;
+}
+
+BF_Context *BF_Unpack(const BF_PackedProgram *program) {
+	BF_Context *ctx = malloc(sizeof(BF_Context));
+	ctx->instructions = malloc((program->instructions + 1) * sizeof(BF_Instruction));
+	ctx->length = program->instructions;
+	ctx->data = NULL;		// The data isn't packed either, it's read from the context that was packed
+	ctx->dataLength = 0;
+	ctx->image = NULL;
+	ctx->imageLength = 0;
+	ctx->cellSize = program->cellSize;
+
+	const uint32_t mask = BF_CELL_MASK(program->cellSize);
+	for(size_t pc = 0; pc < program->length; ++pc) {
+		const BF_PackedOp *op = &program->code[pc];
+		const size_t at = pc;
+		BF_Instruction *instruction = &ctx->instructions[program->origin[pc]];
+
+		BF_Operation type = op->opcode & ~(BF_PACKED_WIDE | BF_PACKED_LONG);
+		int64_t operand = op->operand;
+		uint32_t value = op->value;
+		if (op->opcode & BF_PACKED_WIDE) operand = program->code[++pc].wide;
+		if (op->opcode & BF_PACKED_LONG) value = program->code[++pc].wide;
+
+		instruction->type = type;
+		instruction->operand1 = value & mask;
+		instruction->operand2 = 0;
+		instruction->position = 0;	// The source isn't packed
+
+		switch(type) {
+		case BF_DEC: case BF_DCL: case BF_DCR: instruction->operand1 = -value & mask; break;
+		default: break;
+		}
+
+		switch(type) {
+		case BF_MVL: case BF_SCANL: instruction->operand1 = -operand; break;
+		case BF_MVR: case BF_SCANR: instruction->operand1 = operand; break;
+
+		case BF_ICL: case BF_DCL: case BF_STL: instruction->operand2 = -operand; break;
+		case BF_ICR: case BF_DCR: case BF_STR: case BF_MUL: case BF_PRT: case BF_INP:
+			instruction->operand2 = (uint32_t)operand;
+			break;
+		case BF_WRITE: case BF_FILL: instruction->operand1 = operand; break;
+
+		case BF_LBL: case BF_RPT: case BF_WHILE: case BF_WHILE_END: {
+			size_t target = at + operand;
+			size_t index = target < program->length ? program->origin[target] : program->instructions;
+			instruction->operand1 = type == BF_WHILE_END ? index : index - 1;
+			break;
+		}
+
+		default: break;
+		}
+	}
+
+	return ctx;
+}
+
+void BF_FreePacked(BF_PackedProgram *program) {
+	free(program->code);
+	free(program->origin);
+	free(program);
+}
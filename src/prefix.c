@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bf.h"
+
+#define PREFIX_MEMORY_LENGTH	BF_FIXED_TAPE_LENGTH	// The default memory, leaving it ends the evaluation
+#define MAX_PREFIX_OUTPUT		(1024 * 1024)		// Bytes of output the program may hold
+
+/*
+ * Partial evaluation of the start of the program, the part that doesn't depend on the input.
+ *
+ * The program is run from its first instruction on a private memory, until it reads, leaves the default
+ * memory, runs out of budget or ends. Everything it ran up to the last point it was outside of every loop
+ * is then replaced with a write of what it printed, a fill of the cells it left in the memory and a move
+ * to where it left dp:
+ *	++++++++[>++++++++<-]>+.,	=>	WRITE "A", MVR 1, FILL { 65 }, INP
+ * A program that never reads is left with a single write (and the fill, so the memory ends the same).
+ * The cells are evaluated as wide as the context's, and the fill holds them as the engines do.
+ */
+
+typedef struct {
+	const BF_Context *ctx;
+	uint32_t mask;			// Of the cell size
+	uint32_t memory[PREFIX_MEMORY_LENGTH];
+	int64_t dp;
+	size_t ip;
+	uint64_t work;			// Instructions ran and cells scanned
+
+	char *output;
+	size_t outputLength, outputAllocated;
+} Evaluation;
+
+static bool IsOpener(BF_Operation type) {
+	return type == BF_LBL || type == BF_WHILE;
+}
+
+static bool IsCloser(BF_Operation type) {
+	return type == BF_RPT || type == BF_WHILE_END;
+}
+
+// Loops around every instruction (a ] is inside its loop), false if a jump doesn't go to its matching bracket
+static bool FindDepths(const BF_Context *ctx, uint32_t *depths) {
+	size_t *stack = malloc((ctx->length + 1) * sizeof(size_t)), depth = 0;
+	bool structured = true;
+
+	for(size_t i = 0; structured && i < ctx->length; ++i) {
+		const BF_Instruction *instruction = &ctx->instructions[i];
+		depths[i] = depth;
+
+		if (IsOpener(instruction->type)) {
+			stack[depth++] = i;
+		} else if (IsCloser(instruction->type)) {
+			structured = depth > 0 && instruction->operand1 == stack[depth - 1] &&
+				ctx->instructions[stack[depth - 1]].operand1 == i;
+			--depth;
+		}
+	}
+
+	free(stack);
+	return structured && depth == 0;
+}
+
+// The cell at dp + offset, NULL if it's out of the memory
+static uint32_t *Cell(Evaluation *e, int64_t offset) {
+	int64_t index = e->dp + offset;
+	return 0 <= index && index < PREFIX_MEMORY_LENGTH ? &e->memory[index] : NULL;
+}
+
+// Cells are printed as their low byte
+static bool Print(Evaluation *e, uint8_t value) {
+	if (e->outputLength >= MAX_PREFIX_OUTPUT) return false;
+
+	if (e->outputLength >= e->outputAllocated) {
+		e->outputAllocated = e->outputAllocated ? 2 * e->outputAllocated : 256;
+		e->output = realloc(e->output, e->outputAllocated);
+	}
+
+	e->output[e->outputLength++] = value;
+	return true;
+}
+
+// Runs the instruction at ip, false (with nothing changed) if it reads, leaves the memory or can't be followed
+static bool Step(Evaluation *e) {
+	const BF_Instruction *instruction = &e->ctx->instructions[e->ip];
+	uint32_t value = instruction->operand1, *cell, *target;
+	int64_t offset = 0;
+	size_t next = e->ip + 1;
+
+	switch(instruction->type) {
+	case BF_NOP: break;
+	case BF_MVL: e->dp -= instruction->operand1; break;
+	case BF_MVR: e->dp += instruction->operand1; break;
+
+	case BF_DEC: value = -value;
+		/* fallthrough */
+	case BF_INC:
+		if (!(cell = Cell(e, 0))) return false;
+		*cell = (*cell + value) & e->mask;
+		break;
+
+	case BF_DCL: value = -value;
+		/* fallthrough */
+	case BF_ICL: offset = -(int64_t)instruction->operand2; goto Add;
+	case BF_DCR: value = -value;
+		/* fallthrough */
+	case BF_ICR: offset = instruction->operand2;
+	Add:
+		if (!(cell = Cell(e, offset))) return false;
+		*cell = (*cell + value) & e->mask;
+		break;
+
+	case BF_STL: offset = -(int64_t)instruction->operand2; goto Set;
+	case BF_STR: offset = instruction->operand2; goto Set;
+	case BF_SET:
+	Set:
+		if (!(cell = Cell(e, offset))) return false;
+		*cell = value & e->mask;
+		break;
+
+	case BF_PRT:
+		if (!(cell = Cell(e, (int32_t)instruction->operand2)) || !Print(e, *cell)) return false;
+		break;
+
+	case BF_MUL:	// The target isn't touched by a loop that isn't entered
+		if (!(cell = Cell(e, 0))) return false;
+		if (!*cell) break;
+		if (!(target = Cell(e, (int32_t)instruction->operand2))) return false;
+		*target = (*target + *cell * value) & e->mask;
+		break;
+
+	case BF_COUNT:	// A count that never ends is left to the engines
+		if (!(cell = Cell(e, 0)) || !BF_CountIterations(*cell, value, e->ctx->cellSize, cell)) return false;
+		break;
+
+	case BF_SCANL:
+	case BF_SCANR: {
+		int64_t stride = instruction->type == BF_SCANL ? -(int64_t)instruction->operand1 : instruction->operand1;
+		int64_t dp = e->dp;
+		uint64_t work = e->work;
+
+		for(; (cell = Cell(e, 0)) && *cell; e->dp += stride) ++e->work;
+		if (!cell) {
+			e->dp = dp;
+			e->work = work;
+			return false;
+		}
+		break;
+	}
+
+	case BF_LBL:
+	case BF_WHILE:
+		if (!(cell = Cell(e, 0))) return false;
+
+		if (!*cell) next = instruction->operand1 + 1;
+		else if (instruction->type == BF_WHILE) --*cell;	// Not 0, so it can't wrap
+		break;
+	case BF_RPT:
+		if (!(cell = Cell(e, 0))) return false;
+		if (*cell) next = instruction->operand1 + 1;
+		break;
+	case BF_WHILE_END:
+		if (!(cell = Cell(e, 0))) return false;
+		if (*cell) next = instruction->operand1;
+		break;
+
+	default: return false;	// Reads the input, or isn't something that can be followed
+	}
+
+	e->ip = next;
+	++e->work;
+	return true;
+}
+
+static void Restart(Evaluation *e) {
+	memset(e->memory, 0, sizeof(e->memory));
+	e->dp = 0;
+	e->ip = 0;
+	e->work = 0;
+	e->outputLength = 0;
+}
+
+static uint32_t AddData(BF_Context *ctx, const void *bytes, size_t length) {
+	ctx->data = realloc(ctx->data, (ctx->dataLength + 1) * sizeof(BF_Data));
+	ctx->data[ctx->dataLength] = (BF_Data){ .bytes = malloc(length), .length = length };
+	memcpy(ctx->data[ctx->dataLength].bytes, bytes, length);
+
+	return ctx->dataLength++;
+}
+
+static BF_Instruction Move(int64_t motion, uint32_t position) {
+	return (BF_Instruction){
+		.type = motion < 0 ? BF_MVL : BF_MVR, .operand1 = motion < 0 ? -motion : motion, .position = position
+	};
+}
+
+// Replaces the instructions before end with the state the evaluation left, false if dp is too far to move to
+static bool Replace(BF_Context *ctx, const Evaluation *e, size_t end) {
+	// The fill covers the cells from the first to the last one that isn't 0
+	size_t first = 0, last = PREFIX_MEMORY_LENGTH;
+	for(; first < last && !e->memory[first]; ++first);
+	for(; last > first && !e->memory[last - 1]; --last);
+
+	int64_t dp = first < last ? first : 0;
+	if (e->dp - dp < INT32_MIN || e->dp - dp > INT32_MAX) return false;
+
+	// The cells of the fill, in the size and byte order the engines keep them in
+	size_t size = ctx->cellSize;
+	uint8_t *cells = malloc((last - first) * size + 1);
+	for(size_t i = first; i < last; ++i) {
+		uint8_t byte = e->memory[i];
+		uint16_t half = e->memory[i];
+
+		if (size == 1) memcpy(cells + (i - first) * size, &byte, size);
+		else if (size == 2) memcpy(cells + (i - first) * size, &half, size);
+		else memcpy(cells + (i - first) * size, &e->memory[i], size);
+	}
+
+	BF_Instruction prefix[4];
+	size_t count = 0;
+	uint32_t position = ctx->instructions[end - 1].position;
+
+	if (e->outputLength) {
+		prefix[count++] = (BF_Instruction){
+			.type = BF_WRITE, .operand1 = AddData(ctx, e->output, e->outputLength), .position = position
+		};
+	}
+	if (first < last) {
+		if (first) prefix[count++] = Move(first, position);
+		prefix[count++] = (BF_Instruction){
+			.type = BF_FILL, .operand1 = AddData(ctx, cells, (last - first) * size), .position = position
+		};
+	}
+	free(cells);
+	if (e->dp != dp) prefix[count++] = Move(e->dp - dp, position);
+
+	// Nothing jumps across end, so the jumps after it only shift with the instructions
+	size_t length = count + ctx->length - end;
+	BF_Instruction *instructions = malloc((length + 1) * sizeof(BF_Instruction));
+	memcpy(instructions, prefix, count * sizeof(BF_Instruction));
+	memcpy(instructions + count, ctx->instructions + end, (ctx->length - end) * sizeof(BF_Instruction));
+
+	for(size_t i = count; i < length; ++i) {
+		if (IsOpener(instructions[i].type) || IsCloser(instructions[i].type)) instructions[i].operand1 += count - end;
+	}
+
+	free(ctx->instructions);
+	ctx->instructions = instructions;
+	ctx->length = length;
+	return true;
+}
+
+bool BF_EvaluatePrefix(BF_Context *ctx, uint64_t budget) {
+	uint32_t *depths = malloc((ctx->length + 1) * sizeof(uint32_t));
+	if (!FindDepths(ctx, depths)) {
+		free(depths);
+		return false;
+	}
+
+	BF_DetachCompiled(ctx);		// The data grows and the instructions are replaced
+
+	Evaluation *e = calloc(1, sizeof(Evaluation));
+	e->ctx = ctx;
+	e->mask = BF_CELL_MASK(ctx->cellSize);
+
+	// The last point the evaluation was outside of every loop, where the program can be cut
+	uint64_t boundary = 0;
+	size_t end = 0;
+	for(;;) {
+		bool finished = e->ip >= ctx->length;
+		if (finished || !depths[e->ip]) boundary = e->work, end = e->ip;
+		if (finished || e->work >= budget || !Step(e)) break;
+	}
+
+	// Stopped inside of a loop, the state at the boundary is found by running again up to it
+	if (boundary != e->work) {
+		Restart(e);
+		while (e->work < boundary) Step(e);
+	}
+
+	bool replaced = end > 0 && Replace(ctx, e, end);
+
+	free(e->output);
+	free(e);
+	free(depths);
+	return replaced;
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+static const char *const gNames[__BF_OPERATION_COUNT__] = {
+	[BF_NOP] = "NOP",
+	[BF_MVL] = "MVL", [BF_MVR] = "MVR", [BF_INC] = "INC", [BF_DEC] = "DEC",
+	[BF_PRT] = "PRT", [BF_INP] = "INP", [BF_LBL] = "LBL", [BF_RPT] = "RPT",
+	[BF_ICL] = "ICL", [BF_DCL] = "DCL", [BF_ICR] = "ICR", [BF_DCR] = "DCR",
+	[BF_SET] = "SET", [BF_STL] = "STL", [BF_STR] = "STR",
+	[BF_WHILE] = "WHILE", [BF_WHILE_END] = "WHILE_END",
+	[BF_MUL] = "MUL", [BF_SCANL] = "SCANL", [BF_SCANR] = "SCANR",
+	[BF_WRITE] = "WRITE", [BF_FILL] = "FILL", [BF_COUNT] = "COUNT",
+};
+
+typedef struct {
+	size_t begin, end;		// Indices of the loop opener and closer
+	uint64_t steps;			// Steps spent in the loop, nested loops included
+} LoopSteps;
+
+BF_Profile *BF_CreateProfile(const BF_Context *ctx) {
+	BF_Profile *profile = malloc(sizeof(BF_Profile));
+	profile->length = ctx->length;
+	profile->hits = calloc(ctx->length + 1, sizeof(uint64_t));
+	profile->loops = calloc(ctx->length + 1, sizeof(BF_LoopProfile));
+
+	return profile;
+}
+
+void BF_FreeProfile(BF_Profile *profile) {
+	free(profile->hits);
+	free(profile->loops);
+	free(profile);
+}
+
+static bool IsLoopOpener(BF_Operation type) {
+	return type == BF_LBL || type == BF_WHILE;
+}
+
+static int CompareLoopSteps(const void *a, const void *b) {
+	uint64_t first = ((const LoopSteps *)a)->steps, second = ((const LoopSteps *)b)->steps;
+	return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static void PrintLoops(const BF_Profile *profile, const BF_Context *ctx, FILE *file, uint64_t steps, size_t top) {
+	// The steps of every loop are a range of the hits, so prefix sums give them all in linear time
+	uint64_t *prefix = malloc((ctx->length + 1) * sizeof(uint64_t));
+	LoopSteps *loops = malloc((ctx->length + 1) * sizeof(LoopSteps));
+	size_t count = 0;
+
+	prefix[0] = 0;
+	for(size_t i = 0; i < ctx->length; ++i) prefix[i + 1] = prefix[i] + profile->hits[i];
+
+	for(size_t i = 0; i < ctx->length; ++i) {
+		const BF_Instruction *instruction = &ctx->instructions[i];
+		if (!IsLoopOpener(instruction->type) || instruction->operand1 >= ctx->length) continue;
+
+		size_t end = instruction->operand1;
+		loops[count++] = (LoopSteps){ i, end, prefix[end + 1] - prefix[i] };
+	}
+
+	qsort(loops, count, sizeof(LoopSteps), &CompareLoopSteps);
+
+	fprintf(file, "Hottest loops:\n");
+	fprintf(file, "%14s %7s %12s %14s %12s  %s\n", "steps", "share", "entries", "iterations", "per entry", "source bytes");
+	for(size_t k = 0; k < count && k < top && loops[k].steps; ++k) {
+		const BF_LoopProfile *loop = &profile->loops[loops[k].begin];
+
+		fprintf(file, "%14llu %6.2f%% %12llu %14llu %12.1f  %u-%u\n",
+			(unsigned long long)loops[k].steps, steps ? 100.0 * loops[k].steps / steps : 0.0,
+			(unsigned long long)loop->entries, (unsigned long long)loop->iterations,
+			loop->entries ? (double)loop->iterations / loop->entries : 0.0,
+			ctx->instructions[loops[k].begin].position, ctx->instructions[loops[k].end].position);
+	}
+
+	free(prefix);
+	free(loops);
+}
+
+static void PrintMix(const BF_Profile *profile, const BF_Context *ctx, FILE *file, uint64_t steps) {
+	uint64_t mix[__BF_OPERATION_COUNT__] = { 0 };
+	for(size_t i = 0; i < ctx->length; ++i) {
+		if (ctx->instructions[i].type < __BF_OPERATION_COUNT__) mix[ctx->instructions[i].type] += profile->hits[i];
+	}
+
+	fprintf(file, "Instruction mix:\n");
+	for(;;) {
+		// Selects the most frequent operation that is left, there are only a few of them
+		size_t best = 0;
+		for(size_t type = 1; type < __BF_OPERATION_COUNT__; ++type) {
+			if (mix[type] > mix[best]) best = type;
+		}
+		if (!mix[best]) break;
+
+		fprintf(file, "%14llu %6.2f%%  %s\n", (unsigned long long)mix[best], steps ? 100.0 * mix[best] / steps : 0.0,
+			gNames[best] ? gNames[best] : "?");
+		mix[best] = 0;
+	}
+}
+
+void BF_PrintProfile(const BF_Profile *profile, const BF_Context *ctx, void *handle, size_t top) {
+	FILE *file = handle;
+
+	uint64_t steps = 0;
+	for(size_t i = 0; i < ctx->length; ++i) steps += profile->hits[i];
+
+	fprintf(file, "\nProfile of %zu instructions (%llu steps)\n", ctx->length, (unsigned long long)steps);
+	PrintLoops(profile, ctx, file, steps, top);
+	PrintMix(profile, ctx, file, steps);
+}
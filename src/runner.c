@@ -1,15 +1,28 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <stdio.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <setjmp.h>
+#endif
+
 #include "bf.h"
 
 
-#define DEFAULT_MEMORY_STRIP_LENGTH			30000
+#define DEFAULT_MEMORY_STRIP_LENGTH			BF_FIXED_TAPE_LENGTH
 #define DEFAULT_STACK_SIZE					64
 
-static inline void RunInstruction(BF_SimulationContext *sim);
+// Stops the simulation, the message is kept in the simulation for whoever runs it to report
+static void Fail(BF_SimulationContext *sim, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(sim->message, sizeof sim->message, format, args);
+	va_end(args);
+
+	sim->error = 1;
+}
 
 static void StackPush(BF_SimulationContext *ctx, uint64_t item) {
 	if(ctx->stack.used >= ctx->stack.allocated) {
@@ -22,8 +35,7 @@ static void StackPush(BF_SimulationContext *ctx, uint64_t item) {
 
 inline static uint64_t StackPop(BF_SimulationContext *ctx) {
 	if(ctx->stack.used <= 0) {
-		printf("Empty stack\n");
-		ctx->error = 1;
+		Fail(ctx, "Empty stack");
 		return -1;
 	}
 
@@ -31,67 +43,79 @@ inline static uint64_t StackPop(BF_SimulationContext *ctx) {
 }
 
 inline static char *MemReadOff(BF_SimulationContext *sim, int32_t shift) {
-	static char S_Write = 0;
-
 	size_t odp = sim->dp + shift;
 	if(odp < 0 || odp >= sim->memory.length) {
-		if (sim->memory.flags & CTX_MEMORY_SCALABLE) {
-			size_t newLength = odp + DEFAULT_MEMORY_STRIP_LENGTH;
-			sim->memory.buffer = realloc(sim->memory.buffer, newLength);
-			memset(sim->memory.buffer + sim->memory.length, 0, newLength - sim->memory.length);
-			
-			sim->memory.length = newLength;
-			return &sim->memory.buffer[sim->ip];
-		}
+		// Growable and paged memories move to cover the cell, and dp moves with them
+		if (BF_ReachMemory(sim, shift)) return sim->memory.buffer + (sim->dp + shift) * sim->memory.cellSize;
 
-		printf("\nOOM (ip: %zu, dp: %zu(READ: %zu, SHIFT: %d) , size: %zu)\n", sim->ip, sim->dp, odp, shift, sim->memory.length);
-		sim->error = 1;
-		return &S_Write;	// Cant read
+		Fail(sim, "OOM (ip: %zu, dp: %zu(READ: %zu, SHIFT: %d) , size: %zu)", sim->ip, sim->dp, odp, shift, sim->memory.length);
+		return (char *)&sim->scratch;	// Cant read
 	}
 
-	return &sim->memory.buffer[odp];
+	return sim->memory.buffer + odp * sim->memory.cellSize;
+}
+
+char *BF_ReadMemory(BF_SimulationContext *sim, int32_t shift) {
+	return MemReadOff(sim, shift);
 }
 
 inline static char *MemRead(BF_SimulationContext *sim) {
 	return MemReadOff(sim, 0);
 }
 
-inline static void MemIncrement(BF_SimulationContext *sim, int operand1) {
-	*MemRead(sim) += operand1;
+// Size is a constant in the runners, so only the kernels of their cell size are left in them
+inline static size_t ScanCells(const char *memory, size_t length, size_t dp, int64_t stride, size_t size) {
+	if (size == 1) return stride > 0 ? BF_ScanRight(memory, length, dp, stride) : BF_ScanLeft(memory, length, dp, -stride);
+	return stride > 0 ? BF_ScanRightWide(memory, length, dp, stride, size) : BF_ScanLeftWide(memory, length, dp, -stride, size);
 }
 
-inline static void IOWrite(BF_SimulationContext *sim) {
-	putchar(*MemRead(sim)); fflush(stdout);
+// Leaving the memory grows it, moves it to the next page (where the scan goes on) or reports the error
+inline static void MemScan(BF_SimulationContext *sim, int64_t stride, size_t size) {
+	for(;;) {
+		sim->dp = ScanCells(sim->memory.buffer, sim->memory.length, sim->dp, stride, size);
+		if (sim->dp < sim->memory.length) return;
+
+		MemRead(sim);
+		if (sim->error) return;
+	}
 }
 
-inline static void IORead(BF_SimulationContext *sim) {
-	int chr = getchar();
-	if (chr != EOF) *MemRead(sim) = chr;
+// Cell by cell, for the fills that don't fit in the buffer of a paged memory
+static void MemFill(BF_SimulationContext *sim, const BF_Data *data, size_t size) {
+	for(size_t i = 0; !sim->error && i < data->length / size; ++i) memcpy(MemReadOff(sim, i), data->bytes + i * size, size);
 }
 
-inline static void WhileLoop(BF_SimulationContext *sim, uint32_t jump) {
-	size_t dp = sim->dp, ip = sim->ip;
-	for(;*MemRead(sim); MemIncrement(sim, -1)) {
-		for (sim->ip = ip; sim->ip <= jump; ++sim->ip) {
-			RunInstruction(sim);
-		}
+// Cells are written as their low byte
+inline static void IOWrite(BF_SimulationContext *sim, char value) {
+	BF_IOStream *output = &sim->io.output;
+	output->buffer[output->used++] = value;
 
-		sim->dp = dp;
-	}
-	sim->ip = jump;
+	if (output->used >= output->capacity || (sim->io.flags &&
+		((sim->io.flags & BF_IO_INTERACTIVE) || value == '\n')))
+		BF_FlushOutput(sim);
 }
 
+// Reads into a cell of any size, which is left as it is on EOF, and runs wait when the input is pending
+#define IORead(sim, cell, wait)	do { \
+		int chr = BF_ReadInput(sim); \
+		if (chr == BF_IO_PENDING) wait; \
+		if (chr != EOF) *(cell) = chr; \
+	} while(0)
+
 BF_SimulationContext *BF_CreateSimulation(BF_Context *ctx) {
 	BF_SimulationContext *sim = malloc(sizeof(BF_SimulationContext));
 
 	sim->dp = 0;
 	sim->ip = 0;
+	sim->error = 0;
+	sim->message[0] = 0;
+	sim->state = BF_RUN_READY;
+	sim->packed = NULL;
+	sim->tiered = NULL;
 
-	sim->memory.buffer = malloc(DEFAULT_MEMORY_STRIP_LENGTH);
-	sim->memory.length = DEFAULT_MEMORY_STRIP_LENGTH;
 	sim->memory.flags = 0;
-
-	memset(sim->memory.buffer, 0, sizeof(char) * DEFAULT_MEMORY_STRIP_LENGTH);	
+	sim->memory.cellSize = ctx->cellSize;
+	BF_AllocateMemory(sim, DEFAULT_MEMORY_STRIP_LENGTH, BF_GuardSize(ctx));
 
 	sim->context = ctx;
 
@@ -99,50 +123,349 @@ BF_SimulationContext *BF_CreateSimulation(BF_Context *ctx) {
 	sim->stack.used = 0;
 	sim->stack.allocated = DEFAULT_STACK_SIZE; 
 
+	memset(&sim->io, 0, sizeof(sim->io));
+	BF_SetIODescriptors(sim, 0, 1, 0);
+
 	return sim;
 }
 
+bool BF_UseTape(BF_SimulationContext *sim, BF_Tape tape) {
+	BF_FreeMemory(sim);
+	sim->dp = 0;
+
+	// Only the fixed memory is guarded, the others move when they grow
+	sim->memory.flags = tape == BF_TAPE_GROWABLE ? CTX_MEMORY_SCALABLE : tape == BF_TAPE_SPARSE ? CTX_MEMORY_PAGED : 0;
+	return BF_AllocateMemory(sim, DEFAULT_MEMORY_STRIP_LENGTH, tape == BF_TAPE_FIXED ? BF_GuardSize(sim->context) : 0);
+}
+
 void BF_FreeSimulation(BF_SimulationContext *sim) {
-	free(sim->memory.buffer);
+	if (sim->packed) BF_FreePacked(sim->packed);
+	if (sim->tiered) BF_FreeContext(sim->tiered);
+	BF_FreeIO(sim);
+	BF_FreeMemory(sim);
 	free(sim->stack.buffer);
 
 	free(sim);
 }
 
-static inline void RunInstruction(BF_SimulationContext *sim) {
-	const BF_Instruction *instruction = &sim->context->instructions[sim->ip]; 
-	switch(instruction->type) {
-	case BF_MVL: sim->dp -= instruction->operand1; break;
-	case BF_MVR: sim->dp += instruction->operand1; break;
-	case BF_INC: MemIncrement(sim, instruction->operand1); break;
-	case BF_DEC: MemIncrement(sim, -instruction->operand1); break;
-	case BF_PRT: IOWrite(sim); break;
-	case BF_INP: IORead(sim); break;
-	case BF_LBL: if(!*MemRead(sim)) sim->ip = instruction->operand1; break;
-	case BF_RPT: if(*MemRead(sim)) sim->ip = instruction->operand1; break;
-	case BF_SET: *MemRead(sim) = instruction->operand1; break;
-	
-	case BF_DCL: *MemReadOff(sim, -instruction->operand2) -= instruction->operand1; break;
-	case BF_DCR: *MemReadOff(sim, instruction->operand2) -= instruction->operand1; break;
-	case BF_ICL: *MemReadOff(sim, -instruction->operand2) += instruction->operand1; break;
-	case BF_ICR: *MemReadOff(sim, instruction->operand2) += instruction->operand1; break;
-
-	case BF_STR: *MemReadOff(sim, instruction->operand2) = instruction->operand1; break;
-	case BF_STL: *MemReadOff(sim, -instruction->operand2) = instruction->operand1; break;
-
-	case BF_WHILE: if(!*MemRead(sim)) sim->ip = instruction->operand1; else MemIncrement(sim, -1); break;
-	case BF_WHILE_END: if(*MemRead(sim)) sim->ip = instruction->operand1 - 1; break;
-
-	case BF_NOP: default: break; // Not a instruction
+// Out of range accesses take the common path, with the ip of the instruction that made them
+inline static char *PackedCell(BF_SimulationContext *sim, const BF_PackedProgram *program, size_t pc, int32_t shift, size_t size) {
+	size_t index = sim->dp + shift;
+	if (index < sim->memory.length) return sim->memory.buffer + index * size;
+
+	sim->ip = program->origin[pc];
+	return MemReadOff(sim, shift);
+}
+
+// Both ends of the cells are checked first, so a fill that doesn't fit in the memory writes nothing
+inline static void PackedFill(BF_SimulationContext *sim, const BF_PackedProgram *program, size_t pc, const BF_Data *data, size_t size) {
+	size_t last = data->length / size - 1;
+	PackedCell(sim, program, pc, 0, size);
+	if (!sim->error) PackedCell(sim, program, pc, last, size);
+	if (sim->error) return;
+
+	if (sim->dp < sim->memory.length && sim->dp + last < sim->memory.length) memcpy(sim->memory.buffer + sim->dp * size, data->bytes, data->length);
+	else MemFill(sim, data, size);
+}
+
+// First slot of the instruction, the slots of an instruction are next to each other and in the order of the program
+static size_t PackedSlot(const BF_PackedProgram *program, size_t ip) {
+	size_t low = 0, high = program->length;
+	while(low < high) {
+		size_t middle = (low + high) / 2;
+		if (program->origin[middle] < ip) low = middle + 1;
+		else high = middle;
+	}
+
+	return low;
+}
+
+#define HOT_LOOP_THRESHOLD		1000	// Iterations of a loop before it's compiled
+
+typedef struct {
+	uint64_t *iterations;		// At the index of every LBL / WHILE
+	BF_JitProgram **compiled;	// Once the loop got hot, NULL if it couldn't be compiled
+} HotLoops;
+
+static BF_JitProgram *CompileHotLoop(BF_SimulationContext *sim, size_t opener) {
+	return BF_JitCompileLoop(sim->context, opener, sim->memory.flags);
+}
+
+// Runs the compiled loop on the memory of the interpreter, and sets next to the slot it goes on from
+static uint64_t RunHotLoop(BF_SimulationContext *sim, const BF_PackedProgram *program, BF_JitProgram *loop, size_t *next) {
+	uint64_t steps = BF_JitRunLoop(loop, sim);
+	*next = PackedSlot(program, sim->error ? sim->ip - 1 : sim->ip);
+	return steps;
+}
+
+/*
+ * Every runner is generated once for every cell size, so none of them looks at the size of a cell on an access.
+ * They are picked by the cell size of the memory, which is the one of the context it was created for.
+ */
+#define CELL_TYPE				uint8_t
+#define INTERPRETER_NAME		RunPacked8
+#define INTERPRETER_PROFILED	0
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#define INTERPRETER_NAME		RunPackedProfiled8
+#define INTERPRETER_PROFILED	1
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#define INTERPRETER_NAME		RunPackedHot8
+#define INTERPRETER_HOT			1
+#include "interpreter.inl"
+#undef INTERPRETER_HOT
+#undef INTERPRETER_NAME
+#undef CELL_TYPE
+
+#define CELL_TYPE				uint16_t
+#define INTERPRETER_NAME		RunPacked16
+#define INTERPRETER_PROFILED	0
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#define INTERPRETER_NAME		RunPackedProfiled16
+#define INTERPRETER_PROFILED	1
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#undef CELL_TYPE
+
+#define CELL_TYPE				uint32_t
+#define INTERPRETER_NAME		RunPacked32
+#define INTERPRETER_PROFILED	0
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#define INTERPRETER_NAME		RunPackedProfiled32
+#define INTERPRETER_PROFILED	1
+#include "interpreter.inl"
+#undef INTERPRETER_PROFILED
+#undef INTERPRETER_NAME
+#undef CELL_TYPE
+
+// Goes on from the ip the simulation stopped at, for at most limit steps
+static uint64_t RunPacked(BF_SimulationContext *sim, const BF_PackedProgram *program, BF_Profile *profile, uint64_t limit) {
+	if (sim->state == BF_RUN_ENDED) return 0;
+
+	size_t pc = PackedSlot(program, sim->ip);
+	switch(sim->memory.cellSize) {
+	case 2: return profile ? RunPackedProfiled16(sim, program, profile, pc, limit) : RunPacked16(sim, program, NULL, pc, limit);
+	case 4: return profile ? RunPackedProfiled32(sim, program, profile, pc, limit) : RunPacked32(sim, program, NULL, pc, limit);
+	default: return profile ? RunPackedProfiled8(sim, program, profile, pc, limit) : RunPacked8(sim, program, NULL, pc, limit);
+	}
+}
+
+uint64_t BF_RunPacked(BF_SimulationContext *sim, const BF_PackedProgram *program) {
+	return RunPacked(sim, program, NULL, UINT64_MAX);
+}
+
+// The program is packed on the first slice, so the ones after it only look up where to go on from
+uint64_t BF_RunFor(BF_SimulationContext *sim, uint64_t maxSteps) {
+	if (sim->state == BF_RUN_ENDED) return 0;
+
+	if (!sim->packed && !(sim->packed = BF_Pack(sim->context))) {
+		Fail(sim, "Program can't be packed");
+		sim->state = BF_RUN_ENDED;
+		return 0;
 	}
+
+	return RunPacked(sim, sim->packed, NULL, maxSteps);
 }
 
+// Runs the program from its packed form, which keeps 3 times as many instructions in the cache
 uint64_t BF_Run(BF_SimulationContext *sim) {
-	char *current = NULL;
-	uint64_t steps = 0;
-	for(sim->ip = 0, sim->error = 0; !sim->error && sim->ip < sim->context->length; ++sim->ip, ++steps) {
-		RunInstruction(sim);
+	BF_PackedProgram *program = BF_Pack(sim->context);
+	if (!program) {
+		Fail(sim, "Program can't be packed");
+		sim->state = BF_RUN_ENDED;
+		return 0;
+	}
+
+	uint64_t steps = BF_RunPacked(sim, program);
+	BF_FreePacked(program);
+	return steps;
+}
+
+/*
+ * Interprets the program, and compiles a loop that ran HOT_LOOP_THRESHOLD iterations on its own, to run it
+ * natively every time it's reached from then on. Only byte cells on a memory that doesn't move are compiled.
+ */
+uint64_t BF_RunHot(BF_SimulationContext *sim) {
+	if (sim->memory.cellSize != 1 || sim->memory.flags & (CTX_MEMORY_SCALABLE | CTX_MEMORY_PAGED)) return BF_Run(sim);
+	if (sim->state == BF_RUN_ENDED) return 0;
+
+	BF_PackedProgram *program = BF_Pack(sim->context);
+	if (!program) {
+		Fail(sim, "Program can't be packed");
+		sim->state = BF_RUN_ENDED;
+		return 0;
+	}
+
+	size_t length = sim->context->length;
+	HotLoops hot = {
+		.iterations = calloc(length + 1, sizeof(uint64_t)),
+		.compiled = calloc(length + 1, sizeof(BF_JitProgram *))
+	};
+
+	uint64_t steps = RunPackedHot8(sim, program, &hot, PackedSlot(program, sim->ip), UINT64_MAX);
+
+	for(size_t i = 0; i < length; ++i) BF_JitFree(hot.compiled[i]);
+	free(hot.iterations);
+	free(hot.compiled);
+	BF_FreePacked(program);
+	return steps;
+}
+
+// Same as BF_Run, but counts every instruction and loop it runs into the profile
+uint64_t BF_RunProfiled(BF_SimulationContext *sim, BF_Profile *profile) {
+	BF_PackedProgram *program = BF_Pack(sim->context);
+	if (!program) {
+		Fail(sim, "Program can't be packed");
+		sim->state = BF_RUN_ENDED;
+		return 0;
 	}
 
+	uint64_t steps = RunPacked(sim, program, profile, UINT64_MAX);
+	BF_FreePacked(program);
 	return steps;
-}
\ No newline at end of file
+}
+
+#if defined(__GNUC__)
+
+typedef struct {
+	const void *handler;
+	union {
+		int32_t value;		// Immediate operand (INC, SET, ...)
+		uint32_t target;	// Index of the next instruction to run if the jump is taken
+	};
+	int32_t offset;			// Signed cell offset from dp
+} ThreadedOp;
+
+// Jumps outside of the program end it, just like BF_Run does
+static inline uint32_t ThreadedTarget(const BF_Context *ctx, size_t target) {
+	return target < ctx->length ? target : ctx->length;
+}
+
+/*
+ * Decodes the context into a threaded code array, where every instruction holds the address of its
+ * handler and its operands in the form the handler consumes them (signed offsets, resolved jump targets).
+ * The array is terminated by an extra END operation. MVL/DEC style operations are folded into a signed
+ * operand, so each pair shares a single handler.
+ */
+static ThreadedOp *ThreadedDecode(const BF_Context *ctx, const void *const *handlers, const void *end) {
+	ThreadedOp *code = malloc((ctx->length + 1) * sizeof(ThreadedOp));
+
+	for(size_t i = 0; i < ctx->length; ++i) {
+		const BF_Instruction *instruction = &ctx->instructions[i];
+		ThreadedOp *op = &code[i];
+
+		op->handler = instruction->type < __BF_OPERATION_COUNT__ ? handlers[instruction->type] : handlers[BF_NOP];
+		op->value = instruction->operand1;
+		op->offset = 0;
+
+		switch(instruction->type) {
+		case BF_MVL: case BF_SCANL: op->value = -instruction->operand1; break;
+		case BF_DEC: op->value = -instruction->operand1; break;
+		case BF_DCL: op->value = -instruction->operand1; op->offset = -instruction->operand2; break;
+		case BF_DCR: op->value = -instruction->operand1; op->offset = instruction->operand2; break;
+		case BF_ICL: case BF_STL: op->offset = -instruction->operand2; break;
+		case BF_ICR: case BF_STR: case BF_MUL: case BF_PRT: case BF_INP: op->offset = instruction->operand2; break;
+		case BF_FILL: op->offset = ctx->data[instruction->operand1].length / ctx->cellSize - 1; break;	// The last cell it fills
+
+		case BF_LBL: case BF_RPT: case BF_WHILE: op->target = ThreadedTarget(ctx, (size_t)instruction->operand1 + 1); break;
+		case BF_WHILE_END: op->target = ThreadedTarget(ctx, instruction->operand1); break;
+		default: break;
+		}
+	}
+
+	code[ctx->length] = (ThreadedOp){ .handler = end };
+	return code;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#define THREADED_GUARD_SUPPORTED	1
+
+typedef struct {
+	sigjmp_buf env;
+	const ThreadedOp *volatile checkpoint;
+	volatile size_t dp;
+	volatile uint64_t steps;
+} ThreadedRecovery;
+
+static bool ThreadedRecover(void *argument, void *ucontext) {
+	siglongjmp(((ThreadedRecovery *)argument)->env, 1);
+}
+
+#define THREADED_GUARDED	1
+#define CELL_TYPE			uint8_t
+#define THREADED_NAME		RunThreadedGuarded8
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#define CELL_TYPE			uint16_t
+#define THREADED_NAME		RunThreadedGuarded16
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#define CELL_TYPE			uint32_t
+#define THREADED_NAME		RunThreadedGuarded32
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#undef THREADED_GUARDED
+#endif
+
+#define THREADED_GUARDED	0
+#define CELL_TYPE			uint8_t
+#define THREADED_NAME		RunThreadedChecked8
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#define CELL_TYPE			uint16_t
+#define THREADED_NAME		RunThreadedChecked16
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#define CELL_TYPE			uint32_t
+#define THREADED_NAME		RunThreadedChecked32
+#include "threaded.inl"
+#undef THREADED_NAME
+#undef CELL_TYPE
+#undef THREADED_GUARDED
+
+uint64_t BF_RunThreaded(BF_SimulationContext *sim) {
+#if THREADED_GUARD_SUPPORTED
+	if (sim->memory.flags & CTX_MEMORY_GUARDED) {
+		switch(sim->memory.cellSize) {
+		case 2: return RunThreadedGuarded16(sim);
+		case 4: return RunThreadedGuarded32(sim);
+		default: return RunThreadedGuarded8(sim);
+		}
+	}
+#endif
+	switch(sim->memory.cellSize) {
+	case 2: return RunThreadedChecked16(sim);
+	case 4: return RunThreadedChecked32(sim);
+	default: return RunThreadedChecked8(sim);
+	}
+}
+
+#else
+
+uint64_t BF_RunThreaded(BF_SimulationContext *sim) {
+	return BF_Run(sim);	// Computed gotos are not available, fallback to the switch interpreter
+}
+
+#endif
+
+uint64_t BF_RunEngine(BF_SimulationContext *sim, BF_Engine engine) {
+	switch(engine) {
+	case BF_ENGINE_THREADED: return BF_RunThreaded(sim);
+	case BF_ENGINE_JIT: return BF_RunJit(sim);
+	case BF_ENGINE_HOT: return BF_RunHot(sim);
+	case BF_ENGINE_INTERPRETER: default: return BF_Run(sim);
+	}
+}
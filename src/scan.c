@@ -0,0 +1,185 @@
+#if defined(__linux__)
+#define _GNU_SOURCE		// memrchr
+#endif
+
+#include <string.h>
+
+#include "bf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BF_SCAN_VECTORIZED	1
+#include <immintrin.h>
+#endif
+
+#define MAX_VECTOR_STRIDE	8
+
+/*
+ * The scans return the index of the first zero cell at dp +- k * stride, or the first index outside of
+ * the memory if there is none (to the left that index wraps around, just like dp does in BF_Run).
+ * The kernels never read outside of [0, length).
+ */
+typedef size_t (*ScanKernel)(const char *memory, size_t length, size_t dp, uint32_t stride);
+
+static size_t ScanRightScalar(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	for(; dp < length && memory[dp]; dp += stride);
+	return dp;
+}
+
+static size_t ScanLeftScalar(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	for(; dp < length && memory[dp]; dp -= stride);
+	return dp;
+}
+
+#if BF_SCAN_VECTORIZED
+
+/*
+ * Every vector iteration advances by the largest multiple of the stride that fits in the vector, so the
+ * cells of the scan sit at the same lanes in every iteration and one constant mask selects them.
+ */
+static uint32_t StrideMask(uint32_t stride, uint32_t step, uint32_t width, bool reversed) {
+	uint32_t mask = 0;
+	for(uint32_t lane = 0; lane < step; lane += stride) {
+		mask |= 1u << (reversed ? width - 1 - lane : lane);
+	}
+
+	return mask;
+}
+
+__attribute__((target("sse2")))
+static size_t ScanRightSSE2(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	const uint32_t step = 16 / stride * stride, mask = StrideMask(stride, step, 16, false);
+	const __m128i zero = _mm_setzero_si128();
+
+	for(; dp < length && length - dp >= 16; dp += step) {
+		__m128i cells = _mm_loadu_si128((const __m128i *)(memory + dp));
+		uint32_t found = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cells, zero)) & mask;
+		if (found) return dp + __builtin_ctz(found);
+	}
+
+	return ScanRightScalar(memory, length, dp, stride);
+}
+
+__attribute__((target("sse2")))
+static size_t ScanLeftSSE2(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	const uint32_t step = 16 / stride * stride, mask = StrideMask(stride, step, 16, true);
+	const __m128i zero = _mm_setzero_si128();
+
+	for(; dp < length && dp >= 15; dp -= step) {
+		__m128i cells = _mm_loadu_si128((const __m128i *)(memory + dp - 15));
+		uint32_t found = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cells, zero)) & mask;
+		if (found) return dp - 15 + (31 - __builtin_clz(found));
+	}
+
+	return ScanLeftScalar(memory, length, dp, stride);
+}
+
+__attribute__((target("avx2")))
+static size_t ScanRightAVX2(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	const uint32_t step = 32 / stride * stride, mask = StrideMask(stride, step, 32, false);
+	const __m256i zero = _mm256_setzero_si256();
+
+	for(; dp < length && length - dp >= 32; dp += step) {
+		__m256i cells = _mm256_loadu_si256((const __m256i *)(memory + dp));
+		uint32_t found = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, zero)) & mask;
+		if (found) return dp + __builtin_ctz(found);
+	}
+
+	return ScanRightScalar(memory, length, dp, stride);
+}
+
+__attribute__((target("avx2")))
+static size_t ScanLeftAVX2(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	const uint32_t step = 32 / stride * stride, mask = StrideMask(stride, step, 32, true);
+	const __m256i zero = _mm256_setzero_si256();
+
+	for(; dp < length && dp >= 31; dp -= step) {
+		__m256i cells = _mm256_loadu_si256((const __m256i *)(memory + dp - 31));
+		uint32_t found = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, zero)) & mask;
+		if (found) return dp - 31 + (31 - __builtin_clz(found));
+	}
+
+	return ScanLeftScalar(memory, length, dp, stride);
+}
+
+#endif
+
+static ScanKernel gScanRight = NULL;
+static ScanKernel gScanLeft = NULL;
+
+// Picks the widest kernels the CPU supports (every thread picks the same ones, so racing here is harmless)
+static void SelectKernels(void) {
+	ScanKernel right = &ScanRightScalar, left = &ScanLeftScalar;
+
+#if BF_SCAN_VECTORIZED
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		right = &ScanRightAVX2;
+		left = &ScanLeftAVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		right = &ScanRightSSE2;
+		left = &ScanLeftSSE2;
+	}
+#endif
+
+	gScanLeft = left;
+	gScanRight = right;
+}
+
+size_t BF_ScanRight(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	if (dp >= length) return dp;
+
+	if (stride == 1) {
+		const char *zero = memchr(memory + dp, 0, length - dp);
+		return zero ? (size_t)(zero - memory) : length;
+	}
+
+	if (stride > MAX_VECTOR_STRIDE) return ScanRightScalar(memory, length, dp, stride);
+
+	if (!gScanRight) SelectKernels();
+	return (*gScanRight)(memory, length, dp, stride);
+}
+
+size_t BF_ScanLeft(const char *memory, size_t length, size_t dp, uint32_t stride) {
+	if (dp >= length) return dp;
+
+#if defined(__GLIBC__)
+	if (stride == 1) {
+		const char *zero = memrchr(memory, 0, dp + 1);
+		return zero ? (size_t)(zero - memory) : (size_t)-1;
+	}
+#endif
+
+	if (stride > MAX_VECTOR_STRIDE) return ScanLeftScalar(memory, length, dp, stride);
+
+	if (!gScanLeft) SelectKernels();
+	return (*gScanLeft)(memory, length, dp, stride);
+}
+
+/*
+ * Wider cells are scanned one cell at a time, length and dp are in cells. The type of the cell is a
+ * constant in every kernel, so the compiler is free to unroll them.
+ */
+#define WIDE_SCAN_KERNELS(type)																		\
+	static size_t ScanRight##type(const char *memory, size_t length, size_t dp, uint32_t stride) {	\
+		const type *cells = (const type *)memory;													\
+		for(; dp < length && cells[dp]; dp += stride);												\
+		return dp;																					\
+	}																								\
+	static size_t ScanLeft##type(const char *memory, size_t length, size_t dp, uint32_t stride) {	\
+		const type *cells = (const type *)memory;													\
+		for(; dp < length && cells[dp]; dp -= stride);												\
+		return dp;																					\
+	}
+
+WIDE_SCAN_KERNELS(uint16_t)
+WIDE_SCAN_KERNELS(uint32_t)
+
+size_t BF_ScanRightWide(const char *memory, size_t length, size_t dp, uint32_t stride, uint8_t cellSize) {
+	if (cellSize == 1) return BF_ScanRight(memory, length, dp, stride);
+	return cellSize == 2 ? ScanRightuint16_t(memory, length, dp, stride) : ScanRightuint32_t(memory, length, dp, stride);
+}
+
+size_t BF_ScanLeftWide(const char *memory, size_t length, size_t dp, uint32_t stride, uint8_t cellSize) {
+	if (cellSize == 1) return BF_ScanLeft(memory, length, dp, stride);
+	return cellSize == 2 ? ScanLeftuint16_t(memory, length, dp, stride) : ScanLeftuint32_t(memory, length, dp, stride);
+}
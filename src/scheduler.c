@@ -0,0 +1,236 @@
+#include <stdlib.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_SCHEDULER_THREADED	1
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MIN_QUEUE_LENGTH		64
+#define MAX_SCHEDULER_THREADS	256
+
+/*
+ * Simulations wait their turn in a single queue, and a worker runs the one it takes for a slice of BF_RunFor
+ * at a time. After a slice, a simulation that is still ready goes to the back of the queue, unless the queue
+ * is empty, then the worker keeps running it without letting go of it (or of its packed program).
+ * A simulation that waits for input is parked until the next wake, or put back right away if a wake came
+ * while its slice ran, so input that arrived in between isn't missed.
+ */
+
+typedef struct {
+	BF_SimulationContext **sims;
+	size_t begin, length, allocated;
+} Queue;
+
+struct BF_Scheduler {
+	uint64_t slice;
+
+	Queue ready;
+	BF_SimulationContext **parked;
+	size_t parkedLength, parkedAllocated;
+
+	unsigned running;		// Simulations that are held by a worker
+	uint64_t wakes;
+
+#if BF_SCHEDULER_THREADED
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// The queue has simulations, or the workers stop
+	pthread_cond_t idle;	// Nothing is running or ready
+	bool stopping;
+
+	pthread_t *threads;
+	unsigned threadsLength;
+#endif
+};
+
+static void Push(Queue *queue, BF_SimulationContext *sim) {
+	if (queue->length >= queue->allocated) {
+		size_t allocated = queue->allocated ? queue->allocated * 2 : MIN_QUEUE_LENGTH;
+		BF_SimulationContext **sims = malloc(allocated * sizeof(BF_SimulationContext *));
+
+		// Unwrapped to the start of the new ring
+		for(size_t i = 0; i < queue->length; ++i) sims[i] = queue->sims[(queue->begin + i) % queue->allocated];
+		free(queue->sims);
+
+		queue->sims = sims;
+		queue->begin = 0;
+		queue->allocated = allocated;
+	}
+
+	queue->sims[(queue->begin + queue->length++) % queue->allocated] = sim;
+}
+
+static BF_SimulationContext *Pop(Queue *queue) {
+	BF_SimulationContext *sim = queue->sims[queue->begin];
+	queue->begin = (queue->begin + 1) % queue->allocated;
+	--queue->length;
+	return sim;
+}
+
+static void Park(BF_Scheduler *scheduler, BF_SimulationContext *sim) {
+	if (scheduler->parkedLength >= scheduler->parkedAllocated) {
+		scheduler->parkedAllocated = scheduler->parkedAllocated ? scheduler->parkedAllocated * 2 : MIN_QUEUE_LENGTH;
+		scheduler->parked = realloc(scheduler->parked, scheduler->parkedAllocated * sizeof(BF_SimulationContext *));
+	}
+
+	scheduler->parked[scheduler->parkedLength++] = sim;
+}
+
+static void Unpark(BF_Scheduler *scheduler) {
+	for(size_t i = 0; i < scheduler->parkedLength; ++i) Push(&scheduler->ready, scheduler->parked[i]);
+	scheduler->parkedLength = 0;
+}
+
+// Where the simulation goes after a slice, true if the worker keeps running it
+static bool Settle(BF_Scheduler *scheduler, BF_SimulationContext *sim, uint64_t wakes) {
+	switch(sim->state) {
+	case BF_RUN_READY:
+		if (!scheduler->ready.length) return true;
+		Push(&scheduler->ready, sim);
+		break;
+	case BF_RUN_WAITING:
+		if (wakes != scheduler->wakes) Push(&scheduler->ready, sim);
+		else Park(scheduler, sim);
+		break;
+	case BF_RUN_ENDED: default: break;
+	}
+
+	return false;
+}
+
+static void FreeQueues(BF_Scheduler *scheduler) {
+	free(scheduler->ready.sims);
+	free(scheduler->parked);
+	free(scheduler);
+}
+
+#if BF_SCHEDULER_THREADED
+
+static void *WorkerMain(void *argument) {
+	BF_Scheduler *scheduler = argument;
+
+	pthread_mutex_lock(&scheduler->lock);
+	for(;;) {
+		while (!scheduler->ready.length && !scheduler->stopping) pthread_cond_wait(&scheduler->work, &scheduler->lock);
+		if (!scheduler->ready.length) break;
+
+		BF_SimulationContext *sim = Pop(&scheduler->ready);
+		++scheduler->running;
+
+		uint64_t wakes;
+		do {
+			wakes = scheduler->wakes;
+			pthread_mutex_unlock(&scheduler->lock);
+			BF_RunFor(sim, scheduler->slice);
+			pthread_mutex_lock(&scheduler->lock);
+		} while (Settle(scheduler, sim, wakes));
+
+		--scheduler->running;
+		if (!scheduler->running && !scheduler->ready.length) pthread_cond_broadcast(&scheduler->idle);
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return NULL;
+}
+
+static unsigned CountProcessors(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+}
+
+BF_Scheduler *BF_CreateScheduler(unsigned threads, uint64_t slice) {
+	if (!threads) threads = CountProcessors();
+	if (threads > MAX_SCHEDULER_THREADS) threads = MAX_SCHEDULER_THREADS;
+
+	BF_Scheduler *scheduler = calloc(1, sizeof(BF_Scheduler));
+	scheduler->slice = slice ? slice : 1;
+	scheduler->threads = malloc(threads * sizeof(pthread_t));
+
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->work, NULL);
+	pthread_cond_init(&scheduler->idle, NULL);
+
+	for(; scheduler->threadsLength < threads; ++scheduler->threadsLength) {
+		if (pthread_create(&scheduler->threads[scheduler->threadsLength], NULL, &WorkerMain, scheduler)) break;
+	}
+
+	if (!scheduler->threadsLength) {
+		BF_FreeScheduler(scheduler);
+		return NULL;
+	}
+	return scheduler;
+}
+
+void BF_Schedule(BF_Scheduler *scheduler, BF_SimulationContext *sim) {
+	if (sim->state == BF_RUN_ENDED) return;
+
+	pthread_mutex_lock(&scheduler->lock);
+	Push(&scheduler->ready, sim);
+	pthread_cond_signal(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+void BF_WakeScheduler(BF_Scheduler *scheduler) {
+	pthread_mutex_lock(&scheduler->lock);
+	++scheduler->wakes;
+	Unpark(scheduler);
+	pthread_cond_broadcast(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+void BF_WaitScheduler(BF_Scheduler *scheduler) {
+	pthread_mutex_lock(&scheduler->lock);
+	while (scheduler->running || scheduler->ready.length) pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+void BF_FreeScheduler(BF_Scheduler *scheduler) {
+	BF_WaitScheduler(scheduler);
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stopping = true;
+	pthread_cond_broadcast(&scheduler->work);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	for(unsigned i = 0; i < scheduler->threadsLength; ++i) pthread_join(scheduler->threads[i], NULL);
+
+	pthread_cond_destroy(&scheduler->idle);
+	pthread_cond_destroy(&scheduler->work);
+	pthread_mutex_destroy(&scheduler->lock);
+	free(scheduler->threads);
+	FreeQueues(scheduler);
+}
+
+#else
+
+// Without threads, the simulations run on the thread that waits for them
+BF_Scheduler *BF_CreateScheduler(unsigned threads, uint64_t slice) {
+	BF_Scheduler *scheduler = calloc(1, sizeof(BF_Scheduler));
+	scheduler->slice = slice ? slice : 1;
+	return scheduler;
+}
+
+void BF_Schedule(BF_Scheduler *scheduler, BF_SimulationContext *sim) {
+	if (sim->state != BF_RUN_ENDED) Push(&scheduler->ready, sim);
+}
+
+void BF_WakeScheduler(BF_Scheduler *scheduler) {
+	++scheduler->wakes;
+	Unpark(scheduler);
+}
+
+void BF_WaitScheduler(BF_Scheduler *scheduler) {
+	while (scheduler->ready.length) {
+		BF_SimulationContext *sim = Pop(&scheduler->ready);
+		do BF_RunFor(sim, scheduler->slice); while (Settle(scheduler, sim, scheduler->wakes));
+	}
+}
+
+void BF_FreeScheduler(BF_Scheduler *scheduler) {
+	BF_WaitScheduler(scheduler);
+	FreeQueues(scheduler);
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_SNAPSHOT_MAPPED	1
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#define SNAPSHOT_MAGIC			"BFS\x1a"
+#define SNAPSHOT_VERSION		1
+#define SNAPSHOT_BYTE_ORDER		0x01020304
+#define SNAPSHOT_CHUNK			(1024 * 1024)	// Bytes of cells copied into the file at a time
+
+/*
+ * A snapshot is the state of a simulation at some point of its run: the memory, dp, ip, the stack, and the
+ * state and error of the run. The I/O is not a part of it, the simulations started from it keep their own.
+ * It's tied to the instructions it was taken of, since ip means nothing in another program.
+ *
+ * Saved, it is:
+ *	[header][stack (uint64_t)][segments][padding to BF_TAPE_ALIGNMENT][cells]
+ * and once loaded, the memories restored from it map the cells from the file itself.
+ */
+
+struct BF_Snapshot {
+	uint64_t key;			// ProgramKey of the context it was taken of
+	uint8_t cellSize;
+	BF_Tape tape;
+
+	int64_t cell;			// Of the tape dp is at
+	size_t ip;
+	BF_RunState state;
+	uint8_t error;
+	char message[BF_MESSAGE_LENGTH];
+
+	uint64_t *stack;
+	size_t stackLength;
+
+	BF_TapeImage cells;
+};
+
+typedef struct {
+	char magic[4];
+	uint32_t version;			// SNAPSHOT_VERSION
+	uint32_t byteOrder;			// SNAPSHOT_BYTE_ORDER as written by the machine that saved it
+	uint8_t cellSize;
+	uint8_t tape;
+	uint8_t state;
+	uint8_t error;
+	uint64_t key;
+	int64_t cell;
+	uint64_t ip;
+	uint64_t stackLength;
+	uint64_t segmentsLength;
+	uint64_t cellsSize;
+	char message[BF_MESSAGE_LENGTH];
+} Header;
+
+// The instructions hashed as if they were a source, with the cell size they were optimized for
+static uint64_t ProgramKey(const BF_Context *ctx) {
+	return BF_SourceKey((const char *)ctx->instructions, ctx->length * sizeof(BF_Instruction), 0, ctx->cellSize);
+}
+
+static BF_Tape TapeOf(const BF_SimulationContext *sim) {
+	if (sim->memory.flags & CTX_MEMORY_PAGED) return BF_TAPE_SPARSE;
+	if (sim->memory.flags & CTX_MEMORY_SCALABLE) return BF_TAPE_GROWABLE;
+	return BF_TAPE_FIXED;
+}
+
+BF_Snapshot *BF_TakeSnapshot(const BF_SimulationContext *sim) {
+	BF_Snapshot *snapshot = calloc(1, sizeof(BF_Snapshot));
+	if (!BF_CaptureTape(sim, &snapshot->cells)) {
+		free(snapshot);
+		return NULL;
+	}
+
+	snapshot->key = ProgramKey(sim->context);
+	snapshot->cellSize = sim->memory.cellSize;
+	snapshot->tape = TapeOf(sim);
+
+	snapshot->cell = sim->memory.origin + (int64_t)sim->dp;
+	snapshot->ip = sim->ip;
+	snapshot->state = sim->state;
+	snapshot->error = sim->error;
+	memcpy(snapshot->message, sim->message, BF_MESSAGE_LENGTH);
+
+	snapshot->stackLength = sim->stack.used;
+	snapshot->stack = malloc((sim->stack.used + 1) * sizeof(uint64_t));
+	memcpy(snapshot->stack, sim->stack.buffer, sim->stack.used * sizeof(uint64_t));
+
+	return snapshot;
+}
+
+bool BF_RestoreSnapshot(BF_SimulationContext *sim, const BF_Snapshot *snapshot) {
+	if (sim->memory.cellSize != snapshot->cellSize || ProgramKey(sim->context) != snapshot->key) return false;
+	if (TapeOf(sim) != snapshot->tape && !BF_UseTape(sim, snapshot->tape)) return false;
+	if (!BF_RestoreTape(sim, &snapshot->cells, snapshot->cell)) return false;
+
+	if (snapshot->stackLength > sim->stack.allocated) {
+		sim->stack.allocated = snapshot->stackLength;
+		sim->stack.buffer = realloc(sim->stack.buffer, sim->stack.allocated * sizeof(uint64_t));
+	}
+	memcpy(sim->stack.buffer, snapshot->stack, snapshot->stackLength * sizeof(uint64_t));
+	sim->stack.used = snapshot->stackLength;
+
+	sim->ip = snapshot->ip;
+	sim->state = snapshot->state;
+	sim->error = snapshot->error;
+	memcpy(sim->message, snapshot->message, BF_MESSAGE_LENGTH);
+	return true;
+}
+
+BF_SimulationContext *BF_ForkSnapshot(const BF_Snapshot *snapshot, BF_Context *ctx) {
+	if (ctx->cellSize != snapshot->cellSize) return NULL;
+
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	if (!BF_RestoreSnapshot(sim, snapshot)) {
+		BF_FreeSimulation(sim);
+		return NULL;
+	}
+
+	return sim;
+}
+
+void BF_FreeSnapshot(BF_Snapshot *snapshot) {
+	if (!snapshot) return;
+
+	BF_FreeTape(&snapshot->cells);
+	free(snapshot->stack);
+	free(snapshot);
+}
+
+static bool WriteAll(FILE *file, const void *data, size_t length) {
+	return !length || fwrite(data, length, 1, file) == 1;
+}
+
+static bool ReadAll(FILE *file, void *data, size_t length) {
+	return !length || fread(data, length, 1, file) == 1;
+}
+
+// Where the cells start in the file
+static uint64_t CellsOffset(uint64_t stackLength, uint64_t segmentsLength) {
+	uint64_t offset = sizeof(Header) + stackLength * sizeof(uint64_t) + segmentsLength * sizeof(BF_TapeSegment);
+	return (offset + BF_TAPE_ALIGNMENT - 1) / BF_TAPE_ALIGNMENT * BF_TAPE_ALIGNMENT;
+}
+
+bool BF_SaveSnapshot(const BF_Snapshot *snapshot, const char *path) {
+	// Written aside and renamed, so the file is never seen half written (or changed under a loaded snapshot)
+	char *temporary = malloc(strlen(path) + 32);
+#if BF_SNAPSHOT_MAPPED
+	sprintf(temporary, "%s.%ld.tmp", path, (long)getpid());
+#else
+	sprintf(temporary, "%s.tmp", path);
+#endif
+
+	FILE *file = fopen(temporary, "wb");
+	if (!file) {
+		free(temporary);
+		return false;
+	}
+
+	Header header = {
+		.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .byteOrder = SNAPSHOT_BYTE_ORDER,
+		.cellSize = snapshot->cellSize, .tape = snapshot->tape, .state = snapshot->state, .error = snapshot->error,
+		.key = snapshot->key, .cell = snapshot->cell, .ip = snapshot->ip, .stackLength = snapshot->stackLength,
+		.segmentsLength = snapshot->cells.length, .cellsSize = snapshot->cells.size
+	};
+	memcpy(header.message, snapshot->message, BF_MESSAGE_LENGTH);
+
+	uint64_t offset = CellsOffset(header.stackLength, header.segmentsLength);
+	uint64_t padding = offset - (sizeof(Header) + header.stackLength * sizeof(uint64_t) + header.segmentsLength * sizeof(BF_TapeSegment));
+	char *chunk = calloc(SNAPSHOT_CHUNK, 1);
+
+	bool written = WriteAll(file, &header, sizeof(header)) &&
+		WriteAll(file, snapshot->stack, snapshot->stackLength * sizeof(uint64_t)) &&
+		WriteAll(file, snapshot->cells.segments, snapshot->cells.length * sizeof(BF_TapeSegment)) &&
+		WriteAll(file, chunk, padding);
+
+	for(uint64_t done = 0; written && done < snapshot->cells.size; done += SNAPSHOT_CHUNK) {
+		uint64_t length = snapshot->cells.size - done < SNAPSHOT_CHUNK ? snapshot->cells.size - done : SNAPSHOT_CHUNK;
+		written = BF_ReadTape(&snapshot->cells, chunk, length, done) && WriteAll(file, chunk, length);
+	}
+
+	written = !fclose(file) && written && !rename(temporary, path);
+	if (!written) remove(temporary);
+
+	free(chunk);
+	free(temporary);
+	return written;
+}
+
+static bool IsValid(const Header *header, uint64_t fileLength) {
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != SNAPSHOT_VERSION ||
+		header->byteOrder != SNAPSHOT_BYTE_ORDER || (header->cellSize != 1 && header->cellSize != 2 && header->cellSize != 4) ||
+		header->tape > BF_TAPE_SPARSE || header->state > BF_RUN_ENDED)
+		return false;
+
+	// The sizes are checked one at a time, none of them can overflow the ones after it
+	uint64_t left = fileLength - sizeof(Header);
+	if (header->stackLength > left / sizeof(uint64_t)) return false;
+	left -= header->stackLength * sizeof(uint64_t);
+	if (header->segmentsLength > left / sizeof(BF_TapeSegment)) return false;
+
+	uint64_t offset = CellsOffset(header->stackLength, header->segmentsLength);
+	return offset <= fileLength && header->cellsSize <= fileLength - offset;
+}
+
+// Every segment is whole in the cells, so a damaged file can't make a restore read past them
+static bool AreSegmentsValid(const BF_TapeImage *image, uint8_t cellSize) {
+	for(size_t i = 0; i < image->length; ++i) {
+		const BF_TapeSegment *segment = &image->segments[i];
+		if (segment->offset % BF_TAPE_ALIGNMENT || segment->offset > image->size ||
+			segment->length > (image->size - segment->offset) / cellSize)
+			return false;
+	}
+
+	return true;
+}
+
+static uint64_t FileLength(FILE *file) {
+#if BF_SNAPSHOT_MAPPED
+	struct stat info;
+	return !fstat(fileno(file), &info) && S_ISREG(info.st_mode) ? (uint64_t)info.st_size : 0;
+#else
+	long length = fseek(file, 0, SEEK_END) ? -1 : ftell(file);
+	rewind(file);
+	return length > 0 ? (uint64_t)length : 0;
+#endif
+}
+
+BF_Snapshot *BF_LoadSnapshot(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return NULL;
+
+	Header header;
+	uint64_t fileLength = FileLength(file);
+	if (fileLength < sizeof(Header) || !ReadAll(file, &header, sizeof(header)) || !IsValid(&header, fileLength)) {
+		fclose(file);
+		return NULL;
+	}
+
+	BF_Snapshot *snapshot = calloc(1, sizeof(BF_Snapshot));
+	*snapshot = (BF_Snapshot){
+		.key = header.key, .cellSize = header.cellSize, .tape = header.tape, .cell = header.cell, .ip = header.ip,
+		.state = header.state, .error = header.error, .stackLength = header.stackLength,
+		.stack = malloc((header.stackLength + 1) * sizeof(uint64_t)),
+		.cells = {
+			.segments = malloc((header.segmentsLength + 1) * sizeof(BF_TapeSegment)), .length = header.segmentsLength,
+			.size = header.cellsSize, .descriptor = -1, .base = CellsOffset(header.stackLength, header.segmentsLength)
+		}
+	};
+	memcpy(snapshot->message, header.message, BF_MESSAGE_LENGTH);
+	snapshot->message[BF_MESSAGE_LENGTH - 1] = 0;
+
+	bool loaded = ReadAll(file, snapshot->stack, header.stackLength * sizeof(uint64_t)) &&
+		ReadAll(file, snapshot->cells.segments, header.segmentsLength * sizeof(BF_TapeSegment)) &&
+		AreSegmentsValid(&snapshot->cells, header.cellSize);
+
+	// The cells stay in the file, which the restored memories map
+#if BF_SNAPSHOT_MAPPED
+	loaded = loaded && (snapshot->cells.descriptor = dup(fileno(file))) >= 0;
+#else
+	snapshot->cells.bytes = loaded ? malloc(header.cellsSize + 1) : NULL;
+	loaded = loaded && !fseek(file, snapshot->cells.base, SEEK_SET) && ReadAll(file, snapshot->cells.bytes, header.cellsSize);
+	snapshot->cells.base = 0;
+#endif
+
+	fclose(file);
+	if (!loaded) {
+		BF_FreeSnapshot(snapshot);
+		return NULL;
+	}
+
+	return snapshot;
+}
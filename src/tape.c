@@ -0,0 +1,575 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_GUARD_SUPPORTED	1
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define MAX_GUARD_SIZE				(64 * 1024 * 1024)
+#define MAX_SCALABLE_MEMORY			(1024 * 1024 * 1024)	// Bytes
+#define PAGE_SHIFT					16						// Cells in a page of a paged memory (as a power of 2)
+#define PAGE_CELLS					((int64_t)1 << PAGE_SHIFT)
+#define MAX_PAGES					(1 << 14)
+
+/*
+ * How far outside of the memory a program can reach before it gets checked.
+ * Between two cell accesses the program can only do a run of moves, so the next access is at most
+ * (offset of the last access + the longest run of moves + offset of the next access) away from a valid cell.
+ */
+size_t BF_GuardSize(const BF_Context *ctx) {
+	uint64_t offset = 0, motion = 0, run = 0;
+
+	for(size_t i = 0; i < ctx->length; ++i) {
+		const BF_Instruction *instruction = &ctx->instructions[i];
+		switch(instruction->type) {
+		case BF_NOP: continue;
+		case BF_MVL: case BF_MVR: run += instruction->operand1; continue;
+		case BF_SCANL: case BF_SCANR: run += instruction->operand1; continue;	// Stops at most one stride out
+
+		case BF_ICL: case BF_ICR: case BF_DCL: case BF_DCR: case BF_STL: case BF_STR:
+			if (instruction->operand2 > offset) offset = instruction->operand2;
+			break;
+		case BF_MUL: case BF_PRT: case BF_INP:
+			if (llabs((int32_t)instruction->operand2) > offset) offset = llabs((int32_t)instruction->operand2);
+			break;
+		case BF_FILL:
+			if (ctx->data[instruction->operand1].length / ctx->cellSize > offset)
+				offset = ctx->data[instruction->operand1].length / ctx->cellSize;
+			break;
+		default: break;
+		}
+
+		if (run > motion) motion = run;
+		run = 0;
+	}
+
+	if (run > motion) motion = run;
+	return 2 * offset + motion + 1;
+}
+
+#if BF_GUARD_SUPPORTED
+
+#define MAX_GUARDED_MEMORIES		256
+
+#define RESERVED_SLOT				((BF_SimulationContext *)1)
+
+/*
+ * The range of every guarded memory is kept next to its simulation, so the fault handler never reads a
+ * simulation that another thread may be freeing, only the one whose range was hit.
+ */
+typedef struct {
+	BF_SimulationContext *sim;		// NULL when free, RESERVED_SLOT while the range is written
+	uintptr_t start, end;
+} GuardedSlot;
+
+static GuardedSlot gGuarded[MAX_GUARDED_MEMORIES];
+static pthread_once_t gHandlerInstalled = PTHREAD_ONCE_INIT;
+static struct sigaction gPreviousSegv, gPreviousBus;	// Of the host, the faults that aren't ours go to them
+
+static __thread BF_FaultRecovery gRecovery = NULL;
+static __thread void *gRecoveryArgument = NULL;
+
+static size_t RoundToPage(size_t bytes, size_t page) {
+	return (bytes + page - 1) / page * page;
+}
+
+static size_t PageSize(void) {
+	return sysconf(_SC_PAGESIZE);
+}
+
+static BF_SimulationContext *FindGuarded(uintptr_t address) {
+	for(size_t i = 0; i < MAX_GUARDED_MEMORIES; ++i) {
+		GuardedSlot *slot = &gGuarded[i];
+		BF_SimulationContext *sim = __atomic_load_n(&slot->sim, __ATOMIC_ACQUIRE);
+		if (!sim || sim == RESERVED_SLOT) continue;
+
+		uintptr_t start = __atomic_load_n(&slot->start, __ATOMIC_RELAXED);
+		uintptr_t end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+		if (start <= address && address < end && __atomic_load_n(&slot->sim, __ATOMIC_ACQUIRE) == sim) return sim;
+	}
+
+	return NULL;
+}
+
+static void FaultHandler(int signal, siginfo_t *info, void *ucontext) {
+	BF_SimulationContext *sim = FindGuarded((uintptr_t)info->si_addr);
+	if (sim && gRecovery && (*gRecovery)(gRecoveryArgument, ucontext)) return;
+
+	// Not ours, passed on to the handler that was there before, or left to crash the program
+	const struct sigaction *previous = signal == SIGBUS ? &gPreviousBus : &gPreviousSegv;
+	if (previous->sa_flags & SA_SIGINFO) {
+		previous->sa_sigaction(signal, info, ucontext);
+	} else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+		previous->sa_handler(signal);
+	} else {
+		struct sigaction action = { 0 };
+		action.sa_handler = SIG_DFL;
+		sigaction(signal, &action, NULL);
+	}
+}
+
+static void InstallHandlerOnce(void) {
+	struct sigaction action = { 0 };
+	action.sa_sigaction = &FaultHandler;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGSEGV, &action, &gPreviousSegv);
+	sigaction(SIGBUS, &action, &gPreviousBus);
+}
+
+// Simulations of a batch are created on many threads at once
+static void InstallHandler(void) {
+	pthread_once(&gHandlerInstalled, &InstallHandlerOnce);
+}
+
+static bool Register(BF_SimulationContext *sim) {
+	for(size_t i = 0; i < MAX_GUARDED_MEMORIES; ++i) {
+		GuardedSlot *slot = &gGuarded[i];
+		if (!__sync_bool_compare_and_swap(&slot->sim, NULL, RESERVED_SLOT)) continue;
+
+		__atomic_store_n(&slot->start, (uintptr_t)sim->memory.buffer - sim->memory.guard, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->end, (uintptr_t)sim->memory.buffer + sim->memory.reserved + sim->memory.guard,
+			__ATOMIC_RELAXED);
+		__atomic_store_n(&slot->sim, sim, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	return false;
+}
+
+static void Unregister(BF_SimulationContext *sim) {
+	for(size_t i = 0; i < MAX_GUARDED_MEMORIES; ++i) {
+		if (__sync_bool_compare_and_swap(&gGuarded[i].sim, sim, NULL)) return;
+	}
+}
+
+/*
+ * Reserves the memory between two PROT_NONE guards:
+ *	[guard][length (read/write)][guard]
+ * Accesses that land in the guards raise SIGSEGV instead of needing a bounds check. Only fixed memories are
+ * guarded, the others move when they grow.
+ * Length and guard are in bytes here, and so are the guard and the reserved space kept in the memory.
+ * The length isn't rounded, a memory that isn't whole pages is left unguarded rather than made longer.
+ */
+static bool AllocateGuarded(BF_SimulationContext *sim, size_t length, size_t guard) {
+	// Both ends of the buffer must be on page boundaries for every out of range access to hit a guard
+	size_t page = PageSize();
+	if (length % page) return false;
+	guard = RoundToPage(guard, page);
+
+	size_t reserved = length;
+	char *region = mmap(NULL, reserved + 2 * guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED) return false;
+
+	if (mprotect(region + guard, length, PROT_READ | PROT_WRITE)) {
+		munmap(region, reserved + 2 * guard);
+		return false;
+	}
+
+	sim->memory.buffer = region + guard;
+	sim->memory.length = length / sim->memory.cellSize;
+	sim->memory.guard = guard;
+	sim->memory.reserved = reserved;
+	sim->memory.flags |= CTX_MEMORY_GUARDED;
+
+	InstallHandler();
+	if (!Register(sim)) {
+		munmap(region, reserved + 2 * guard);
+		sim->memory.flags &= ~CTX_MEMORY_GUARDED;
+		return false;
+	}
+
+	return true;
+}
+
+static void FreeGuarded(BF_SimulationContext *sim) {
+	Unregister(sim);
+	munmap(sim->memory.buffer - sim->memory.guard, sim->memory.reserved + 2 * sim->memory.guard);
+}
+
+void BF_SetFaultRecovery(BF_FaultRecovery recovery, void *argument) {
+	gRecovery = recovery;
+	gRecoveryArgument = argument;
+}
+
+#else
+
+static bool AllocateGuarded(BF_SimulationContext *sim, size_t length, size_t guard) {
+	return false;
+}
+
+static void FreeGuarded(BF_SimulationContext *sim) {}
+
+void BF_SetFaultRecovery(BF_FaultRecovery recovery, void *argument) {}
+
+#endif
+
+/*
+ * A paged memory is a sparse tape, unbounded in both directions. Its pages are only allocated once they're
+ * accessed, and the buffer of the memory is the page of the last access that didn't fit in the one before it.
+ * The engines work on that page as if it was the whole memory, their out of range accesses take the common
+ * path, which moves the buffer (and dp, relative to it) to the page of the access.
+ */
+typedef struct {
+	int64_t number;			// Cells [number * PAGE_CELLS, (number + 1) * PAGE_CELLS) of the tape
+	char *cells;			// NULL in free slots
+} Page;
+
+struct BF_PageTable {
+	Page *slots;			// Open addressing, at most half full
+	size_t used, capacity;
+};
+
+static size_t PageSlot(const BF_PageTable *table, int64_t number) {
+	uint64_t hash = (uint64_t)number * 0x9E3779B97F4A7C15ull;
+	size_t slot = hash >> 32 & (table->capacity - 1);
+
+	while (table->slots[slot].cells && table->slots[slot].number != number) slot = (slot + 1) & (table->capacity - 1);
+	return slot;
+}
+
+// Zeroed cells, mapped so that pages which are only read don't take any memory
+static char *AllocatePage(size_t bytes) {
+#if BF_GUARD_SUPPORTED
+	char *cells = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return cells != MAP_FAILED ? cells : NULL;
+#else
+	return calloc(bytes, 1);
+#endif
+}
+
+static void FreePage(char *cells, size_t bytes) {
+#if BF_GUARD_SUPPORTED
+	munmap(cells, bytes);
+#else
+	free(cells);
+#endif
+}
+
+// Into the free slot PageSlot found for the number
+static void InsertPage(BF_PageTable *table, size_t slot, int64_t number, char *cells) {
+	table->slots[slot] = (Page){ .number = number, .cells = cells };
+	if (++table->used * 2 <= table->capacity) return;
+
+	// Rehashed into a table twice as large
+	Page *slots = table->slots;
+	size_t capacity = table->capacity;
+
+	table->capacity *= 2;
+	table->slots = calloc(table->capacity, sizeof(Page));
+	for(size_t i = 0; i < capacity; ++i) {
+		if (slots[i].cells) table->slots[PageSlot(table, slots[i].number)] = slots[i];
+	}
+
+	free(slots);
+}
+
+static char *FindPage(BF_SimulationContext *sim, int64_t number) {
+	BF_PageTable *table = sim->memory.pages;
+	size_t slot = PageSlot(table, number);
+	if (table->slots[slot].cells) return table->slots[slot].cells;
+
+	if (table->used >= MAX_PAGES) return NULL;
+
+	char *cells = AllocatePage(PAGE_CELLS * sim->memory.cellSize);
+	if (!cells) return NULL;
+
+	InsertPage(table, slot, number, cells);
+	return cells;
+}
+
+static void FreePages(BF_SimulationContext *sim) {
+	BF_PageTable *table = sim->memory.pages;
+	for(size_t i = 0; i < table->capacity; ++i) {
+		if (table->slots[i].cells) FreePage(table->slots[i].cells, PAGE_CELLS * sim->memory.cellSize);
+	}
+
+	memset(table->slots, 0, table->capacity * sizeof(Page));
+	table->used = 0;
+}
+
+// Moves the buffer to the page of the cell, keeping dp on the same cell of the tape
+static bool MoveToPage(BF_SimulationContext *sim, int64_t cell) {
+	int64_t number = cell >= 0 ? cell / PAGE_CELLS : -((-cell - 1) / PAGE_CELLS) - 1;
+	char *cells = FindPage(sim, number);
+	if (!cells) return false;
+
+	int64_t origin = number * PAGE_CELLS;
+	sim->dp = (size_t)(sim->memory.origin + (int64_t)sim->dp - origin);
+	sim->memory.buffer = cells;
+	sim->memory.length = PAGE_CELLS;
+	sim->memory.origin = origin;
+	return true;
+}
+
+static bool AllocatePaged(BF_SimulationContext *sim) {
+	BF_PageTable *table = malloc(sizeof(BF_PageTable));
+	table->capacity = 64;
+	table->used = 0;
+	table->slots = calloc(table->capacity, sizeof(Page));
+
+	sim->memory.pages = table;
+	sim->memory.origin = 0;
+	return MoveToPage(sim, 0);
+}
+
+// Grows an unguarded memory by at least as much as it has, to the left or to the right of the cell
+static bool GrowToCell(BF_SimulationContext *sim, int64_t cell) {
+	size_t size = sim->memory.cellSize, length = sim->memory.length;
+	size_t left = cell < 0 ? -cell : 0, right = cell >= (int64_t)length ? cell - length + 1 : 0;
+	if (left && left < length) left = length;
+	if (right && right < length) right = length;
+
+	if (length + left + right > MAX_SCALABLE_MEMORY / size) return false;
+
+	char *buffer = realloc(sim->memory.buffer, (length + left + right) * size);
+	if (!buffer) return false;
+
+	memmove(buffer + left * size, buffer, length * size);
+	memset(buffer, 0, left * size);
+	memset(buffer + (left + length) * size, 0, right * size);
+
+	sim->memory.buffer = buffer;
+	sim->memory.length = length + left + right;
+	sim->memory.origin -= left;
+	sim->dp += left;
+	return true;
+}
+
+// Lengths are in cells, of the size set in the memory
+bool BF_AllocateMemory(BF_SimulationContext *sim, size_t length, size_t guard) {
+	size_t size = sim->memory.cellSize;
+	sim->memory.guard = 0;
+	sim->memory.reserved = length * size;
+	sim->memory.origin = 0;
+	sim->memory.pages = NULL;
+	sim->memory.flags &= ~CTX_MEMORY_GUARDED;
+
+	if (sim->memory.flags & CTX_MEMORY_PAGED) return AllocatePaged(sim);
+	if (guard && guard <= MAX_GUARD_SIZE / size && AllocateGuarded(sim, length * size, guard * size)) return true;
+
+	sim->memory.buffer = calloc(length, size);
+	sim->memory.length = length;
+	return sim->memory.buffer != NULL;
+}
+
+bool BF_ReachMemory(BF_SimulationContext *sim, int32_t shift) {
+	int64_t cell = (int64_t)(sim->dp + shift);		// Relative to the buffer, dp wraps around below it
+
+	if (sim->memory.flags & CTX_MEMORY_PAGED) return MoveToPage(sim, sim->memory.origin + cell);
+	if (sim->memory.flags & CTX_MEMORY_SCALABLE) return GrowToCell(sim, cell);
+	return false;
+}
+
+void BF_ClearMemory(BF_SimulationContext *sim) {
+	if (sim->memory.flags & CTX_MEMORY_PAGED) {
+		FreePages(sim);
+		sim->dp = 0;
+		sim->memory.origin = 0;
+		MoveToPage(sim, 0);
+		return;
+	}
+
+	memset(sim->memory.buffer, 0, sim->memory.length * sim->memory.cellSize);
+	sim->dp = -sim->memory.origin;		// Cell 0 of the tape
+}
+
+void BF_FreeMemory(BF_SimulationContext *sim) {
+	if (sim->memory.flags & CTX_MEMORY_PAGED) {
+		FreePages(sim);
+		free(sim->memory.pages->slots);
+		free(sim->memory.pages);
+		sim->memory.pages = NULL;
+	}
+	else if (sim->memory.flags & CTX_MEMORY_GUARDED) FreeGuarded(sim);
+	else free(sim->memory.buffer);
+
+	sim->memory.buffer = NULL;
+	sim->memory.length = 0;
+}
+
+/*
+ * Tape images. The cells are kept in a file where possible (a memfd, or the snapshot they were loaded from),
+ * which fixed and paged memories map copy on write, so they share the cells until they write them. They are
+ * copied otherwise, and into growable memories, which move when they grow.
+ */
+
+#if defined(__linux__)
+#define BF_TAPE_MEMFD	1
+#endif
+
+static void AddSegment(BF_TapeImage *image, int64_t cell, uint64_t length, size_t size) {
+	image->segments = realloc(image->segments, (image->length + 1) * sizeof(BF_TapeSegment));
+	image->segments[image->length++] = (BF_TapeSegment){ .cell = cell, .length = length, .offset = image->size };
+	image->size += (length * size + BF_TAPE_ALIGNMENT - 1) / BF_TAPE_ALIGNMENT * BF_TAPE_ALIGNMENT;
+}
+
+static bool WriteSegment(BF_TapeImage *image, const BF_TapeSegment *segment, const char *cells, size_t size) {
+	uint64_t length = segment->length * size;
+
+#if BF_TAPE_MEMFD
+	if (image->descriptor >= 0) {
+		for(uint64_t done = 0; done < length;) {
+			ssize_t written = pwrite(image->descriptor, cells + done, length - done, segment->offset + done);
+			if (written <= 0) return false;
+			done += written;
+		}
+		return true;
+	}
+#endif
+
+	memcpy(image->bytes + segment->offset, cells, length);
+	return true;
+}
+
+bool BF_CaptureTape(const BF_SimulationContext *sim, BF_TapeImage *image) {
+	const BF_PageTable *table = sim->memory.pages;
+	size_t size = sim->memory.cellSize;
+	*image = (BF_TapeImage){ .descriptor = -1 };
+
+	if (sim->memory.flags & CTX_MEMORY_PAGED) {
+		for(size_t i = 0; i < table->capacity; ++i) {
+			if (table->slots[i].cells) AddSegment(image, table->slots[i].number * PAGE_CELLS, PAGE_CELLS, size);
+		}
+	} else {
+		AddSegment(image, sim->memory.origin, sim->memory.length, size);
+	}
+
+#if BF_TAPE_MEMFD
+	image->descriptor = memfd_create("bf-tape", MFD_CLOEXEC);
+	if (image->descriptor >= 0 && ftruncate(image->descriptor, image->size)) {
+		close(image->descriptor);
+		image->descriptor = -1;
+	}
+#endif
+	if (image->descriptor < 0) image->bytes = calloc(image->size + 1, 1);
+
+	bool written = image->descriptor >= 0 || image->bytes;
+	for(size_t i = 0; written && i < image->length; ++i) {
+		const BF_TapeSegment *segment = &image->segments[i];
+		const char *cells = sim->memory.flags & CTX_MEMORY_PAGED ?
+			table->slots[PageSlot(table, segment->cell / PAGE_CELLS)].cells : sim->memory.buffer;
+
+		written = WriteSegment(image, segment, cells, size);
+	}
+
+	if (!written) BF_FreeTape(image);
+	return written;
+}
+
+bool BF_ReadTape(const BF_TapeImage *image, void *bytes, uint64_t length, uint64_t offset) {
+	if (offset > image->size || length > image->size - offset) return false;
+
+#if BF_GUARD_SUPPORTED
+	if (image->descriptor >= 0) {
+		for(uint64_t done = 0; done < length;) {
+			ssize_t read = pread(image->descriptor, (char *)bytes + done, length - done, image->base + offset + done);
+			if (read <= 0) return false;
+			done += read;
+		}
+		return true;
+	}
+#endif
+
+	memcpy(bytes, image->bytes + offset, length);
+	return true;
+}
+
+// The cells of the segment mapped at at (or anywhere, when NULL), NULL if they have to be copied
+static char *MapSegment(const BF_TapeImage *image, const BF_TapeSegment *segment, uint64_t length, char *at) {
+#if BF_GUARD_SUPPORTED
+	uint64_t offset = image->base + segment->offset;
+	if (image->descriptor < 0 || offset % PageSize() || segment->offset > image->size || length > image->size - segment->offset)
+		return NULL;
+
+	char *cells = mmap(at, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | (at ? MAP_FIXED : 0), image->descriptor, offset);
+	return cells != MAP_FAILED ? cells : NULL;
+#else
+	return NULL;
+#endif
+}
+
+static bool RestorePages(BF_SimulationContext *sim, const BF_TapeImage *image, int64_t cell) {
+	BF_PageTable *table = sim->memory.pages;
+	size_t length = PAGE_CELLS * sim->memory.cellSize;
+	FreePages(sim);
+
+	for(size_t i = 0; i < image->length; ++i) {
+		const BF_TapeSegment *segment = &image->segments[i];
+		if (segment->length != PAGE_CELLS || segment->cell % PAGE_CELLS || table->used >= MAX_PAGES) return false;
+
+		int64_t number = segment->cell / PAGE_CELLS;
+		size_t slot = PageSlot(table, number);
+		if (table->slots[slot].cells) return false;		// The same page twice
+
+		char *cells = MapSegment(image, segment, length, NULL);
+		if (!cells) {
+			if (!(cells = AllocatePage(length))) return false;
+			if (!BF_ReadTape(image, cells, length, segment->offset)) {
+				FreePage(cells, length);
+				return false;
+			}
+		}
+
+		InsertPage(table, slot, number, cells);
+	}
+
+	sim->memory.origin = 0;
+	sim->dp = cell;
+	return MoveToPage(sim, cell);
+}
+
+static bool RestoreCells(BF_SimulationContext *sim, const BF_TapeImage *image, int64_t cell) {
+	size_t size = sim->memory.cellSize;
+	if (image->length != 1 || image->segments[0].length > image->size / size) return false;
+
+	const BF_TapeSegment *segment = &image->segments[0];
+	uint64_t length = segment->length * size;
+
+	if (sim->memory.flags & CTX_MEMORY_SCALABLE) {
+		if (!segment->length || length > MAX_SCALABLE_MEMORY) return false;
+
+		char *buffer = realloc(sim->memory.buffer, length);
+		if (!buffer) return false;
+
+		sim->memory.buffer = buffer;
+		sim->memory.length = segment->length;
+		sim->memory.origin = segment->cell;
+	} else if (segment->cell || segment->length != sim->memory.length) {
+		return false;
+	} else if (sim->memory.flags & CTX_MEMORY_GUARDED && MapSegment(image, segment, length, sim->memory.buffer)) {
+		sim->dp = cell;
+		return true;
+	}
+
+	sim->dp = (size_t)(cell - sim->memory.origin);
+	return BF_ReadTape(image, sim->memory.buffer, length, segment->offset);
+}
+
+bool BF_RestoreTape(BF_SimulationContext *sim, const BF_TapeImage *image, int64_t cell) {
+	bool restored = sim->memory.flags & CTX_MEMORY_PAGED ? RestorePages(sim, image, cell) : RestoreCells(sim, image, cell);
+	if (!restored) BF_ClearMemory(sim);
+
+	return restored;
+}
+
+void BF_FreeTape(BF_TapeImage *image) {
+#if BF_GUARD_SUPPORTED
+	if (image->descriptor >= 0) close(image->descriptor);
+#endif
+	free(image->segments);
+	free(image->bytes);
+	*image = (BF_TapeImage){ .descriptor = -1 };
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bf.h"
+
+#define ASSERT(expr) if (!(expr)) { printf("%s:%d: Assert failed: "#expr"\n", __FUNCTION__, __LINE__); result = 1; goto cleanup; }
+
+static char *ReadAll(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+
+	char *content = malloc(length + 1);
+	content[fread(content, 1, length, file)] = 0;
+
+	fclose(file);
+	return content;
+}
+
+static void WriteAll(const char *path, const char *content) {
+	FILE *file = fopen(path, "wb");
+	fputs(content, file);
+	fclose(file);
+}
+
+// Runs the context on the interpreter with its input and output redirected to files
+static bool RunInterpreter(BF_Context *ctx, const char *input, const char *output) {
+	int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644), in = open(input, O_RDONLY);
+
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	BF_SetIODescriptors(sim, in, out, 0);
+	BF_Run(sim);
+	bool error = sim->error;
+	BF_FreeSimulation(sim);
+
+	close(out), close(in);
+	return !error;
+}
+
+// The files of a comparison, in a directory of their own that's removed with them
+static const char *const EXPORT_FILES[] = { "input.txt", "program.c", "program", "actual.txt", "expected.txt" };
+enum { EXPORT_INPUT, EXPORT_SOURCE, EXPORT_PROGRAM, EXPORT_ACTUAL, EXPORT_EXPECTED, EXPORT_FILES_LENGTH };
+
+/*
+ * Transpiles a sample to C, compiles it with the system compiler and verifies that the
+ * native program prints the same output as the interpreter.
+ */
+int CompareTranspiled(const char *sample, const char *input, uint8_t optimizationLevel) {
+	int result = 0;
+	char command[4096], path[512], directory[] = "/tmp/bf-export-XXXXXX", files[EXPORT_FILES_LENGTH][512];
+	char *code = NULL, *expected = NULL, *actual = NULL;
+	BF_Context *ctx = NULL;
+
+	bool created = mkdtemp(directory) != NULL;
+	ASSERT(created);
+	for(size_t i = 0; i < EXPORT_FILES_LENGTH; ++i) snprintf(files[i], sizeof files[i], "%s/%s", directory, EXPORT_FILES[i]);
+
+	snprintf(path, sizeof path, "%s/%s.bf", BF_SAMPLES_DIR, sample);
+	ctx = BF_Open(path, NULL);
+	ASSERT(ctx);
+	BF_Optimize(ctx, optimizationLevel);
+
+	WriteAll(files[EXPORT_INPUT], input);
+
+	code = BF_ExportC(ctx);
+	ASSERT(code);
+	WriteAll(files[EXPORT_SOURCE], code);
+
+	snprintf(command, sizeof command, "%s -O2 -o %s %s", BF_C_COMPILER, files[EXPORT_PROGRAM], files[EXPORT_SOURCE]);
+	ASSERT(system(command) == 0);
+
+	snprintf(command, sizeof command, "%s < %s > %s", files[EXPORT_PROGRAM], files[EXPORT_INPUT], files[EXPORT_ACTUAL]);
+	ASSERT(system(command) == 0);
+	ASSERT(RunInterpreter(ctx, files[EXPORT_INPUT], files[EXPORT_EXPECTED]));
+
+	expected = ReadAll(files[EXPORT_EXPECTED]);
+	actual = ReadAll(files[EXPORT_ACTUAL]);
+	ASSERT(expected && actual);
+	ASSERT(strcmp(expected, actual) == 0);
+cleanup:
+	if (result) printf("\tSample %s, optimization level %d\n", sample, optimizationLevel);
+
+	if (created) {
+		for(size_t i = 0; i < EXPORT_FILES_LENGTH; ++i) remove(files[i]);
+		rmdir(directory);
+	}
+
+	free(code);
+	free(expected);
+	free(actual);
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma region ExportC
+
+int TestExportC_OnSamples_ThenMatchInterpreter(void) {
+	int result = 0;
+
+	static const struct { const char *sample, *input; uint8_t optimizationLevel; } SAMPLES[] = {
+		{ "hello", "", BF_OPT_NONE },
+		{ "hello", "", BF_OPT_MIN },
+		{ "hello", "", BF_OPT_MAX },
+		{ "simple", "", BF_OPT_NONE },
+		{ "simple", "", BF_OPT_MIN },
+		{ "test", "", BF_OPT_NONE },
+		{ "test", "", BF_OPT_MIN },
+		{ "rot14", "Hello, World!\n", BF_OPT_NONE },
+		{ "rot14", "Hello, World!\n", BF_OPT_MIN },
+		{ "conway", "bb\nbc\nbd\n\n\nq\n", BF_OPT_NONE },
+		{ "conway", "bb\nbc\nbd\n\n\nq\n", BF_OPT_MIN },
+		{ "conway", "bb\nbc\nbd\n\n\nq\n", BF_OPT_MAX },
+	};
+
+	for(size_t i = 0; i < sizeof SAMPLES / sizeof SAMPLES[0]; ++i) {
+		result |= CompareTranspiled(SAMPLES[i].sample, SAMPLES[i].input, SAMPLES[i].optimizationLevel);
+	}
+
+	return result;
+}
+
+int TestExportC_OnUnstructuredJump_ThenFail(void) {
+	int result = 0;
+
+	BF_Instruction instructions[] = {
+		{ .type = BF_LBL, .operand1 = 3 },
+		{ .type = BF_INC, .operand1 = 1 },
+		{ .type = BF_RPT, .operand1 = 0 },
+		{ .type = BF_PRT },
+	};
+	BF_Context ctx = { .instructions = instructions, .length = sizeof instructions / sizeof instructions[0] };
+
+	char *code = BF_ExportC(&ctx);
+	ASSERT(!code);
+cleanup:
+	free(code);
+	return result;
+}
+
+#pragma endregion
+
+
+int main(void) {
+	int result = 0;
+
+	result |= TestExportC_OnSamples_ThenMatchInterpreter();
+	result |= TestExportC_OnUnstructuredJump_ThenFail();
+
+	return result;
+}
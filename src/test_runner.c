@@ -0,0 +1,1412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "bf.h"
+
+#define ASSERT(expr) if (!(expr)) { printf("%s:%d: Assert failed: "#expr"\n", __FUNCTION__, __LINE__); result = 1; goto cleanup; }
+
+FILE *EmulateStream(const char *content) {
+	FILE *file = tmpfile();
+
+	fputs(content, file);
+	rewind(file);
+
+	return file;
+}
+
+BF_Context *LoadProgramOf(const char *source, uint8_t optimizationLevel, uint8_t cellSize) {
+	FILE *f = EmulateStream(source);
+	BF_Context *ctx = BF_FromFile(f, NULL);
+	fclose(f);
+
+	ctx->cellSize = cellSize;
+	BF_Optimize(ctx, optimizationLevel);
+	return ctx;
+}
+
+BF_Context *LoadProgram(const char *source, uint8_t optimizationLevel) {
+	return LoadProgramOf(source, optimizationLevel, 1);
+}
+
+// Replaces the (guarded) memory of the simulation with a plain bounds checked one
+void UseCheckedMemory(BF_SimulationContext *sim) {
+	BF_FreeMemory(sim);
+	BF_AllocateMemory(sim, BF_FIXED_TAPE_LENGTH, 0);
+}
+
+/*
+ * Runs the same program on the switch interpreter and on another engine, and verifies that
+ * both of them end with the same steps count, error state, data pointer and memory.
+ */
+int CompareEnginesOn(const char *source, uint8_t optimizationLevel, BF_Engine engine, bool checked, uint8_t cellSize) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgramOf(source, optimizationLevel, cellSize);
+	BF_SimulationContext *expected = BF_CreateSimulation(ctx);
+	BF_SimulationContext *actual = BF_CreateSimulation(ctx);
+	if (checked) {
+		UseCheckedMemory(expected);
+		UseCheckedMemory(actual);
+	}
+
+	uint64_t expectedSteps = BF_Run(expected);
+	uint64_t actualSteps = BF_RunEngine(actual, engine);
+
+	ASSERT(expectedSteps == actualSteps);
+	ASSERT(expected->error == actual->error);
+	ASSERT(expected->dp == actual->dp);
+	ASSERT(expected->memory.length == actual->memory.length);
+	ASSERT(memcmp(expected->memory.buffer, actual->memory.buffer, expected->memory.length * cellSize) == 0);
+cleanup:
+	if (result) printf("\tEngine %d, optimization level %d, checked %d, cell size %d, program %s\n",
+		engine, optimizationLevel, checked, cellSize, source);
+
+	BF_FreeSimulation(expected);
+	BF_FreeSimulation(actual);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int CompareEngines(const char *source, uint8_t optimizationLevel, BF_Engine engine) {
+	return CompareEnginesOn(source, optimizationLevel, engine, false, 1) |
+		CompareEnginesOn(source, optimizationLevel, engine, true, 1);
+}
+
+static const char *gPrograms[] = {
+	"++>+++++[<+>-]<",
+	">>+++[<++[>>+<<-]>-]<<[-]+>[-]++>>[<+>-]",
+	"++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>[-]>---[-]>+++++++[-]>>++",
+	"+[>>>+<<<-]>>>[<+>-]<<+<[>>+<<[-]]",
+	"+++[>+++[>+++[>+<-]<-]<-]>>>[<<+>>-]",
+	"<+",								// Out of memory on the first access
+	">>>>[-]<<<<<<<[-]",				// Out of memory after some work
+	"+[>+]",							// Out of memory on the right
+	"+++++[->+++>-->>+<<<<]>>>>[+>++<]>>++[-<<<<+>>>>]",	// Multiplication loops counting down, up and to the left
+	"+++[<+>-]",						// Out of memory in a multiplication
+	"[-<+>][++<-->]+++",				// Multiplications out of memory that never run
+	">+>+>+>+>>+>+>+<<<[<]+>>>>>>>[>>]+<<<<[<<<]",	// Scans
+	"+>+>+>+[<]",						// Out of memory in a scan
+	">>+<<<+>>>>-<[<]>>>+<+[>>++<-<+>]",	// Deferred moves
+	"+>+>+<<[>++++++<-]>[>>>>>>>>+<<<<<<<<-]>>>>>>>>[<<<<<<<<<<<<<<<<+>>>>>>>>>>>>>>>>-]",	// Out of memory with an offset
+	"+++[>++>+++<<-]>>>>+.>.<<[<]>.",	// Evaluated up to the end
+	"++++[>++++<-]>.[<<<+>>>-]",		// Evaluated up to the loop that goes out of memory
+	NULL
+};
+
+// Value of the cell after running the program, the same on every engine and optimization level (-1 otherwise)
+int64_t RunToCell(const char *source, uint8_t cellSize, size_t index) {
+	int64_t value = -2;		// Nothing ran yet
+
+	for(uint8_t level = BF_OPT_NONE; level <= BF_OPT_MAX; ++level) {
+		for(BF_Engine engine = BF_ENGINE_INTERPRETER; engine <= BF_ENGINE_HOT; ++engine) {
+			BF_Context *ctx = LoadProgramOf(source, level, cellSize);
+			BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+			BF_RunEngine(sim, engine);
+
+			uint32_t cell = 0;
+			memcpy(&cell, sim->memory.buffer + index * cellSize, cellSize);
+
+			int64_t ended = sim->error ? -1 : (int64_t)cell;
+			value = value == -2 || value == ended ? ended : -1;
+
+			BF_FreeSimulation(sim);
+			BF_FreeContext(ctx);
+		}
+	}
+
+	return value;
+}
+
+#pragma region Threaded
+
+int TestThreaded_OnPrograms_ThenMatchInterpreter(void) {
+	int result = 0;
+
+	for(int i = 0; gPrograms[i]; ++i) {
+		result |= CompareEngines(gPrograms[i], BF_OPT_NONE, BF_ENGINE_THREADED);
+		result |= CompareEngines(gPrograms[i], BF_OPT_MIN, BF_ENGINE_THREADED);
+		result |= CompareEngines(gPrograms[i], BF_OPT_MAX, BF_ENGINE_THREADED);
+	}
+
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Optimizer
+
+int TestMultiplyLoop_OnCopyLoop_ThenMultiply(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram("++[->+++<<-->]", BF_OPT_MIN);
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	sim->dp = 1;
+
+	ASSERT(ctx->length == 4);
+	ASSERT(ctx->instructions[1].type == BF_MUL && ctx->instructions[1].operand1 == 3 && (int32_t)ctx->instructions[1].operand2 == 1);
+	ASSERT(ctx->instructions[2].type == BF_MUL && ctx->instructions[2].operand1 == 254 && (int32_t)ctx->instructions[2].operand2 == -1);
+	ASSERT(ctx->instructions[3].type == BF_SET && ctx->instructions[3].operand1 == 0);
+
+	BF_Run(sim);
+	ASSERT(!sim->error);
+	ASSERT(sim->memory.buffer[0] == -4 && sim->memory.buffer[1] == 0 && sim->memory.buffer[2] == 6);
+cleanup:
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestMultiplyLoop_OnNonUnitSteps_ThenCountIterations(void) {
+	int result = 0;
+	uint32_t iterations = 0;
+
+	BF_Context *ctx = LoadProgram(",[++++++>+<]", BF_OPT_MIN);
+	ASSERT(ctx->length == 5);
+	ASSERT(ctx->instructions[1].type == BF_MUL && ctx->instructions[1].operand1 == 0);	// Touches the target first
+	ASSERT(ctx->instructions[2].type == BF_COUNT && ctx->instructions[2].operand1 == 6);
+	ASSERT(ctx->instructions[3].type == BF_MUL && ctx->instructions[3].operand1 == 1);
+	ASSERT(ctx->instructions[4].type == BF_SET && ctx->instructions[4].operand1 == 0);
+
+	// Odd steps always get to 0, and even ones only from a multiple of their power of 2
+	ASSERT(BF_CountIterations(8, -3, 1, &iterations) && iterations == 88);
+	ASSERT(BF_CountIterations(4, 6, 2, &iterations) && iterations == 10922);
+	ASSERT(BF_CountIterations(0, 0, 1, &iterations) && iterations == 0);
+	ASSERT(!BF_CountIterations(1, 2, 1, &iterations));
+	ASSERT(!BF_CountIterations(6, 4, 4, &iterations));
+	ASSERT(!BF_CountIterations(1, 0, 1, &iterations));
+
+	ASSERT(RunToCell("++++++++[--->+<]", 1, 1) == 88);
+	ASSERT(RunToCell("++++[++++++>+<]", 1, 1) == 42);
+	ASSERT(RunToCell("++++[++++++>+<]", 2, 1) == 10922);
+	ASSERT(RunToCell("++++++[>+++<--]", 1, 1) == 9);
+
+	// Counts that never end fail on their targets, like the loops did
+	ASSERT(RunToCell("+[<--+>]", 1, 0) == -1);
+	ASSERT(RunToCell("+[<++>++]", 1, 0) == -1);
+cleanup:
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestMultiplyLoop_OnLoopNotEntered_ThenSkipTargets(void) {
+	int result = 0;
+
+	// The targets are out of the memory, but the loops never run
+	ASSERT(RunToCell("[-<+>]+++", 1, 0) == 3);
+	ASSERT(RunToCell("[-<+>]", 2, 0) == 0);
+	ASSERT(RunToCell("[++<-->]+", 1, 0) == 1);
+	ASSERT(RunToCell("[>+<++<++>]++", 1, 0) == 2);
+	ASSERT(RunToCell(">+.<[-<++>++]>", 1, 1) == 1);
+cleanup:
+	return result;
+}
+
+int TestDeferMotion_OnBasicBlock_ThenMoveOnce(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram(">>+<.>>-[<]", BF_OPT_MIN);
+
+	ASSERT(ctx->length == 5);
+	ASSERT(ctx->instructions[0].type == BF_ICR && ctx->instructions[0].operand1 == 1 && ctx->instructions[0].operand2 == 2);
+	ASSERT(ctx->instructions[1].type == BF_PRT && (int32_t)ctx->instructions[1].operand2 == 1);
+	ASSERT(ctx->instructions[2].type == BF_DCR && ctx->instructions[2].operand1 == 1 && ctx->instructions[2].operand2 == 3);
+	ASSERT(ctx->instructions[3].type == BF_MVR && ctx->instructions[3].operand1 == 3);
+	ASSERT(ctx->instructions[4].type == BF_SCANL && ctx->instructions[4].operand1 == 1);
+cleanup:
+	BF_FreeContext(ctx);
+	return result;
+}
+
+static size_t CountOperations(const BF_Context *ctx, BF_Operation type) {
+	size_t count = 0;
+	for(size_t i = 0; i < ctx->length; ++i) count += ctx->instructions[i].type == type;
+
+	return count;
+}
+
+int TestPropagateConstants_OnKnownLoops_ThenUnroll(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram("++++++++[>++++++++<-]>+.", BF_OPT_MIN);
+
+	ASSERT(BF_PropagateConstants(ctx));
+
+	ASSERT(CountOperations(ctx, BF_LBL) == 0 && CountOperations(ctx, BF_WHILE) == 0 && CountOperations(ctx, BF_MUL) == 0);
+	ASSERT(ctx->instructions[0].type == BF_STR && ctx->instructions[0].operand1 == 'A' && ctx->instructions[0].operand2 == 1);
+	ASSERT(ctx->instructions[1].type == BF_PRT && (int32_t)ctx->instructions[1].operand2 == 1);
+cleanup:
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestPropagateConstants_OnZeroCell_ThenRemoveLoop(void) {
+	int result = 0;
+
+	// The first loop never runs on the fresh memory, and the last one starts on the cell the second ended on
+	BF_Context *ctx = LoadProgram("[.>]>,[.-][.>]", BF_OPT_MIN);
+
+	ASSERT(BF_PropagateConstants(ctx));
+	ASSERT(CountOperations(ctx, BF_LBL) == 1);
+	ASSERT(ctx->instructions[0].type == BF_INP && (int32_t)ctx->instructions[0].operand2 == 1);
+cleanup:
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestEvaluatePrefix_OnInputInLoop_ThenStopBeforeLoop(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram("+++[>++<-]>.[<,.>-]", BF_OPT_MIN);
+
+	// Prints 6, and leaves 6 in cell 1 for the loop that reads
+	ASSERT(BF_EvaluatePrefix(ctx, 1000));
+	ASSERT(ctx->length == 3 + 5);
+	ASSERT(ctx->instructions[0].type == BF_WRITE && ctx->instructions[1].type == BF_MVR && ctx->instructions[2].type == BF_FILL);
+	ASSERT(ctx->data[ctx->instructions[0].operand1].length == 1 && ctx->data[ctx->instructions[0].operand1].bytes[0] == 6);
+	ASSERT(ctx->data[ctx->instructions[2].operand1].length == 1 && ctx->data[ctx->instructions[2].operand1].bytes[0] == 6);
+	ASSERT(ctx->instructions[3].type == BF_LBL && ctx->instructions[3].operand1 == ctx->length - 1);
+cleanup:
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Packed
+
+int TestPacked_OnWideOperands_ThenUnpackToSameProgram(void) {
+	int result = 0;
+	static char source[100000];
+
+	// Long moves, and a loop too long for a 16 bit jump
+	char *cursor = source;
+	cursor += sprintf(cursor, "+++[");
+	for(int i = 0; i < 20000; ++i) cursor += sprintf(cursor, "+>");
+	for(int i = 0; i < 40000; ++i) *cursor++ = '<';
+	cursor += sprintf(cursor, "-].");
+
+	BF_Context *ctx = LoadProgram(source, BF_OPT_NONE);
+	BF_PackedProgram *program = BF_Pack(ctx);
+	BF_Context *unpacked = BF_Unpack(program);
+
+	ASSERT(program->length == ctx->length + 3);		// Both jumps and the long move are wide
+	ASSERT(unpacked->length == ctx->length);
+	for(size_t i = 0; i < ctx->length; ++i) {
+		ASSERT(unpacked->instructions[i].type == ctx->instructions[i].type);
+		ASSERT(unpacked->instructions[i].operand1 == ctx->instructions[i].operand1);
+		ASSERT(unpacked->instructions[i].operand2 == ctx->instructions[i].operand2);
+	}
+
+	result |= CompareEngines(source, BF_OPT_NONE, BF_ENGINE_THREADED);
+cleanup:
+	BF_FreeContext(unpacked);
+	BF_FreePacked(program);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestPacked_OnWideCells_ThenKeepLongValues(void) {
+	int result = 0;
+	static char source[2000];
+
+	// A set of 1000 and a subtraction of 300, neither of them fits in the slot of a 16 bit cell
+	char *cursor = source;
+	cursor += sprintf(cursor, "[-]");
+	for(int i = 0; i < 1000; ++i) *cursor++ = '+';
+	*cursor++ = '>';
+	for(int i = 0; i < 300; ++i) *cursor++ = '-';
+
+	BF_Context *ctx = LoadProgramOf(source, BF_OPT_MIN, 2);
+	BF_PackedProgram *program = BF_Pack(ctx);
+	BF_Context *unpacked = BF_Unpack(program);
+
+	ASSERT(program->length == ctx->length + 2);
+	ASSERT(unpacked->length == ctx->length && unpacked->cellSize == 2);
+	for(size_t i = 0; i < ctx->length; ++i) {
+		ASSERT(unpacked->instructions[i].type == ctx->instructions[i].type);
+		ASSERT(unpacked->instructions[i].operand1 == ctx->instructions[i].operand1);
+	}
+
+	ASSERT(RunToCell(source, 2, 0) == 1000 && RunToCell(source, 2, 1) == 0x10000 - 300);
+cleanup:
+	BF_FreeContext(unpacked);
+	BF_FreePacked(program);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Profile
+
+int TestProfile_OnNestedLoops_ThenCountEntriesAndIterations(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram("++[>+++[>+<-]<-]", BF_OPT_NONE);
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	BF_Profile *profile = BF_CreateProfile(ctx);
+	uint64_t expected = BF_Run(sim);
+
+	BF_FreeSimulation(sim);
+	sim = BF_CreateSimulation(ctx);
+	ASSERT(BF_RunProfiled(sim, profile) == expected);
+
+	uint64_t steps = 0;
+	for(size_t i = 0; i < ctx->length; ++i) steps += profile->hits[i];
+	ASSERT(steps == expected);
+
+	ASSERT(ctx->instructions[1].type == BF_LBL && ctx->instructions[4].type == BF_LBL);
+	ASSERT(profile->loops[1].entries == 1 && profile->loops[1].iterations == 2);
+	ASSERT(profile->loops[4].entries == 2 && profile->loops[4].iterations == 6);
+	ASSERT(profile->hits[6] == 6);
+
+	// The loops map back to their brackets
+	ASSERT(ctx->instructions[1].position == 2 && ctx->instructions[ctx->instructions[1].operand1].position == 15);
+	ASSERT(ctx->instructions[4].position == 7 && ctx->instructions[ctx->instructions[4].operand1].position == 12);
+cleanup:
+	BF_FreeProfile(profile);
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestProfile_OnWhileLoop_ThenCountEntriesAndIterations(void) {
+	int result = 0;
+
+	// The inner loop becomes a WHILE, which is jumped back to instead of its body
+	BF_Context *ctx = LoadProgram("++[>+++[->[-]+<]<-]", BF_OPT_MIN);
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	BF_Profile *profile = BF_CreateProfile(ctx);
+	BF_RunProfiled(sim, profile);
+
+	size_t loop = 0;
+	for(; loop < ctx->length && ctx->instructions[loop].type != BF_WHILE; ++loop);
+	ASSERT(loop < ctx->length);
+	ASSERT(profile->loops[loop].entries == 2 && profile->loops[loop].iterations == 6);
+cleanup:
+	BF_FreeProfile(profile);
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Scan
+
+static size_t NaiveScan(const char *memory, size_t length, size_t dp, int32_t stride) {
+	for(; dp < length && memory[dp]; dp += stride);
+	return dp;
+}
+
+int TestScan_OnStrides_ThenMatchNaiveScan(void) {
+	int result = 0;
+	static char memory[1000];
+
+	memset(memory, 1, sizeof memory);
+	memory[3] = memory[500] = memory[531] = memory[997] = 0;
+
+	for(uint32_t stride = 1; stride <= 12; ++stride) {
+		for(size_t dp = 0; dp < sizeof memory; ++dp) {
+			ASSERT(BF_ScanRight(memory, sizeof memory, dp, stride) == NaiveScan(memory, sizeof memory, dp, stride));
+			ASSERT(BF_ScanLeft(memory, sizeof memory, dp, stride) == NaiveScan(memory, sizeof memory, dp, -stride));
+		}
+	}
+cleanup:
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Memory
+
+int TestGuardSize_OnMovesAndOffsets_ThenCoverFurthestAccess(void) {
+	int result = 0;
+
+	BF_Instruction instructions[] = {
+		{ .type = BF_MVR, .operand1 = 3 },
+		{ .type = BF_ICR, .operand1 = 1, .operand2 = 10 },
+		{ .type = BF_MVL, .operand1 = 7 },
+		{ .type = BF_NOP },
+		{ .type = BF_MVL, .operand1 = 5 },
+		{ .type = BF_PRT },
+	};
+	BF_Context ctx = { .instructions = instructions, .length = sizeof instructions / sizeof instructions[0] };
+
+	ASSERT(BF_GuardSize(&ctx) == 2 * 10 + 12 + 1);
+cleanup:
+	return result;
+}
+
+int TestGuardedMemory_OnOutOfRange_ThenReportError(void) {
+	int result = 0;
+
+	BF_Context *ctx = LoadProgram("+[<+]", BF_OPT_NONE);
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+
+	uint64_t steps = BF_RunThreaded(sim);
+	ASSERT(sim->memory.flags & CTX_MEMORY_GUARDED);
+	ASSERT(sim->error);
+	ASSERT(steps == 4);
+	ASSERT(sim->ip == 4);	// One past the faulting instruction, like BF_Run
+	ASSERT(sim->dp == (size_t)-1);
+cleanup:
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+// Cell of the tape, wherever the buffer of the memory is
+static uint8_t TapeCell(BF_SimulationContext *sim, int64_t cell) {
+	return *BF_ReadMemory(sim, cell - (sim->memory.origin + (int64_t)sim->dp));
+}
+
+static const char *gTapePrograms[] = {
+	"<+<++>>>+",						// Left of cell 0
+	">>>>[-]<<<<<<<[-]+",
+	"+++[<+>-]<",						// Multiplication into cell -1
+	"+>+>+>+[<]+",						// Scan to cell -1
+	"+<<<<<<<<<<+[>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<-]",	// Multiplication from the left of cell 0 to its right
+	NULL
+};
+
+int TestTape_OnGrowableAndSparse_ThenMatchInterpreter(void) {
+	int result = 0;
+	BF_Context *ctx = NULL;
+	BF_SimulationContext *expected = NULL, *actual = NULL;
+
+	for(BF_Tape tape = BF_TAPE_GROWABLE; tape <= BF_TAPE_SPARSE; ++tape) {
+		for(int i = 0; gTapePrograms[i]; ++i) {
+			for(uint8_t level = BF_OPT_NONE; level <= BF_OPT_MAX; ++level) {
+				for(BF_Engine engine = BF_ENGINE_THREADED; engine <= BF_ENGINE_HOT; ++engine) {
+					ctx = LoadProgram(gTapePrograms[i], level);
+					expected = BF_CreateSimulation(ctx);
+					actual = BF_CreateSimulation(ctx);
+					ASSERT(BF_UseTape(expected, tape) && BF_UseTape(actual, tape));
+
+					ASSERT(BF_Run(expected) == BF_RunEngine(actual, engine));
+					ASSERT(!expected->error && !actual->error);
+					ASSERT(expected->memory.origin + (int64_t)expected->dp == actual->memory.origin + (int64_t)actual->dp);
+					for(int64_t cell = -80; cell < 80; ++cell) ASSERT(TapeCell(expected, cell) == TapeCell(actual, cell));
+
+					BF_FreeSimulation(expected);
+					BF_FreeSimulation(actual);
+					BF_FreeContext(ctx);
+					expected = actual = NULL;
+					ctx = NULL;
+				}
+			}
+		}
+	}
+
+cleanup:
+	if (expected) BF_FreeSimulation(expected);
+	if (actual) BF_FreeSimulation(actual);
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+int TestTape_OnFarCells_ThenReachThem(void) {
+	int result = 0;
+	static char source[3 * 70000 + 16];
+	char *far = NULL;
+	BF_Context *ctx = NULL;
+	BF_SimulationContext *sim = NULL;
+
+	// Ones in cells [0, 70000), and a scan from the last one back to cell -1 over a page boundary
+	char *cursor = source;
+	for(int i = 0; i < 70000; ++i) cursor += sprintf(cursor, "+>");
+	cursor += sprintf(cursor, "<[<]");
+
+	for(BF_Tape tape = BF_TAPE_GROWABLE; tape <= BF_TAPE_SPARSE; ++tape) {
+		for(BF_Engine engine = BF_ENGINE_INTERPRETER; engine <= BF_ENGINE_THREADED; ++engine) {
+			ctx = LoadProgram(source, BF_OPT_MAX);
+			sim = BF_CreateSimulation(ctx);
+			ASSERT(BF_UseTape(sim, tape));
+
+			BF_RunEngine(sim, engine);
+			ASSERT(!sim->error);
+			ASSERT(sim->memory.origin + (int64_t)sim->dp == -1);
+			ASSERT(TapeCell(sim, 0) == 1 && TapeCell(sim, 69999) == 1 && TapeCell(sim, 70000) == 0);
+
+			BF_FreeSimulation(sim);
+			BF_FreeContext(ctx);
+			sim = NULL;
+			ctx = NULL;
+		}
+	}
+
+	// A million cells away in both directions
+	far = malloc(3 * 1000000 + 16);
+	cursor = far;
+	cursor += sprintf(cursor, "+");
+	for(int i = 0; i < 1000000; ++i) *cursor++ = '>';
+	cursor += sprintf(cursor, "++");
+	for(int i = 0; i < 2000000; ++i) *cursor++ = '<';
+	cursor += sprintf(cursor, "+++");
+
+	for(BF_Tape tape = BF_TAPE_GROWABLE; tape <= BF_TAPE_SPARSE; ++tape) {
+		ctx = LoadProgram(far, BF_OPT_MIN);
+		sim = BF_CreateSimulation(ctx);
+		ASSERT(BF_UseTape(sim, tape));
+
+		BF_RunThreaded(sim);
+		ASSERT(!sim->error);
+		ASSERT(TapeCell(sim, 0) == 1 && TapeCell(sim, 1000000) == 2 && TapeCell(sim, -1000000) == 3);
+
+		BF_FreeSimulation(sim);
+		BF_FreeContext(ctx);
+		sim = NULL;
+		ctx = NULL;
+	}
+
+cleanup:
+	free(far);
+	if (sim) BF_FreeSimulation(sim);
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region IO
+
+typedef struct {
+	char data[4096];
+	size_t length;
+	int writes;
+} CapturedOutput;
+
+static int64_t CaptureOutput(void *handle, char *data, size_t length) {
+	CapturedOutput *captured = handle;
+	memcpy(captured->data + captured->length, data, length);
+	captured->length += length;
+	captured->writes++;
+
+	return length;
+}
+
+static int64_t NoInput(void *handle, char *data, size_t length) {
+	return 0;
+}
+
+int CaptureRun(const char *source, uint8_t optimizationLevel, uint8_t flags, CapturedOutput *captured) {
+	BF_Context *ctx = LoadProgram(source, optimizationLevel);
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	memset(captured, 0, sizeof *captured);
+
+	BF_SetIO(sim, &NoInput, NULL, &CaptureOutput, captured, flags);
+	BF_Run(sim);
+
+	int error = sim->error;
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return error;
+}
+
+int TestIO_OnHeavyOutput_ThenWriteOnce(void) {
+	int result = 0;
+	CapturedOutput captured;
+
+	// 2000 bytes of 'A' (65)
+	ASSERT(!CaptureRun("++++++++[>++++++++<-]>+>++++++++++++++++++++[>++++++++++[>++++++++++<-]>[<<<.>>>-]<<-]", BF_OPT_MIN, 0, &captured));
+	ASSERT(captured.length == 2000);
+	ASSERT(captured.data[0] == 'A' && captured.data[1999] == 'A');
+	ASSERT(captured.writes == 1);
+cleanup:
+	return result;
+}
+
+int TestIO_OnPrintOutOfMemory_ThenWriteNothing(void) {
+	int result = 0;
+	CapturedOutput captured;
+
+	ASSERT(CaptureRun("+.<.", BF_OPT_NONE, 0, &captured));
+	ASSERT(captured.length == 1 && captured.data[0] == 1);
+cleanup:
+	return result;
+}
+
+int TestIO_OnLineBuffered_ThenWriteEveryLine(void) {
+	int result = 0;
+	CapturedOutput captured;
+
+	// "\n\n\n"
+	ASSERT(!CaptureRun("++++++++++...", BF_OPT_MIN, BF_IO_LINE_BUFFERED, &captured));
+	ASSERT(captured.length == 3);
+	ASSERT(captured.writes == 3);
+cleanup:
+	return result;
+}
+
+int TestIO_OnEvaluatedOutput_ThenWriteOnce(void) {
+	int result = 0;
+	CapturedOutput captured;
+
+	// The same 2000 bytes, computed while optimizing
+	ASSERT(!CaptureRun("++++++++[>++++++++<-]>+>++++++++++++++++++++[>++++++++++[>++++++++++<-]>[<<<.>>>-]<<-]", BF_OPT_MAX, 0, &captured));
+	ASSERT(captured.length == 2000);
+	ASSERT(captured.data[0] == 'A' && captured.data[1999] == 'A');
+	ASSERT(captured.writes == 1);
+cleanup:
+	return result;
+}
+
+int TestIO_OnSpans_ThenReadAndWriteInPlace(void) {
+	int result = 0;
+	BF_Context *echo = LoadProgram(",[.[-],]", BF_OPT_MAX);
+	BF_Context *heavy = LoadProgram("++++++++[>++++++++<-]>+>++++++++++++++++++++[>++++++++++[>++++++++++<-]>[<<<.>>>-]<<-]", BF_OPT_MAX);
+	BF_SimulationContext *sim = NULL;
+	char output[8];
+
+	for(BF_Engine engine = BF_ENGINE_INTERPRETER; engine <= BF_ENGINE_HOT; ++engine) {
+		sim = BF_CreateSimulation(echo);
+		memset(output, '*', sizeof output);
+
+		BF_SetInputSpan(sim, "hello", 5);
+		BF_SetOutputSpan(sim, output, sizeof output);
+		BF_RunEngine(sim, engine);
+		ASSERT(!sim->error);
+		ASSERT(sim->io.output.length == 5);
+		ASSERT(memcmp(output, "hello***", sizeof output) == 0);
+
+		// Past the end of the span, the output is dropped
+		BF_FreeSimulation(sim);
+		sim = BF_CreateSimulation(heavy);
+		BF_SetOutputSpan(sim, output, 4);
+		BF_RunEngine(sim, engine);
+		ASSERT(!sim->error);
+		ASSERT(sim->io.output.length == 4);
+		ASSERT(memcmp(output, "AAAAo***", sizeof output) == 0);
+
+		BF_FreeSimulation(sim);
+		sim = NULL;
+	}
+
+cleanup:
+	if (sim) BF_FreeSimulation(sim);
+	BF_FreeContext(echo);
+	BF_FreeContext(heavy);
+	return result;
+}
+
+int TestIO_OnInput_ThenFlushBeforeReading(void) {
+	int result = 0;
+	CapturedOutput captured;
+
+	ASSERT(!CaptureRun("+.,.,.", BF_OPT_MIN, 0, &captured));
+	ASSERT(captured.length == 3);
+	ASSERT(captured.writes == 3);
+cleanup:
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Jit
+
+int TestJit_OnPrograms_ThenMatchInterpreter(void) {
+	int result = 0;
+
+	for(int i = 0; gPrograms[i]; ++i) {
+		result |= CompareEngines(gPrograms[i], BF_OPT_NONE, BF_ENGINE_JIT);
+		result |= CompareEngines(gPrograms[i], BF_OPT_MIN, BF_ENGINE_JIT);
+		result |= CompareEngines(gPrograms[i], BF_OPT_MAX, BF_ENGINE_JIT);
+	}
+
+	return result;
+}
+
+static const char *gHotPrograms[] = {
+	"++++++++[>++++++++<-]>[>++++++++++++++++[>+>+<<-]<-]",	// The inner loop gets hot, then is entered compiled
+	"+[>++++[>++++<-]>[-<+>]<]",							// Out of memory in a compiled loop
+	NULL
+};
+
+int TestHot_OnPrograms_ThenMatchInterpreter(void) {
+	int result = 0;
+
+	for(int i = 0; gPrograms[i]; ++i) {
+		result |= CompareEngines(gPrograms[i], BF_OPT_NONE, BF_ENGINE_HOT);
+		result |= CompareEngines(gPrograms[i], BF_OPT_MAX, BF_ENGINE_HOT);
+	}
+	for(int i = 0; gHotPrograms[i]; ++i) {
+		result |= CompareEngines(gHotPrograms[i], BF_OPT_NONE, BF_ENGINE_HOT);
+		result |= CompareEngines(gHotPrograms[i], BF_OPT_MIN, BF_ENGINE_HOT);
+		result |= CompareEngines(gHotPrograms[i], BF_OPT_MAX, BF_ENGINE_HOT);
+	}
+
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Cells
+
+int TestCells_OnPrograms_ThenMatchInterpreter(void) {
+	int result = 0;
+
+	for(uint8_t cellSize = 2; cellSize <= 4; cellSize *= 2) {
+		for(int i = 0; gPrograms[i]; ++i) {
+			// Unless they are optimized away, loops that count a 32 bit cell up to 0 take billions of steps
+			for(uint8_t level = cellSize == 4 ? BF_OPT_MIN : BF_OPT_NONE; level <= BF_OPT_MAX; ++level) {
+				result |= CompareEnginesOn(gPrograms[i], level, BF_ENGINE_THREADED, false, cellSize);
+				result |= CompareEnginesOn(gPrograms[i], level, BF_ENGINE_THREADED, true, cellSize);
+				result |= CompareEnginesOn(gPrograms[i], level, BF_ENGINE_JIT, false, cellSize);
+			}
+		}
+	}
+
+	return result;
+}
+
+int TestCells_OnOverflow_ThenWrapAtCellWidth(void) {
+	int result = 0;
+	const char *square = "++++++++++++++++[>++++++++++++++++<-]>";		// 16 * 16 in cell 1
+	const char *product = "++++++++++++++++[>++++++++++++++++[>++++++++++++++++<-]<-]>>";	// 16 * 16 * 16 in cell 2
+
+	ASSERT(RunToCell("-", 1, 0) == 0xFF);
+	ASSERT(RunToCell("-", 2, 0) == 0xFFFF);
+	ASSERT(RunToCell("-", 4, 0) == 0xFFFFFFFF);
+
+	ASSERT(RunToCell(square, 1, 1) == 0);
+	ASSERT(RunToCell(square, 2, 1) == 256);
+	ASSERT(RunToCell(product, 2, 2) == 4096);
+	ASSERT(RunToCell(product, 4, 2) == 4096);
+
+	// A loop that only ends once the cell wraps back to 0
+	ASSERT(RunToCell("+[>+<+]", 1, 1) == 0xFF);
+	ASSERT(RunToCell("+[>+<+]", 2, 1) == 0xFFFF);
+
+cleanup:
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Batch
+
+#define BATCH_JOBS		64
+
+int TestBatch_OnManyInputs_ThenMatchEveryInput(void) {
+	int result = 0;
+
+	char inputs[BATCH_JOBS][BATCH_JOBS];
+	BF_BatchJob jobs[BATCH_JOBS] = { 0 };
+	BF_Context *ctx = LoadProgram(",[.[-],]", BF_OPT_MAX);		// Echoes the input
+
+	for(size_t i = 0; i < BATCH_JOBS; ++i) {
+		for(size_t j = 0; j < i; ++j) inputs[i][j] = 'a' + (i + j) % 26;
+		jobs[i] = (BF_BatchJob){ .input = inputs[i], .inputLength = i };
+	}
+
+	for(BF_Engine engine = BF_ENGINE_INTERPRETER; engine <= BF_ENGINE_HOT; ++engine) {
+		BF_RunBatch(ctx, jobs, BATCH_JOBS, engine, BF_TAPE_FIXED, 4);
+
+		for(size_t i = 0; i < BATCH_JOBS; ++i) {
+			ASSERT(!jobs[i].error);
+			ASSERT(jobs[i].steps > 0);
+			ASSERT(jobs[i].outputLength == i);
+			ASSERT(!i || memcmp(jobs[i].output, inputs[i], i) == 0);
+
+			free(jobs[i].output);
+			jobs[i].output = NULL;
+		}
+	}
+
+cleanup:
+	for(size_t i = 0; i < BATCH_JOBS; ++i) free(jobs[i].output);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestBatch_OnFailingInputs_ThenReportOnlyThem(void) {
+	int result = 0;
+
+	BF_BatchJob jobs[BATCH_JOBS] = { 0 };
+	BF_Context *ctx = LoadProgram(",[<+]", BF_OPT_NONE);		// Leaves the memory unless the input is 0
+
+	for(size_t i = 0; i < BATCH_JOBS; ++i) jobs[i] = (BF_BatchJob){ .input = i % 3 ? "\0" : "a", .inputLength = 1 };
+	BF_RunBatch(ctx, jobs, BATCH_JOBS, BF_ENGINE_INTERPRETER, BF_TAPE_FIXED, 4);
+
+	for(size_t i = 0; i < BATCH_JOBS; ++i) {
+		ASSERT(jobs[i].error == !(i % 3));
+		ASSERT(!jobs[i].message[0] == !jobs[i].error);
+	}
+
+cleanup:
+	for(size_t i = 0; i < BATCH_JOBS; ++i) free(jobs[i].output);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Compiled
+
+#define COMPILED_PATH		"test_runner.bfc"
+#define CACHE_DIRECTORY		"test_runner_cache"
+#define CACHED_SOURCE		"test_runner_cached.bf"
+
+bool SameContext(const BF_Context *a, const BF_Context *b) {
+	if (a->length != b->length || a->dataLength != b->dataLength) return false;
+	if (memcmp(a->instructions, b->instructions, a->length * sizeof(BF_Instruction))) return false;
+
+	for(size_t i = 0; i < a->dataLength; ++i) {
+		if (a->data[i].length != b->data[i].length || memcmp(a->data[i].bytes, b->data[i].bytes, a->data[i].length))
+			return false;
+	}
+
+	return true;
+}
+
+int TestCompiled_OnSavedPrograms_ThenLoadSameContext(void) {
+	int result = 0;
+	BF_Context *ctx = NULL, *loaded = NULL;
+	int i = 0;
+
+	for(; gPrograms[i]; ++i) {
+		ctx = LoadProgram(gPrograms[i], BF_OPT_MAX);
+		ASSERT(BF_SaveCompiled(ctx, 42, COMPILED_PATH));
+
+		ASSERT(!BF_LoadCompiled(COMPILED_PATH, 43));		// Compiled from another source
+		ASSERT(loaded = BF_LoadCompiled(COMPILED_PATH, 42));
+		ASSERT(loaded->image);
+		ASSERT(SameContext(ctx, loaded));
+
+		// Changing it copies it out of the file first
+		BF_DetachCompiled(loaded);
+		ASSERT(!loaded->image);
+		ASSERT(SameContext(ctx, loaded));
+		BF_EvaluatePrefix(loaded, 1000);
+
+		BF_FreeContext(loaded);
+		BF_FreeContext(ctx);
+		loaded = ctx = NULL;
+	}
+
+cleanup:
+	if (result) printf("\tProgram %s\n", gPrograms[i]);
+	if (loaded) BF_FreeContext(loaded);
+	if (ctx) BF_FreeContext(ctx);
+	remove(COMPILED_PATH);
+	return result;
+}
+
+int TestCompiled_OnDamagedFile_ThenReject(void) {
+	int result = 0;
+	BF_Context *ctx = LoadProgram("+[>++[-]<-].", BF_OPT_NONE);
+	FILE *file = NULL;
+	char image[1024];
+
+	// Cut short
+	ASSERT(BF_SaveCompiled(ctx, BF_COMPILED_ANY_KEY, COMPILED_PATH));
+	ASSERT(file = fopen(COMPILED_PATH, "rb"));
+	size_t length = fread(image, 1, sizeof(image), file);
+	fclose(file);
+
+	ASSERT(file = fopen(COMPILED_PATH, "wb"));
+	fwrite(image, 1, length - 1, file);
+	fclose(file);
+	file = NULL;
+	ASSERT(!BF_LoadCompiled(COMPILED_PATH, BF_COMPILED_ANY_KEY));
+
+	// A jump out of the program
+	ctx->instructions[1].operand1 = ctx->length;
+	ASSERT(BF_SaveCompiled(ctx, BF_COMPILED_ANY_KEY, COMPILED_PATH));
+	ASSERT(!BF_LoadCompiled(COMPILED_PATH, BF_COMPILED_ANY_KEY));
+
+cleanup:
+	if (file) fclose(file);
+	BF_FreeContext(ctx);
+	remove(COMPILED_PATH);
+	return result;
+}
+
+int TestOpenCached_OnSecondOpen_ThenSkipOptimizer(void) {
+	int result = 0;
+	BF_Context *first = NULL, *second = NULL;
+
+	FILE *file = fopen(CACHED_SOURCE, "w");
+	fputs("++++++++[>++++++++<-]>+.,[>+<-]>.", file);
+	fclose(file);
+
+	ASSERT(first = BF_OpenCached(CACHED_SOURCE, BF_OPT_MAX, 1, CACHE_DIRECTORY, NULL));
+	ASSERT(!first->image);
+	ASSERT(second = BF_OpenCached(CACHED_SOURCE, BF_OPT_MAX, 1, CACHE_DIRECTORY, NULL));
+	ASSERT(second->image);
+	ASSERT(SameContext(first, second));
+
+	// Another level is another entry
+	BF_FreeContext(second);
+	ASSERT(second = BF_OpenCached(CACHED_SOURCE, BF_OPT_MIN, 1, CACHE_DIRECTORY, NULL));
+	ASSERT(!second->image);
+
+	// And so is another cell size
+	BF_FreeContext(second);
+	ASSERT(second = BF_OpenCached(CACHED_SOURCE, BF_OPT_MAX, 2, CACHE_DIRECTORY, NULL));
+	ASSERT(!second->image && second->cellSize == 2);
+
+cleanup:
+	if (first) BF_FreeContext(first);
+	if (second) BF_FreeContext(second);
+
+	char path[64];
+	for(uint8_t level = BF_OPT_MIN; level <= BF_OPT_MAX; ++level) {
+		for(uint8_t cellSize = 1; cellSize <= 2; ++cellSize) {
+			sprintf(path, CACHE_DIRECTORY "/%016llx.bfc", (unsigned long long)BF_SourceKey(
+				"++++++++[>++++++++<-]>+.,[>+<-]>.", 33, level, cellSize));
+			remove(path);
+		}
+	}
+	remove(CACHE_DIRECTORY);
+	remove(CACHED_SOURCE);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Resume
+
+#define RESUME_SLICE		7
+#define SCHEDULED_SIMS		200
+#define HOT_INPUT_LENGTH	3000	// Enough for the loop that reads it to get hot
+
+int TestRunFor_OnSmallSlices_ThenMatchRun(void) {
+	int result = 0;
+	int i = 0;
+	BF_Context *ctx = NULL;
+	BF_SimulationContext *expected = NULL, *actual = NULL;
+
+	for(; gPrograms[i]; ++i) {
+		for(uint8_t level = BF_OPT_NONE; level <= BF_OPT_MAX; ++level) {
+			ctx = LoadProgram(gPrograms[i], level);
+			expected = BF_CreateSimulation(ctx);
+			actual = BF_CreateSimulation(ctx);
+
+			uint64_t expectedSteps = BF_Run(expected), actualSteps = 0, slices = 0;
+			for(; actual->state == BF_RUN_READY; ++slices) actualSteps += BF_RunFor(actual, RESUME_SLICE);
+
+			ASSERT(actual->state == BF_RUN_ENDED);
+			ASSERT(expectedSteps == actualSteps);
+			ASSERT(slices >= expectedSteps / RESUME_SLICE);
+			ASSERT(expected->error == actual->error);
+			ASSERT(expected->dp == actual->dp);
+			ASSERT(memcmp(expected->memory.buffer, actual->memory.buffer, expected->memory.length) == 0);
+			ASSERT(!BF_RunFor(actual, RESUME_SLICE));		// Nothing is left to run
+
+			BF_FreeSimulation(expected);
+			BF_FreeSimulation(actual);
+			BF_FreeContext(ctx);
+			expected = actual = NULL;
+			ctx = NULL;
+		}
+	}
+
+cleanup:
+	if (result) printf("\tProgram %s\n", gPrograms[i]);
+	if (expected) BF_FreeSimulation(expected);
+	if (actual) BF_FreeSimulation(actual);
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+typedef struct {
+	const char *data;
+	size_t length, available, used;		// Past available, the input is pending
+} PendingInput;
+
+static int64_t ReadPendingInput(void *handle, char *data, size_t length) {
+	PendingInput *input = handle;
+	if (input->used >= input->available) return input->used < input->length ? BF_IO_PENDING : 0;
+
+	if (length > input->available - input->used) length = input->available - input->used;
+	memcpy(data, input->data + input->used, length);
+	input->used += length;
+	return length;
+}
+
+int TestRunEngine_OnPendingInput_ThenResumeWhenReady(void) {
+	int result = 0;
+	BF_Context *ctx = LoadProgram(",[.,]", BF_OPT_MAX);		// Echoes up to a 0
+	BF_SimulationContext *sim = NULL;
+	CapturedOutput captured;
+
+	// The steps of a run that never waits
+	PendingInput ready = { .data = "abc", .length = 4, .available = 4 };
+	memset(&captured, 0, sizeof captured);
+	sim = BF_CreateSimulation(ctx);
+	BF_SetIO(sim, &ReadPendingInput, &ready, &CaptureOutput, &captured, 0);
+	uint64_t expectedSteps = BF_Run(sim);
+	BF_FreeSimulation(sim);
+
+	for(BF_Engine engine = BF_ENGINE_INTERPRETER; engine <= BF_ENGINE_HOT; ++engine) {
+		PendingInput input = { .data = "abc", .length = 4 };
+		memset(&captured, 0, sizeof captured);
+
+		sim = BF_CreateSimulation(ctx);
+		BF_SetIO(sim, &ReadPendingInput, &input, &CaptureOutput, &captured, 0);
+
+		uint64_t steps = BF_RunEngine(sim, engine);
+		ASSERT(sim->state == BF_RUN_WAITING);
+		ASSERT(!sim->error);
+		ASSERT(captured.length == 0);
+
+		input.available = 2;
+		steps += BF_RunEngine(sim, engine);
+		ASSERT(sim->state == BF_RUN_WAITING);
+		ASSERT(captured.length == 2 && memcmp(captured.data, "ab", 2) == 0);
+
+		input.available = 4;
+		steps += BF_RunEngine(sim, engine);
+		ASSERT(sim->state == BF_RUN_ENDED);
+		ASSERT(captured.length == 3 && memcmp(captured.data, "abc", 3) == 0);
+		ASSERT(steps == expectedSteps);
+
+		BF_FreeSimulation(sim);
+		sim = NULL;
+	}
+
+cleanup:
+	if (sim) BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+// Runs out of input in the middle of an echo loop that got hot
+int TestRunHot_OnPendingInput_ThenResumeWhenReady(void) {
+	int result = 0;
+	BF_Context *ctx = LoadProgram(",[.,]", BF_OPT_MAX);
+	BF_SimulationContext *sim = NULL;
+	CapturedOutput captured;
+	char data[HOT_INPUT_LENGTH + 1];
+
+	memset(data, 'x', HOT_INPUT_LENGTH);
+	data[HOT_INPUT_LENGTH] = 0;
+
+	PendingInput ready = { .data = data, .length = sizeof data, .available = sizeof data };
+	memset(&captured, 0, sizeof captured);
+	sim = BF_CreateSimulation(ctx);
+	BF_SetIO(sim, &ReadPendingInput, &ready, &CaptureOutput, &captured, 0);
+	uint64_t expectedSteps = BF_Run(sim);
+	BF_FreeSimulation(sim);
+
+	PendingInput input = { .data = data, .length = sizeof data, .available = HOT_INPUT_LENGTH / 2 };
+	memset(&captured, 0, sizeof captured);
+	sim = BF_CreateSimulation(ctx);
+	BF_SetIO(sim, &ReadPendingInput, &input, &CaptureOutput, &captured, 0);
+
+	uint64_t steps = BF_RunHot(sim);
+	ASSERT(sim->state == BF_RUN_WAITING);
+	ASSERT(captured.length == HOT_INPUT_LENGTH / 2);
+
+	input.available = input.length;
+	steps += BF_RunHot(sim);
+	ASSERT(sim->state == BF_RUN_ENDED);
+	ASSERT(!sim->error);
+	ASSERT(captured.length == HOT_INPUT_LENGTH);
+	ASSERT(steps == expectedSteps);
+
+cleanup:
+	if (sim) BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestScheduler_OnManySimulations_ThenRunEveryOne(void) {
+	int result = 0;
+	BF_Context *ctx = LoadProgram("++++++++[>++++++++[>+>++<<-]<-]>>+", BF_OPT_MIN);
+	BF_Context *echo = LoadProgram(",[.,]", BF_OPT_MIN);
+	BF_SimulationContext *sims[SCHEDULED_SIMS] = { 0 }, *waiting = BF_CreateSimulation(echo);
+	BF_Scheduler *scheduler = BF_CreateScheduler(4, 16);
+
+	PendingInput input = { .data = "hi", .length = 3 };
+	CapturedOutput captured = { 0 };
+	BF_SetIO(waiting, &ReadPendingInput, &input, &CaptureOutput, &captured, 0);
+
+	ASSERT(scheduler);
+	BF_Schedule(scheduler, waiting);
+	for(size_t i = 0; i < SCHEDULED_SIMS; ++i) {
+		sims[i] = BF_CreateSimulation(ctx);
+		BF_Schedule(scheduler, sims[i]);
+	}
+	BF_WaitScheduler(scheduler);
+
+	for(size_t i = 0; i < SCHEDULED_SIMS; ++i) {
+		ASSERT(sims[i]->state == BF_RUN_ENDED);
+		ASSERT(!sims[i]->error);
+		ASSERT((uint8_t)sims[i]->memory.buffer[2] == 65 && (uint8_t)sims[i]->memory.buffer[3] == 128);
+	}
+	ASSERT(waiting->state == BF_RUN_WAITING);
+
+	// Parked until the input arrives
+	input.available = input.length;
+	BF_WakeScheduler(scheduler);
+	BF_WaitScheduler(scheduler);
+	ASSERT(waiting->state == BF_RUN_ENDED);
+	ASSERT(captured.length == 2 && memcmp(captured.data, "hi", 2) == 0);
+
+cleanup:
+	if (scheduler) BF_FreeScheduler(scheduler);
+	for(size_t i = 0; i < SCHEDULED_SIMS; ++i) if (sims[i]) BF_FreeSimulation(sims[i]);
+	BF_FreeSimulation(waiting);
+	BF_FreeContext(echo);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Tiered
+
+static const char *gTieredPrograms[] = {
+	"++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.>---.+++++++..+++.>>.<-.<.+++.------.--------.>>+.>++.",
+	",[>,[>+>+<<-]>[.-]<<-]",			// Loops that stay loops, they depend on the input
+	",>,<[>[>+>+<<-]>>[<<+>>-]<<<-]>>.",	// Multiplies the inputs
+	"-[>-[>-[-]<-]<-]+++.",				// Long enough for the optimizer to finish in the middle of it
+	NULL
+};
+
+int TestTiered_OnPrograms_ThenMatchRun(void) {
+	int result = 0;
+	int i = 0;
+	BF_Context *ctx = NULL;
+	BF_SimulationContext *expected = NULL, *actual = NULL;
+	CapturedOutput expectedOutput, actualOutput;
+
+	for(; gTieredPrograms[i]; ++i) {
+		ctx = LoadProgram(gTieredPrograms[i], BF_OPT_NONE);
+		expected = BF_CreateSimulation(ctx);
+		actual = BF_CreateSimulation(ctx);
+		memset(&expectedOutput, 0, sizeof expectedOutput);
+		memset(&actualOutput, 0, sizeof actualOutput);
+
+		BF_SetIO(expected, NULL, NULL, &CaptureOutput, &expectedOutput, 0);
+		BF_SetInputSpan(expected, "\x05\x07xyzabc", 8);
+		BF_SetIO(actual, NULL, NULL, &CaptureOutput, &actualOutput, 0);
+		BF_SetInputSpan(actual, "\x05\x07xyzabc", 8);
+
+		BF_Run(expected);
+		BF_RunTiered(actual, BF_OPT_MAX);
+
+		ASSERT(actual->state == BF_RUN_ENDED);
+		ASSERT(!expected->error && !actual->error);
+		ASSERT(expected->dp == actual->dp);
+		ASSERT(memcmp(expected->memory.buffer, actual->memory.buffer, expected->memory.length) == 0);
+		ASSERT(expectedOutput.length == actualOutput.length);
+		ASSERT(memcmp(expectedOutput.data, actualOutput.data, expectedOutput.length) == 0);
+
+		BF_FreeSimulation(expected);
+		BF_FreeSimulation(actual);
+		BF_FreeContext(ctx);
+		expected = actual = NULL;
+		ctx = NULL;
+	}
+
+cleanup:
+	if (result) printf("\tProgram %s\n", gTieredPrograms[i]);
+	if (expected) BF_FreeSimulation(expected);
+	if (actual) BF_FreeSimulation(actual);
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+
+#pragma region Snapshot
+
+#define SNAPSHOT_PATH		"test_runner.bfs"
+#define SNAPSHOT_STEPS		300		// Into the run, where the snapshot is taken
+#define SNAPSHOT_FORKS		3
+
+// Builds a table, then moves it and works to the right of it
+static const char *gSnapshotProgram = "++++++++[>++++++++[>+>++<<-]<-]>>[>>>+<<<-]>[>>+<<-]>>>>>++++[>++++<-]";
+
+static int CompareSimulations(const BF_SimulationContext *expected, const BF_SimulationContext *actual) {
+	int result = 0;
+	ASSERT(actual->state == expected->state);
+	ASSERT(actual->error == expected->error);
+	ASSERT(actual->ip == expected->ip);
+	ASSERT(actual->memory.origin + (int64_t)actual->dp == expected->memory.origin + (int64_t)expected->dp);
+	ASSERT(actual->memory.origin == expected->memory.origin && actual->memory.length == expected->memory.length);
+	ASSERT(memcmp(actual->memory.buffer, expected->memory.buffer, expected->memory.length * expected->memory.cellSize) == 0);
+cleanup:
+	return result;
+}
+
+// Every fork of a snapshot taken in the middle of a run ends like the run did, whatever the forks before it wrote
+int TestSnapshot_OnForks_ThenEndLikeTheRun(void) {
+	int result = 0;
+	BF_Context *ctx = NULL, *other = LoadProgram("+[>+<-]", BF_OPT_NONE);
+	BF_SimulationContext *expected = NULL, *sim = NULL, *fork = NULL;
+	BF_Snapshot *snapshot = NULL;
+
+	for(BF_Tape tape = BF_TAPE_FIXED; tape <= BF_TAPE_SPARSE; ++tape) {
+		for(uint8_t cellSize = 1; cellSize <= 2; ++cellSize) {
+			ctx = LoadProgramOf(gSnapshotProgram, BF_OPT_NONE, cellSize);
+			expected = BF_CreateSimulation(ctx);
+			sim = BF_CreateSimulation(ctx);
+			ASSERT(BF_UseTape(expected, tape) && BF_UseTape(sim, tape));
+
+			uint64_t expectedSteps = BF_Run(expected);
+			uint64_t steps = BF_RunFor(sim, SNAPSHOT_STEPS);
+			ASSERT(sim->state == BF_RUN_READY);
+			ASSERT(snapshot = BF_TakeSnapshot(sim));
+			ASSERT(!BF_ForkSnapshot(snapshot, other));
+
+			for(int i = 0; i < SNAPSHOT_FORKS; ++i) {
+				ASSERT(fork = BF_ForkSnapshot(snapshot, ctx));
+				ASSERT(steps + BF_Run(fork) == expectedSteps);
+				ASSERT(!CompareSimulations(expected, fork));
+
+				BF_FreeSimulation(fork);
+				fork = NULL;
+			}
+
+			// The run the snapshot was taken of goes back to it
+			ASSERT(steps + BF_Run(sim) == expectedSteps);
+			ASSERT(BF_RestoreSnapshot(sim, snapshot));
+			ASSERT(steps + BF_Run(sim) == expectedSteps);
+			ASSERT(!CompareSimulations(expected, sim));
+
+			BF_FreeSnapshot(snapshot);
+			BF_FreeSimulation(expected);
+			BF_FreeSimulation(sim);
+			BF_FreeContext(ctx);
+			snapshot = NULL;
+			expected = sim = NULL;
+			ctx = NULL;
+		}
+	}
+
+cleanup:
+	if (snapshot) BF_FreeSnapshot(snapshot);
+	if (fork) BF_FreeSimulation(fork);
+	if (expected) BF_FreeSimulation(expected);
+	if (sim) BF_FreeSimulation(sim);
+	if (ctx) BF_FreeContext(ctx);
+	BF_FreeContext(other);
+	return result;
+}
+
+int TestSnapshot_OnSaveAndLoad_ThenForkSameState(void) {
+	int result = 0;
+	BF_Context *ctx = LoadProgram(gSnapshotProgram, BF_OPT_NONE);
+	BF_SimulationContext *expected = NULL, *sim = NULL, *fork = NULL;
+	BF_Snapshot *snapshot = NULL, *loaded = NULL;
+	FILE *file = NULL;
+	char *image = malloc(BF_TAPE_ALIGNMENT);
+
+	for(BF_Tape tape = BF_TAPE_FIXED; tape <= BF_TAPE_SPARSE; ++tape) {
+		expected = BF_CreateSimulation(ctx);
+		sim = BF_CreateSimulation(ctx);
+		ASSERT(BF_UseTape(expected, tape) && BF_UseTape(sim, tape));
+
+		uint64_t expectedSteps = BF_Run(expected);
+		uint64_t steps = BF_RunFor(sim, SNAPSHOT_STEPS);
+		ASSERT(snapshot = BF_TakeSnapshot(sim));
+		ASSERT(BF_SaveSnapshot(snapshot, SNAPSHOT_PATH));
+		ASSERT(loaded = BF_LoadSnapshot(SNAPSHOT_PATH));
+
+		for(int i = 0; i < SNAPSHOT_FORKS; ++i) {
+			ASSERT(fork = BF_ForkSnapshot(loaded, ctx));
+			ASSERT(steps + BF_Run(fork) == expectedSteps);
+			ASSERT(!CompareSimulations(expected, fork));
+
+			BF_FreeSimulation(fork);
+			fork = NULL;
+		}
+
+		BF_FreeSnapshot(snapshot);
+		BF_FreeSnapshot(loaded);
+		BF_FreeSimulation(expected);
+		BF_FreeSimulation(sim);
+		snapshot = loaded = NULL;
+		expected = sim = NULL;
+	}
+
+	// Cut short before its cells
+	ASSERT(file = fopen(SNAPSHOT_PATH, "rb"));
+	size_t length = fread(image, 1, BF_TAPE_ALIGNMENT, file);
+	fclose(file);
+
+	ASSERT(file = fopen(SNAPSHOT_PATH, "wb"));
+	fwrite(image, 1, length, file);
+	fclose(file);
+	file = NULL;
+	ASSERT(!BF_LoadSnapshot(SNAPSHOT_PATH));
+
+cleanup:
+	if (file) fclose(file);
+	free(image);
+	remove(SNAPSHOT_PATH);
+	if (snapshot) BF_FreeSnapshot(snapshot);
+	if (loaded) BF_FreeSnapshot(loaded);
+	if (fork) BF_FreeSimulation(fork);
+	if (expected) BF_FreeSimulation(expected);
+	if (sim) BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+int main(void) {
+	int result = 0;
+
+	result |= TestThreaded_OnPrograms_ThenMatchInterpreter();
+	result |= TestJit_OnPrograms_ThenMatchInterpreter();
+	result |= TestHot_OnPrograms_ThenMatchInterpreter();
+
+	result |= TestMultiplyLoop_OnCopyLoop_ThenMultiply();
+	result |= TestMultiplyLoop_OnNonUnitSteps_ThenCountIterations();
+	result |= TestMultiplyLoop_OnLoopNotEntered_ThenSkipTargets();
+	result |= TestDeferMotion_OnBasicBlock_ThenMoveOnce();
+	result |= TestPropagateConstants_OnKnownLoops_ThenUnroll();
+	result |= TestPropagateConstants_OnZeroCell_ThenRemoveLoop();
+	result |= TestEvaluatePrefix_OnInputInLoop_ThenStopBeforeLoop();
+
+	result |= TestPacked_OnWideOperands_ThenUnpackToSameProgram();
+	result |= TestPacked_OnWideCells_ThenKeepLongValues();
+	result |= TestScan_OnStrides_ThenMatchNaiveScan();
+
+	result |= TestProfile_OnNestedLoops_ThenCountEntriesAndIterations();
+	result |= TestProfile_OnWhileLoop_ThenCountEntriesAndIterations();
+
+	result |= TestGuardSize_OnMovesAndOffsets_ThenCoverFurthestAccess();
+	result |= TestGuardedMemory_OnOutOfRange_ThenReportError();
+	result |= TestTape_OnGrowableAndSparse_ThenMatchInterpreter();
+	result |= TestTape_OnFarCells_ThenReachThem();
+
+	result |= TestIO_OnHeavyOutput_ThenWriteOnce();
+	result |= TestIO_OnPrintOutOfMemory_ThenWriteNothing();
+	result |= TestIO_OnLineBuffered_ThenWriteEveryLine();
+	result |= TestIO_OnEvaluatedOutput_ThenWriteOnce();
+	result |= TestIO_OnInput_ThenFlushBeforeReading();
+	result |= TestIO_OnSpans_ThenReadAndWriteInPlace();
+
+	result |= TestCells_OnPrograms_ThenMatchInterpreter();
+	result |= TestCells_OnOverflow_ThenWrapAtCellWidth();
+
+	result |= TestBatch_OnManyInputs_ThenMatchEveryInput();
+	result |= TestBatch_OnFailingInputs_ThenReportOnlyThem();
+
+	result |= TestCompiled_OnSavedPrograms_ThenLoadSameContext();
+	result |= TestCompiled_OnDamagedFile_ThenReject();
+	result |= TestOpenCached_OnSecondOpen_ThenSkipOptimizer();
+
+	result |= TestRunFor_OnSmallSlices_ThenMatchRun();
+	result |= TestRunEngine_OnPendingInput_ThenResumeWhenReady();
+	result |= TestRunHot_OnPendingInput_ThenResumeWhenReady();
+	result |= TestScheduler_OnManySimulations_ThenRunEveryOne();
+
+	result |= TestTiered_OnPrograms_ThenMatchRun();
+
+	result |= TestSnapshot_OnForks_ThenEndLikeTheRun();
+	result |= TestSnapshot_OnSaveAndLoad_ThenForkSameState();
+
+	return result;
+}
@@ -1,6 +1,9 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <dirent.h>
 
 #include "bf.h"
 
@@ -10,12 +13,194 @@ FILE *EmulateStream(const char *content) {
 	FILE *file = tmpfile();
 
 	fputs(content, file);
-	fpos_t pos = 0;
-	fsetpos(file, &pos);
+	rewind(file);
 
 	return file;
 } 
 
+#pragma region Load
+
+int TestLoad_OnLongRunsAndComments_ThenAggregate(void) {
+	int result = 0;
+
+	// Longer than a vector, with the runs split by comments
+	const char *source = "comment ++++++++++++++++++++ more comment ++ [->>>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<<<] .";
+	BF_LoadError error;
+	BF_Context *ctx = BF_FromSource(source, strlen(source), &error);
+
+	ASSERT(ctx && error.code == BF_LOAD_OK);
+	ASSERT(ctx->length == 8);
+	ASSERT(ctx->instructions[0].type == BF_INC && ctx->instructions[0].operand1 == 22);
+	ASSERT(ctx->instructions[1].type == BF_LBL && ctx->instructions[1].operand1 == 6);
+	ASSERT(ctx->instructions[3].type == BF_MVR && ctx->instructions[3].operand1 == 18);
+	ASSERT(ctx->instructions[5].type == BF_MVL && ctx->instructions[5].operand1 == 18);
+	ASSERT(ctx->instructions[6].type == BF_RPT && ctx->instructions[6].operand1 == 1);
+	ASSERT(ctx->instructions[7].type == BF_PRT);
+cleanup:
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+int TestLoad_OnUnmatchedBrackets_ThenReportOffset(void) {
+	int result = 0;
+
+	BF_LoadError error;
+	BF_Context *ctx = BF_FromSource("+[[-]", 5, &error);
+	ASSERT(!ctx);
+	ASSERT(error.code == BF_LOAD_UNMATCHED_OPEN && error.offset == 1);
+
+	FILE *f = EmulateStream("+[-]  -]>");
+	ctx = BF_FromFile(f, &error);
+	fclose(f);
+	ASSERT(!ctx);
+	ASSERT(error.code == BF_LOAD_UNMATCHED_CLOSE && error.offset == 7);
+cleanup:
+	if (ctx) BF_FreeContext(ctx);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region CompactProgram
+
+int TestCompactProgram_OnErasedInstructions_ThenRelinkJumps(void) {
+	int result = 0;
+
+	BF_Instruction instructions[] = {
+		{ .type = BF_NOP },
+		{ .type = BF_LBL, .operand1 = 6 },
+		{ .type = BF_NOP },
+		{ .type = BF_WHILE, .operand1 = 5 },
+		{ .type = BF_INC, .operand1 = 1 },
+		{ .type = BF_WHILE_END, .operand1 = 3 },
+		{ .type = BF_RPT, .operand1 = 1 },
+		{ .type = BF_NOP },
+		{ .type = BF_PRT, .operand1 = 1 },
+	};
+	bool marks[9] = { false };
+	size_t length = sizeof instructions / sizeof instructions[0];
+
+	BF_CompactProgram(instructions, &length, marks);
+
+	ASSERT(length == 6);
+	ASSERT(instructions[0].type == BF_LBL && instructions[0].operand1 == 4);
+	ASSERT(instructions[1].type == BF_WHILE && instructions[1].operand1 == 3);
+	ASSERT(instructions[3].type == BF_WHILE_END && instructions[3].operand1 == 1);
+	ASSERT(instructions[4].type == BF_RPT && instructions[4].operand1 == 0);
+	ASSERT(instructions[5].type == BF_PRT);
+
+	// The instructions that follow an erased run are marked
+	ASSERT(marks[0] && marks[1] && !marks[2] && !marks[3] && !marks[4] && marks[5]);
+cleanup:
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Optimize
+
+#define SAMPLE_INPUT		"bb\nbc\nbd\n\n\nq\n"	// Read by the samples that take input, a few moves of conway
+#define SAMPLE_STEPS		20000000				// Of the unoptimized run, the optimized one does more in as many
+#define SAMPLE_OUTPUT		(1024 * 1024)
+
+typedef struct {
+	char *data;
+	size_t length;
+	const char *input;
+} SampleRun;
+
+static int64_t SampleWrite(void *handle, char *data, size_t length) {
+	SampleRun *run = handle;
+	size_t kept = SAMPLE_OUTPUT - run->length < length ? SAMPLE_OUTPUT - run->length : length;
+	memcpy(run->data + run->length, data, kept);
+	run->length += kept;
+
+	return length;
+}
+
+static int64_t SampleRead(void *handle, char *data, size_t length) {
+	SampleRun *run = handle;
+	size_t left = strlen(run->input);
+	if (left > length) left = length;
+
+	memcpy(data, run->input, left);
+	run->input += left;
+	return left;
+}
+
+// Runs the sample at the level, for the steps, false when it fails to load
+static bool RunSample(const char *path, uint8_t optimizationLevel, SampleRun *run, bool *ended, uint8_t *error) {
+	BF_Context *ctx = BF_Open(path, NULL);
+	if (!ctx) return false;
+	BF_Optimize(ctx, optimizationLevel);
+
+	*run = (SampleRun){ .data = malloc(SAMPLE_OUTPUT), .input = SAMPLE_INPUT };
+	BF_SimulationContext *sim = BF_CreateSimulation(ctx);
+	BF_SetIO(sim, &SampleRead, run, &SampleWrite, run, 0);
+	BF_RunFor(sim, SAMPLE_STEPS);
+	BF_FlushOutput(sim);
+
+	*ended = sim->state == BF_RUN_ENDED;
+	*error = sim->error;
+	BF_FreeSimulation(sim);
+	BF_FreeContext(ctx);
+	return true;
+}
+
+/*
+ * Every sample prints the same optimized as it does unoptimized. The samples that don't end in the steps
+ * are compared on the output they both got to.
+ */
+int TestOptimize_OnSamples_ThenMatchUnoptimized(void) {
+	int result = 0;
+	char path[512];
+	SampleRun expected = { 0 }, actual = { 0 };
+	const char *name = NULL;
+	uint8_t level = BF_OPT_NONE;
+
+	DIR *directory = opendir(BF_SAMPLES_DIR);
+	ASSERT(directory);
+
+	for(struct dirent *entry; (entry = readdir(directory));) {
+		size_t length = strlen(entry->d_name);
+		if (length < 3 || strcmp(entry->d_name + length - 3, ".bf")) continue;
+
+		name = entry->d_name;
+		snprintf(path, sizeof path, "%s/%s", BF_SAMPLES_DIR, name);
+
+		bool expectedEnded, actualEnded;
+		uint8_t expectedError, actualError;
+		level = BF_OPT_NONE;
+		ASSERT(RunSample(path, BF_OPT_NONE, &expected, &expectedEnded, &expectedError));
+
+		for(level = BF_OPT_MIN; level <= BF_OPT_MAX; ++level) {
+			ASSERT(RunSample(path, level, &actual, &actualEnded, &actualError));
+
+			if (expectedEnded) {
+				ASSERT(actualEnded && actualError == expectedError);
+				ASSERT(actual.length == expected.length);
+			}
+			size_t common = actual.length < expected.length ? actual.length : expected.length;
+			ASSERT(memcmp(actual.data, expected.data, common) == 0);
+
+			free(actual.data);
+			actual.data = NULL;
+		}
+
+		free(expected.data);
+		expected.data = NULL;
+	}
+cleanup:
+	if (result && name) printf("\tSample %s, optimization level %d\n", name, level);
+
+	if (directory) closedir(directory);
+	free(expected.data);
+	free(actual.data);
+	return result;
+}
+
+#pragma endregion
+
 #pragma region SumMotion
 
 int TestSumMotion_OnLinear_ThenCountMoves(void) {
@@ -23,7 +208,7 @@ int TestSumMotion_OnLinear_ThenCountMoves(void) {
 
 	FILE *f = EmulateStream(">>>.<++.>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -41,7 +226,7 @@ int TestSumMotion_OnMotionlessLoop_ThenCountMoves(void) {
 
 	FILE *f = EmulateStream(">>>.<[++].>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -59,7 +244,7 @@ int TestSumMotion_OnMotionInLoop_ThenUnpretictable(void) {
 
 	FILE *f = EmulateStream(">>>.<[+>>>+].>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -76,7 +261,7 @@ int TestSumMotion_OnMotionInNestedLoop_ThenUnpretictable(void) {
 
 	FILE *f = EmulateStream(">>>.<[+[>>>]+].>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -93,7 +278,7 @@ int TestSumMotion_OnMotionlessNestedLoop_ThenCountMoves(void) {
 
 	FILE *f = EmulateStream(">>>.<[+[>+.<]+].>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -112,7 +297,7 @@ int TestSumMotion_OnDualMotionlessNestedLoop_ThenCountMoves(void) {
 
 	FILE *f = EmulateStream(">>>.<[->+[>+.<]+[->+<]<].>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t motion = BF_SumMotion(ctx->instructions, 0, ctx->length, &unpredictable);
@@ -156,7 +341,7 @@ int TestCellDelta_WhenLinear_ThenComputeDelta(void) {
 
 	FILE *f = EmulateStream(">>+<-->+>+<<+>-<>");
 
-	BF_Context *ctx = BF_FromFile(f);
+	BF_Context *ctx = BF_FromFile(f, NULL);
 
 	bool unpredictable;
 	int32_t delta = BF_CellDelta(ctx->instructions, 2, 0, ctx->length, &unpredictable);
@@ -169,12 +354,54 @@ cleanup:
 	return result;
 }
 
+int TestCellDelta_WhenLoopTouchesCell_ThenUnpredictable(void) {
+	int result = 0;
+
+	FILE *f = EmulateStream(">>[-<+>]<<");
+
+	BF_Context *ctx = BF_FromFile(f, NULL);
+
+	bool unpredictable;
+	BF_CellDelta(ctx->instructions, 1, 0, ctx->length, &unpredictable);
+
+	ASSERT(unpredictable);
+cleanup:
+	fclose(f);
+	BF_FreeContext(ctx);
+	return result;
+}
+
+int TestCellDelta_WhenLoopIgnoresCell_ThenComputeDelta(void) {
+	int result = 0;
+
+	FILE *f = EmulateStream("+>[->>+<<]<-->>");
+
+	BF_Context *ctx = BF_FromFile(f, NULL);
+
+	bool unpredictable;
+	int32_t delta = BF_CellDelta(ctx->instructions, 0, 0, ctx->length, &unpredictable);
+
+	ASSERT(!unpredictable);
+	ASSERT(delta == -1);
+cleanup:
+	fclose(f);
+	BF_FreeContext(ctx);
+	return result;
+}
+
 #pragma endregion
 
 
 int main(void) {
 	int result = 0;
 
+	result |= TestLoad_OnLongRunsAndComments_ThenAggregate();
+	result |= TestLoad_OnUnmatchedBrackets_ThenReportOffset();
+
+	result |= TestCompactProgram_OnErasedInstructions_ThenRelinkJumps();
+
+	result |= TestOptimize_OnSamples_ThenMatchUnoptimized();
+
 	result |= TestSumMotion_OnLinear_ThenCountMoves();
 	result |= TestSumMotion_OnMotionlessLoop_ThenCountMoves();
 	result |= TestSumMotion_OnMotionInLoop_ThenUnpretictable();
@@ -184,6 +411,8 @@ int main(void) {
 	result |= TestSumMotion_OnWhileLoop_ThenCountMoves();
 
 	result |= TestCellDelta_WhenLinear_ThenComputeDelta();
+	result |= TestCellDelta_WhenLoopTouchesCell_ThenUnpredictable();
+	result |= TestCellDelta_WhenLoopIgnoresCell_ThenComputeDelta();
 
 	return result;
 }
\ No newline at end of file
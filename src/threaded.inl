@@ -0,0 +1,173 @@
+/*
+ * Body of the threaded engine, included by runner.c once for every memory model:
+ *	THREADED_NAME		Name of the generated function
+ *	THREADED_GUARDED	Cells are accessed without bounds checks, out of range accesses hit a guard page
+ *	CELL_TYPE			Unsigned type of a cell
+ * Like the interpreter, it goes on from ip, and stops on an input that is pending with ip on it.
+ */
+static uint64_t THREADED_NAME(BF_SimulationContext *sim) {
+	static const void *const HANDLERS[] = {
+		[BF_NOP] = &&L_NOP,
+		[__BF_AGGREGATABLE_START__] = &&L_NOP,
+		[BF_MVL] = &&L_MOVE,
+		[BF_MVR] = &&L_MOVE,
+		[BF_INC] = &&L_ADD,
+		[BF_DEC] = &&L_ADD,
+		[__BF_AGGREGATABLE_END__] = &&L_NOP,
+		[BF_PRT] = &&L_PRT,
+		[BF_INP] = &&L_INP,
+		[BF_LBL] = &&L_JZ,
+		[BF_RPT] = &&L_JNZ,
+		[__BF_EXTEND_OPSET__] = &&L_NOP,
+		[BF_ICL] = &&L_ADD,
+		[BF_DCL] = &&L_ADD,
+		[BF_ICR] = &&L_ADD,
+		[BF_DCR] = &&L_ADD,
+		[BF_SET] = &&L_SET,
+		[BF_STL] = &&L_SET,
+		[BF_STR] = &&L_SET,
+		[BF_WHILE] = &&L_WHILE,
+		[BF_WHILE_END] = &&L_WHILE_END,
+		[BF_MUL] = &&L_MUL,
+		[BF_SCANL] = &&L_SCAN,
+		[BF_SCANR] = &&L_SCAN,
+		[BF_WRITE] = &&L_WRITE,
+		[BF_FILL] = &&L_FILL,
+		[BF_COUNT] = &&L_COUNT,
+	};
+
+	if (sim->state == BF_RUN_ENDED) return 0;
+
+	ThreadedOp *const code = ThreadedDecode(sim->context, HANDLERS, &&L_END);
+
+	// Every instruction has its own op, so ip is where the run goes on from
+	const ThreadedOp *op = code + (sim->ip < sim->context->length ? sim->ip : sim->context->length);
+	size_t dp = sim->dp;
+	CELL_TYPE *memory = (CELL_TYPE *)sim->memory.buffer;
+	uint64_t steps = 0;
+	CELL_TYPE *cell, value;
+	uint32_t iterations;
+
+	sim->error = 0;
+	sim->state = BF_RUN_READY;
+
+#define DISPATCH(next)	do { op = (next); goto *op->handler; } while(0)
+#define NEXT()			DISPATCH(op + 1)
+
+#if THREADED_GUARDED
+	/*
+	 * Control instructions leave a checkpoint, so after a fault the straight line code that follows it can be
+	 * replayed (without side effects) to find the instruction that faulted, its dp and the steps count.
+	 */
+	ThreadedRecovery recovery = { .checkpoint = op, .dp = dp, .steps = 0 };
+	if (sigsetjmp(recovery.env, 1)) {
+		op = recovery.checkpoint;
+		dp = recovery.dp;
+		steps = recovery.steps;
+
+		int32_t shift = 0;
+		for(; op->handler != &&L_END; ++op) {
+			++steps;
+			if (op->handler == &&L_MOVE) dp += op->value;
+			else if (op->handler == &&L_MUL && dp >= sim->memory.length) break;	// Reads its own cell first
+			else if (op->handler == &&L_FILL && dp >= sim->memory.length) break;	// Checks its first cell first
+			else if (op->handler != &&L_NOP && (size_t)(dp + op->offset) >= sim->memory.length) {
+				shift = op->offset;
+				break;
+			}
+		}
+
+		// Let the common path report the error
+		sim->dp = dp;
+		sim->ip = op - code;
+		if (op->handler != &&L_END) MemReadOff(sim, shift);
+		sim->error = 1;
+		goto L_END;
+	}
+	BF_SetFaultRecovery(&ThreadedRecover, &recovery);
+
+#define CELL(off)		(memory + (ptrdiff_t)(dp + (off)))
+#define SlowCell(off)	(sim->dp = dp, sim->ip = op - code, cell = (CELL_TYPE *)MemReadOff(sim, (off)), \
+							memory = (CELL_TYPE *)sim->memory.buffer, cell)
+#define CHECK()
+#define JUMP(next)		do { op = (next); recovery.checkpoint = op, recovery.dp = dp, recovery.steps = steps; goto *op->handler; } while(0)
+#else
+	size_t length = sim->memory.length;
+
+#define CELL(off)		((size_t)(dp + (off)) < length ? &memory[dp + (off)] : SlowCell(off))
+	// Out of range accesses take the common path, which either grows the memory or raises an error
+#define SlowCell(off)	(sim->dp = dp, sim->ip = op - code, cell = (CELL_TYPE *)MemReadOff(sim, (off)), \
+							memory = (CELL_TYPE *)sim->memory.buffer, length = sim->memory.length, dp = sim->dp, cell)
+#define CHECK()			if (sim->error) goto L_END
+#define JUMP(next)		DISPATCH(next)
+#endif
+
+	DISPATCH(op);
+
+L_NOP:		++steps; NEXT();
+L_MOVE:		++steps; dp += op->value; NEXT();
+L_ADD:		++steps; cell = CELL(op->offset); CHECK(); *cell += op->value; NEXT();
+L_SET:		++steps; cell = CELL(op->offset); CHECK(); *cell = op->value; NEXT();
+L_PRT:		++steps; cell = CELL(op->offset); CHECK(); IOWrite(sim, *cell); NEXT();
+L_INP:		++steps; cell = CELL(op->offset); CHECK(); IORead(sim, cell, goto L_WAIT); NEXT();
+L_JZ:		++steps; cell = CELL(0); CHECK(); if (!*cell) JUMP(code + op->target); JUMP(op + 1);
+L_JNZ:		++steps; cell = CELL(0); CHECK(); if (*cell) JUMP(code + op->target); JUMP(op + 1);
+L_WHILE:	++steps; cell = CELL(0); CHECK(); if (!*cell) JUMP(code + op->target); --*cell; JUMP(op + 1);
+L_WHILE_END:++steps; cell = CELL(0); CHECK(); if (*cell) JUMP(code + op->target); JUMP(op + 1);
+// The scan leaves dp somewhere unknown, so it ends the replayable straight line code like a jump does
+L_SCAN:		++steps;
+			for(;;) {
+				dp = ScanCells((const char *)memory, sim->memory.length, dp, op->value, sizeof(CELL_TYPE));
+				if (dp < sim->memory.length) break;
+
+				SlowCell(0);	// On a paged memory, the scan goes on in the page it moved to
+				if (sim->error) goto L_END;
+			}
+			JUMP(op + 1);
+// The target isn't touched by a loop that isn't entered, so a skipped MUL leaves a checkpoint past it
+L_MUL:		++steps; cell = CELL(0); CHECK(); value = *cell; if (!value) JUMP(op + 1);
+			cell = CELL(op->offset); CHECK(); *cell += (uint32_t)value * (uint32_t)op->value; NEXT();
+L_COUNT:	++steps; cell = CELL(0); CHECK();
+			if (!BF_CountIterations(*cell, op->value, sizeof(CELL_TYPE), &iterations)) JUMP(op);	// Forever, like the loop
+			*cell = iterations;
+			NEXT();
+L_WRITE:	++steps; BF_WriteOutput(sim, sim->context->data[op->value].bytes, sim->context->data[op->value].length); NEXT();
+// Touches both ends of the cells (on guarded memory too) before copying, so only the checks can fault
+L_FILL:		++steps;
+			cell = CELL(0); CHECK(); value = *(volatile CELL_TYPE *)cell;
+			cell = CELL(op->offset); CHECK(); value = *(volatile CELL_TYPE *)cell;
+#if !THREADED_GUARDED
+			if (dp >= length || (size_t)(dp + op->offset) >= length) {	// Across pages
+				sim->dp = dp;
+				MemFill(sim, &sim->context->data[op->value], sizeof(CELL_TYPE));
+				memory = (CELL_TYPE *)sim->memory.buffer, length = sim->memory.length, dp = sim->dp;
+				CHECK();
+				NEXT();
+			}
+#endif
+			memcpy(memory + dp, sim->context->data[op->value].bytes, sim->context->data[op->value].length);
+			NEXT();
+
+// The input is read again when the run goes on, so it isn't counted yet
+L_WAIT:		--steps;
+			sim->state = BF_RUN_WAITING;
+
+L_END:
+#if THREADED_GUARDED
+	BF_SetFaultRecovery(NULL, NULL);
+#endif
+#undef SlowCell
+#undef JUMP
+#undef CHECK
+#undef CELL
+#undef NEXT
+#undef DISPATCH
+
+	if (sim->state != BF_RUN_WAITING) sim->state = BF_RUN_ENDED;
+	sim->dp = dp;
+	sim->ip = op - code + (sim->error ? 1 : 0);	// Same resting point as BF_Run
+	free(code);
+
+	BF_FlushOutput(sim);
+	return steps;
+}
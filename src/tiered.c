@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BF_TIERED_THREADED	1
+#include <pthread.h>
+#endif
+
+#define TIER_SLICE		(1 << 16)		// Steps run between the checks for the optimized program
+#define NO_HEAD			SIZE_MAX
+
+/*
+ * Tiered execution. The optimized program is only equivalent to the original at the points the optimizer
+ * keeps, and the ones every pass keeps are the loops that stay loops: they still start with an opener at the
+ * byte of the source their [ is at, and dp and the memory are whole before it (a move is never deferred into
+ * a loop, and known cells are written before a loop that runs).
+ *
+ * The original program can move to such an opener from its own opener, and from the start of an iteration
+ * of it (LBL + 1), since the cell is not 0 there and the opener of the copy goes into the body for it, the
+ * same as the LBL did. Openers that the optimizer copied (while unrolling around them) are not moved to.
+ */
+
+typedef struct {
+	BF_Context *ctx;
+	uint8_t level;
+
+#if BF_TIERED_THREADED
+	pthread_mutex_t lock;
+	bool done;
+	bool abandoned;		// The run ended first, the optimizer frees everything once it's done
+#endif
+} Tier;
+
+static BF_Context *CopyContext(const BF_Context *ctx) {
+	BF_Context *copy = malloc(sizeof(BF_Context));
+	*copy = (BF_Context){ .length = ctx->length, .dataLength = ctx->dataLength, .cellSize = ctx->cellSize };
+
+	copy->instructions = malloc((ctx->length + 1) * sizeof(BF_Instruction));
+	memcpy(copy->instructions, ctx->instructions, ctx->length * sizeof(BF_Instruction));
+
+	copy->data = malloc((ctx->dataLength + 1) * sizeof(BF_Data));
+	for(size_t i = 0; i < ctx->dataLength; ++i) {
+		copy->data[i] = (BF_Data){ .bytes = malloc(ctx->data[i].length + 1), .length = ctx->data[i].length };
+		memcpy(copy->data[i].bytes, ctx->data[i].bytes, ctx->data[i].length);
+	}
+
+	return copy;
+}
+
+static bool IsOpener(BF_Operation type) {
+	return type == BF_LBL || type == BF_WHILE;
+}
+
+static int ComparePositions(const void *a, const void *b) {
+	uint32_t first = ((const BF_Instruction *)a)->position, second = ((const BF_Instruction *)b)->position;
+	return first < second ? -1 : first > second;
+}
+
+// Index in the optimized program to go on from, for every ip of the original (NO_HEAD where it can't move)
+static size_t *MapLoopHeads(const BF_Context *original, const BF_Context *optimized) {
+	// The openers of the optimized program by position, with the index in operand1
+	BF_Instruction *openers = malloc((optimized->length + 1) * sizeof(BF_Instruction));
+	size_t count = 0;
+	for(size_t i = 0; i < optimized->length; ++i) {
+		if (IsOpener(optimized->instructions[i].type))
+			openers[count++] = (BF_Instruction){ .operand1 = i, .position = optimized->instructions[i].position };
+	}
+	qsort(openers, count, sizeof(BF_Instruction), &ComparePositions);
+
+	size_t *heads = malloc((original->length + 1) * sizeof(size_t));
+	for(size_t i = 0; i <= original->length; ++i) heads[i] = NO_HEAD;
+
+	// The starts of the iterations first, the openers themselves win where both are the same ip ([[)
+	for(int pass = 0; pass < 2; ++pass) {
+		for(size_t i = 0; i < original->length; ++i) {
+			const BF_Instruction *instruction = &original->instructions[i];
+			if (!IsOpener(instruction->type) || (pass == 0 && instruction->type != BF_LBL)) continue;
+
+			BF_Instruction key = { .position = instruction->position };
+			const BF_Instruction *found = bsearch(&key, openers, count, sizeof(BF_Instruction), &ComparePositions);
+			if (!found) continue;
+
+			// Copies of the opener are next to it
+			bool unique = (found == openers || found[-1].position != key.position) &&
+				(found + 1 == openers + count || found[1].position != key.position);
+			if (unique) heads[pass == 0 ? i + 1 : i] = found->operand1;
+		}
+	}
+
+	free(openers);
+	return heads;
+}
+
+// Steps to the next loop head and moves the simulation to the optimized program there
+static uint64_t MoveToTier(BF_SimulationContext *sim, BF_Context *optimized) {
+	size_t *heads = MapLoopHeads(sim->context, optimized);
+	uint64_t steps = 0;
+
+	while (sim->state == BF_RUN_READY && heads[sim->ip < sim->context->length ? sim->ip : sim->context->length] == NO_HEAD)
+		steps += BF_RunFor(sim, 1);
+
+	if (sim->state == BF_RUN_READY) {
+		sim->ip = heads[sim->ip];
+		sim->context = sim->tiered = optimized;
+
+		if (sim->packed) BF_FreePacked(sim->packed);
+		sim->packed = NULL;
+	} else {
+		BF_FreeContext(optimized);
+	}
+
+	free(heads);
+	return steps;
+}
+
+#if BF_TIERED_THREADED
+
+static bool IsDone(Tier *tier) {
+	pthread_mutex_lock(&tier->lock);
+	bool done = tier->done;
+	pthread_mutex_unlock(&tier->lock);
+
+	return done;
+}
+
+static void FreeTier(Tier *tier) {
+	pthread_mutex_destroy(&tier->lock);
+	free(tier);
+}
+
+static void *OptimizerMain(void *argument) {
+	Tier *tier = argument;
+	BF_Optimize(tier->ctx, tier->level);
+
+	pthread_mutex_lock(&tier->lock);
+	tier->done = true;
+	bool abandoned = tier->abandoned;
+	pthread_mutex_unlock(&tier->lock);
+
+	if (abandoned) {
+		BF_FreeContext(tier->ctx);
+		FreeTier(tier);
+	}
+	return NULL;
+}
+
+uint64_t BF_RunTiered(BF_SimulationContext *sim, uint8_t optimizationLevel) {
+	if (sim->tiered || sim->state == BF_RUN_ENDED) return BF_RunFor(sim, UINT64_MAX);	// Already moved
+
+	Tier *tier = calloc(1, sizeof(Tier));
+	tier->ctx = CopyContext(sim->context);
+	tier->level = optimizationLevel;
+	pthread_mutex_init(&tier->lock, NULL);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, &OptimizerMain, tier)) {
+		BF_Optimize(tier->ctx, optimizationLevel);
+		tier->done = true;
+	} else {
+		pthread_detach(thread);
+	}
+
+	uint64_t steps = 0;
+	while (sim->state == BF_RUN_READY && !IsDone(tier)) steps += BF_RunFor(sim, TIER_SLICE);
+
+	// Ended (or waits for input) before the optimizer did, which is left to clean up after itself
+	pthread_mutex_lock(&tier->lock);
+	bool done = tier->done;
+	tier->abandoned = !done;
+	pthread_mutex_unlock(&tier->lock);
+	if (!done) return steps;
+
+	BF_Context *optimized = tier->ctx;
+	FreeTier(tier);
+
+	if (sim->state != BF_RUN_READY) {
+		BF_FreeContext(optimized);
+		return steps;
+	}
+
+	steps += MoveToTier(sim, optimized);
+	return steps + BF_RunFor(sim, UINT64_MAX);
+}
+
+#else
+
+// Without threads, the program is optimized first and moved to at its first loop
+uint64_t BF_RunTiered(BF_SimulationContext *sim, uint8_t optimizationLevel) {
+	if (sim->tiered || sim->state == BF_RUN_ENDED) return BF_RunFor(sim, UINT64_MAX);	// Already moved
+
+	BF_Context *optimized = CopyContext(sim->context);
+	BF_Optimize(optimized, optimizationLevel);
+
+	uint64_t steps = MoveToTier(sim, optimized);
+	return steps + BF_RunFor(sim, UINT64_MAX);
+}
+
+#endif
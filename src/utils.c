@@ -1,58 +1,62 @@
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 #include "bf.h"
 
 
 void BF_FlattenProgram(BF_Instruction *a, size_t *len) {
+	BF_CompactProgram(a, len, NULL);
+}
+
+/*
+ * Removes every NOP in a single pass, and then relinks the jumps through a table of the new index of
+ * every old instruction (an erased instruction maps to the one that replaces it).
+ */
+void BF_CompactProgram(BF_Instruction *a, size_t *len, bool *marks) {
 	static const BF_Operation CLOSERS[]  = { BF_RPT, BF_WHILE_END };
 	static const BF_Operation STARTERS[] = { BF_LBL, BF_WHILE };
+	static const char *const ERRORS[]    = { "Unmatched jnz\n", "Unmatched while closer\n" };
 
 	static const size_t COUNT = sizeof(CLOSERS) / sizeof(CLOSERS[0]); 
-	
-	for(size_t i = 0; i < *len; ++i) {
-		size_t start = i;
-		for(;i < *len && a[i].type == BF_NOP; ++i);
-
-		if(i - start > 0) {
-			size_t trimSize = i - start;
-			for(int j = 0; j < *len - i; ++j) {
-				a[start + j].operand1 = a[i + j].operand1;
-				a[start + j].operand2 = a[i + j].operand2;
-				a[start + j].type = a[i + j].type;
-
-				uint32_t target = a[start + j].operand1;;
-				switch(a[start + j].type) {
-				case BF_RPT:
-					if (target >= i) target -= trimSize;
-					
-					if (a[target].type == BF_LBL)
-						a[target].operand1 = start + j;
-					else printf("Unmatched jnz\n");
-					
-					a[start + j].operand1 = target;
-					break;
-				case BF_WHILE_END:
-					if (target >= i) target -= trimSize;
 
-					if(a[target].type != BF_WHILE) {
-						printf("Unmatched while closer\n");
-						continue;
-					} // We have an error!
+	size_t length = *len, kept = 0;
+	uint32_t *index = malloc((length + 1) * sizeof(uint32_t));
 
-					a[start + j].operand1 = target;
-					a[target].operand1 = start + j;
-					break;
+	bool erased = false;
+	for(size_t i = 0; i < length; ++i) {
+		index[i] = kept;
+		if (a[i].type == BF_NOP) {
+			erased = true;
+			continue;
+		}
 
-				default: continue;
-				}
+		a[kept] = a[i];
+		if (marks) marks[kept] = marks[i] || erased;	// Its neighbourhood changed
+		erased = false;
+		++kept;
+	}
+	index[length] = kept;
+
+	for(size_t j = 0; j < kept; ++j) {
+		for(size_t k = 0; k < COUNT; ++k) {
+			if (a[j].type == STARTERS[k] && a[j].operand1 < length) a[j].operand1 = index[a[j].operand1];
+			if (a[j].type != CLOSERS[k]) continue;
+
+			uint32_t target = a[j].operand1 < length ? index[a[j].operand1] : a[j].operand1;
+			if (target >= kept || a[target].type != STARTERS[k]) {
+				printf("%s", ERRORS[k]);
+				continue;
 			}
-			
-			*len -= trimSize;
-			
-			i = start; // To rescan area
+
+			a[j].operand1 = target;
+			a[target].operand1 = j;
 		}
 	}
+
+	free(index);
+	*len = kept;
 }
 
 void BF_PassiveErase(BF_Instruction *start, size_t len) {
@@ -63,6 +67,8 @@ void BF_PassiveErase(BF_Instruction *start, size_t len) {
 	}
 }
 
+static int32_t LinearMotion(BF_Instruction *origin, size_t *i, size_t len, bool *unpredictable);
+
 static int32_t JumpingMotion(BF_Instruction *origin, size_t *i, size_t len, bool *unpredictable) {
 	uint32_t end = origin[*i].operand1;
 	uint32_t range = end - *i;
@@ -91,6 +97,7 @@ static int32_t LinearMotion(BF_Instruction *origin, size_t *i, size_t len, bool
 			case BF_WHILE:	// While has shift of 0, we can skip everything inside the while loop
 				*i = origin[*i].operand1;
 				break;
+			case BF_SCANL: case BF_SCANR: *unpredictable = true; break;
 
 			default: continue;
 		}
@@ -121,24 +128,34 @@ static int32_t LinearDelta(BF_Instruction *origin, int64_t index, size_t *i, siz
 			case BF_DCL: if (dp - origin[*i].operand2 == index) cell -= origin[*i].operand1; break;
 			case BF_DCR: if (dp + origin[*i].operand2 == index) cell -= origin[*i].operand1; break;
 
-			case BF_SET: if (dp == index) cell = origin[*i].operand1;
-			case BF_STL: if (dp - origin[*i].operand2 == index) cell = origin[*i].operand1;
-			case BF_STR: if (dp + origin[*i].operand2 == index) cell = origin[*i].operand1;
-
-			case BF_INP: if(dp == index) *unpredictable = true; break;		// If we an input segment on the targeted cell, we cant compute its delta
-
-			case BF_LBL: 
-				motion = JumpingMotion(origin, i, len, unpredictable); 
-				if (motion != 0 || *unpredictable) {
+			// A set or a multiplication makes the value of the cell independent of its starting value
+			case BF_SET: if (dp == index) *unpredictable = true; break;
+			case BF_STL: if (dp - origin[*i].operand2 == index) *unpredictable = true; break;
+			case BF_STR: if (dp + origin[*i].operand2 == index) *unpredictable = true; break;
+			case BF_MUL: if (dp + (int32_t)origin[*i].operand2 == index) *unpredictable = true; break;
+			case BF_COUNT: if (dp == index) *unpredictable = true; break;
+
+			case BF_INP: if(dp + (int32_t)origin[*i].operand2 == index) *unpredictable = true; break;		// If we an input segment on the targeted cell, we cant compute its delta
+			case BF_SCANL: case BF_SCANR: *unpredictable = true; break;		// We lose track of which cell is the targeted one
+
+			case BF_LBL: {
+				// A loop runs an unknown amount of times, it must not touch the cell at all
+				size_t body = *i + 1, end = origin[*i].operand1;
+				motion = JumpingMotion(origin, i, len, unpredictable);
+				if (motion != 0 || *unpredictable || dp == index) {
 					*unpredictable = true;
 					break;
 				}
-				cell += LinearDelta(origin, cell - dp ,i, origin[*i].operand1, unpredictable);
+
+				if (LinearDelta(origin, index - dp, &body, end, unpredictable) != 0) *unpredictable = true;
 				break;
-			case BF_WHILE:	// While acts like SET 0, we can skip everything inside the while loop
-				*i = origin[*i].operand1;
-				if (dp == index) cell = 0;
+			}
+			case BF_WHILE: {	// While ends with its cell at 0, and must not touch the cell anywhere else
+				size_t body = *i + 1, end = origin[*i].operand1;
+				if (dp == index || LinearDelta(origin, index - dp, &body, end, unpredictable) != 0) *unpredictable = true;
+				*i = end;
 				break;
+			}
 
 			default: continue;
 		}
@@ -147,9 +164,40 @@ static int32_t LinearDelta(BF_Instruction *origin, int64_t index, size_t *i, siz
 	return cell;
 }
 
-int32_t BF_CellDelta(BF_Instruction *origin, size_t cell, size_t start, size_t len, bool *unpredictable) {
+int32_t BF_CellDelta(BF_Instruction *origin, int64_t cell, size_t start, size_t len, bool *unpredictable) {
 	size_t i = start;
 
 	*unpredictable = false;
 	return LinearDelta(origin, cell, &i, len, unpredictable);
-}
\ No newline at end of file
+}
+
+uint32_t BF_InverseOf(uint32_t value) {
+	// Right in the low 3 bits for every odd value, and every step doubles the bits that are right
+	uint32_t inverse = value;
+	for(int i = 0; i < 4; ++i) inverse *= 2 - value * inverse;
+
+	return inverse;
+}
+
+/*
+ * Iterations of a loop that adds step to its cell until it's 0, mod the cell size. With step = 2^k * odd, the cell
+ * only gets there if it's a multiple of 2^k too, and then after -(cell / 2^k) / odd iterations mod 2^(bits - k).
+ */
+bool BF_CountIterations(uint32_t cell, uint32_t step, uint8_t cellSize, uint32_t *iterations) {
+	uint32_t mask = BF_CELL_MASK(cellSize);
+	cell &= mask;
+	step &= mask;
+
+	if (!cell) {
+		*iterations = 0;
+		return true;
+	}
+	if (!step) return false;
+
+	for(; !(step & 1); step >>= 1, cell >>= 1, mask >>= 1) {
+		if (cell & 1) return false;
+	}
+
+	*iterations = -cell * BF_InverseOf(step) & mask;
+	return true;
+}